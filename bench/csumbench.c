@@ -0,0 +1,296 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * What the metadata checksums cost
+ * - kfs_crc32c(), with the crc32 instruction if there is one, and the
+ *   table one are timed on buffers of the sizes of a gde, an inode and
+ *   a bitmap block.
+ * - Then an image with a few data groups is made and mounted, and each
+ *   round every bitmap and inode is dirtied and kfs_sync_fs() is run.
+ *   The CPU time of the rounds, all threads, is printed next to the
+ *   time of the crcs they compute.
+ */
+
+#include <kfs.h>
+
+static char *pname = NULL;
+
+int csumbench_usage()
+{
+    printf("usage: %s\n", pname);
+    printf("options:\n");
+    printf("    -f|--file filename     image to create, removed at the end\n");
+    printf("    -n|--groups            data groups (default 64)\n");
+    printf("    -i|--inodes            inodes (default 1024)\n");
+    printf("    -r|--rounds            sync rounds (default 16)\n");
+    printf("    -m|--mmap_meta         mount with mmap_meta\n");
+    return 1;
+}
+
+static struct option kfs_csumbench_opts[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "file", required_argument, NULL, 'f' },
+    { "groups", required_argument, NULL, 'n' },
+    { "inodes", required_argument, NULL, 'i' },
+    { "rounds", required_argument, NULL, 'r' },
+    { "mmap_meta", no_argument, NULL, 'm' },
+    { NULL, no_argument, NULL, 0 }
+};
+
+#define CSUMBENCH_BYTES (256ULL << 20)  /* Hashed per size */
+
+static char file[256] = "/tmp/csumbench.kfs";
+static u32 groups = 64;
+static u32 inodes = 1024;
+static u32 rounds = 16;
+static u32 mnt_flags = 0;
+
+static u64 csumbench_now(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return ((u64)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void csumbench_free_bgs(struct kfs *fs)
+{
+    struct kfs_bg *bg, *n;
+
+    list_for_each_entry_safe(bg, n, &fs->ibgs, link) {
+        list_del(&bg->link);
+        kfs_free_bg(bg);
+    }
+    list_for_each_entry_safe(bg, n, &fs->dbgs, link) {
+        list_del(&bg->link);
+        kfs_free_bg(bg);
+    }
+}
+
+static void csumbench_speed(size_t size)
+{
+    u32 (*fn[2])(u32, const void *, size_t) = { kfs_crc32c, kfs_crc32c_soft };
+    double mbs[2];
+    u64 t0, i, loops = CSUMBENCH_BYTES / size;
+    u32 crc = 0;
+    u8 *buf;
+    int k;
+
+    buf = kfs_alloc(MEM_NORMAL, size);
+    if (!buf) {
+        return;
+    }
+    for (i = 0; i < size; i++) {
+        buf[i] = random();
+    }
+
+    for (k = 0; k < 2; k++) {
+        t0 = csumbench_now(CLOCK_MONOTONIC);
+        for (i = 0; i < loops; i++) {
+            crc = fn[k](crc, buf, size);
+        }
+        t0 = csumbench_now(CLOCK_MONOTONIC) - t0;
+        mbs[k] = (double)(loops * size) * 1000.0 / t0;
+    }
+
+    printf("%8zu %12.0f %12.0f %10.1f (%08x)\n", size, mbs[0], mbs[1],
+            (size * 1000.0) / mbs[0], crc);
+    kfs_free(MEM_NORMAL, buf);
+}
+
+/* An image with one inode group and groups data groups */
+static int csumbench_mkimg(void)
+{
+    struct kfs fs;
+    u32 i;
+    int ret;
+
+    kfs_init(&fs);
+    fs.fd = open(file, O_CREAT|O_TRUNC|O_RDWR|O_NOFOLLOW, 0644);
+    if (fs.fd < 0) {
+        kerr("Open file %s failed: %s\n", file, strerror(errno));
+        return -errno;
+    }
+
+    ret = ftruncate(fs.fd, KFS_SB_SIZE);
+    if (ret < 0) {
+        kerr("Generate superblock failed: %s\n", strerror(errno));
+        ret = -errno;
+        goto out;
+    }
+
+    fs.sb->magic = KFS_SB_MAGIC;
+    fs.sb->version = KFS_SB_VERSION;
+    fs.sb->ibg_size = DEFAULT_IBG_SIZE;
+    fs.sb->dbg_size = MIN_BBG_SIZE;
+    fs.filesize = KFS_SB_SIZE;
+    fs.inode_per_bg = kfs_ibg_size(&fs) / KFS_INODE_SIZE;
+    fs.block_per_bg = kfs_dbg_size(&fs) / KFS_BLOCK_SIZE;
+
+    ret = kfs_create_gdt(&fs, (groups / KFS_GDE_PER_BLOCK) + 1);
+    if (ret) {
+        goto out;
+    }
+    ret = kfs_extend_bg(&fs, KFS_BG_INODE);
+    for (i = 0; !ret && (i < groups); i++) {
+        ret = kfs_extend_bg(&fs, KFS_BG_DATA);
+    }
+    if (!ret) {
+        ret = kfs_sync_fs(&fs);
+    }
+
+  out:
+    csumbench_free_bgs(&fs);
+    kfs_free_gdt(&fs);
+    close(fs.fd);
+    return ret;
+}
+
+/* The crcs a sync round computes, done again */
+static u32 csumbench_crcs(struct kfs *fs, struct kfs_inode **inode)
+{
+    struct kfs_bg *bg;
+    u32 crc = 0, i;
+
+    crc ^= kfs_meta_csum(fs->sb, sizeof(*fs->sb), offsetof(struct kfs_sb, csum));
+    list_for_each_entry(bg, &fs->dbgs, link) {
+        crc ^= kfs_crc32c(0, bg->bitmap, sizeof(struct kfs_bitmap));
+        crc ^= kfs_meta_csum(&fs->gdt[bg->slot], sizeof(struct kfs_gde),
+                offsetof(struct kfs_gde, csum));
+    }
+    for (i = 0; i < inodes; i++) {
+        crc ^= kfs_meta_csum(inode[i]->node, sizeof(struct kfs_node),
+                offsetof(struct kfs_node, csum));
+    }
+    return crc;
+}
+
+static int csumbench_run(void)
+{
+    struct kfs fs;
+    struct kfs_bg *bg;
+    struct kfs_inode **inode;
+    u64 t0, sync = 0, csum = 0, bno;
+    u32 i, r, crc = 0;
+    int ret;
+
+    ret = csumbench_mkimg();
+    if (ret) {
+        kerr("Make image of %u groups failed %d\n", groups, ret);
+        return ret;
+    }
+
+    inode = kfs_alloc(MEM_NORMAL, inodes * sizeof(*inode));
+    if (!inode) {
+        return -ENOMEM;
+    }
+
+    kfs_init(&fs);
+    fs.mntopt.flags |= mnt_flags;
+    ret = kfs_open_fs(&fs, file);
+    if (ret) {
+        kerr("Mount image of %u groups failed %d\n", groups, ret);
+        goto out_free;
+    }
+    for (i = 0; !ret && (i < inodes); i++) {
+        ret = kfs_alloc_inode(&fs, &inode[i]);
+    }
+    if (!ret) {
+        ret = kfs_sync_fs(&fs);
+    }
+
+    for (r = 0; !ret && (r < rounds); r++) {
+        /* Every bitmap and inode dirty, all are written by one sync */
+        list_for_each_entry(bg, &fs.dbgs, link) {
+            lock_bg(bg);
+            if (!ret) {
+                ret = kfs_alloc_block_bg(bg, &bno);
+            }
+            unlock_bg(bg);
+        }
+        for (i = 0; !ret && (i < inodes); i++) {
+            kfs_lock_inode(inode[i]);
+            inode[i]->node->mtime = r;
+            mark_inode_dirty(inode[i]);
+            kfs_unlock_inode(inode[i]);
+        }
+        if (ret) {
+            break;
+        }
+
+        t0 = csumbench_now(CLOCK_PROCESS_CPUTIME_ID);
+        ret = kfs_sync_fs(&fs);
+        sync += csumbench_now(CLOCK_PROCESS_CPUTIME_ID) - t0;
+
+        t0 = csumbench_now(CLOCK_PROCESS_CPUTIME_ID);
+        crc ^= csumbench_crcs(&fs, inode);
+        csum += csumbench_now(CLOCK_PROCESS_CPUTIME_ID) - t0;
+    }
+    if (ret) {
+        kerr("Dirty and sync the metadata failed %d\n", ret);
+    } else {
+        printf("%8u %8u %8u %12.3f %12.3f %8.2f%% (%08x)\n", groups, inodes,
+                rounds, sync / 1000000.0, csum / 1000000.0,
+                sync ? (csum * 100.0) / sync : 0, crc);
+    }
+
+    kfs_close_fs(&fs);
+    csumbench_free_bgs(&fs);
+  out_free:
+    kfs_free(MEM_NORMAL, inode);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    char *p;
+    int c, ret;
+
+    pname = argv[0];
+    if ((p = strrchr(pname, '/')) != NULL)
+        pname = p+1;
+
+    while ((c = getopt_long(argc, argv, "hf:n:i:r:m", kfs_csumbench_opts, NULL)) != -1) {
+        switch (c) {
+            case 'f':
+                snprintf(file, 256, "%s", optarg);
+                break;
+            case 'n':
+                groups = atoi(optarg);
+                break;
+            case 'i':
+                inodes = atoi(optarg);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 'm':
+                mnt_flags |= KFS_MNT_MMAP;
+                break;
+            default:
+                return csumbench_usage();
+        }
+    }
+
+    if (!groups || !inodes) {
+        kerr("Invalid groups or inodes\n");
+        return 1;
+    }
+
+    printf("%8s %12s %12s %10s\n", "size", "crc32c(MB/s)", "tables(MB/s)", "ns/call");
+    csumbench_speed(sizeof(struct kfs_gde));
+    csumbench_speed(sizeof(struct kfs_node));
+    csumbench_speed(sizeof(struct kfs_bitmap));
+
+    printf("%8s %8s %8s %12s %12s %9s\n", "groups", "inodes", "rounds",
+            "sync(ms)", "csum(ms)", "csum/sync");
+    ret = csumbench_run();
+
+    remove(file);
+    return ret ? 1 : 0;
+}
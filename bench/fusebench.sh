@@ -0,0 +1,200 @@
+#!/bin/bash
+# vim: set expandtab ts=4 sw=4:
+
+#-=============================================================-#
+#  Author:                                                      #
+#        KevinKW                                                #
+#-=============================================================-#
+
+#
+# CPU the kfs daemons take per op, on a host with libfuse and /dev/fuse
+# - An image is made with mkfs and mounted with fuse/kfs, the high level
+#   path based frontend, then with fuse/kfs_ll, the low level one keyed
+#   by kfs_inode.
+# - meta: files are created, stat'ed and removed in a directory depth
+#   levels down, where the path lookups of the high level lib add up.
+#   The CPU of the daemon, utime+stime of all its threads, per file is
+#   printed for each step.
+# - io: a file is written and read back with dd bs=1M, the CPU of the
+#   daemon per GB is printed. Once with splice, where read_buf/write_buf
+#   hand the image ranges to libfuse, once with -o no_splice_* where
+#   libfuse copies them through its buffers.
+# - Everything outside the daemon, xargs and the kernel, is not counted.
+#
+
+pname=${0##*/}
+bdir=$(cd "$(dirname "$0")" && pwd)
+
+MKFS=${MKFS:-$bdir/../mkfs/mkfs}
+KFS=${KFS:-$bdir/../fuse/kfs}
+KFS_LL=${KFS_LL:-$bdir/../fuse/kfs_ll}
+FUSERMOUNT=${FUSERMOUNT:-fusermount}
+
+dir=/tmp/fusebench
+files=10000
+depth=8
+mb=1024
+fuseopts=
+
+usage()
+{
+    echo "usage: $pname"
+    echo "options:"
+    echo "    -d dir          where the image and the mount point go (default $dir)"
+    echo "    -n files        files of the meta steps (default $files)"
+    echo "    -l depth        directory levels above them (default $depth)"
+    echo "    -m MB           size of the io file (default $mb)"
+    echo "                    -n 0 or -m 0 skips the meta or the io steps"
+    echo "    -o options      more mount options for both frontends"
+    exit 1
+}
+
+while getopts "hd:n:l:m:o:" c; do
+    case $c in
+        d) dir=$OPTARG ;;
+        n) files=$OPTARG ;;
+        l) depth=$OPTARG ;;
+        m) mb=$OPTARG ;;
+        o) fuseopts=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+img=$dir/fusebench.kfs
+mnt=$dir/mnt
+hz=$(getconf CLK_TCK)
+pid=
+
+for bin in "$MKFS" "$KFS" "$KFS_LL"; do
+    if [ ! -x "$bin" ]; then
+        echo "$bin not built, make mkfs and fuse first"
+        exit 1
+    fi
+done
+
+kfs_umount()
+{
+    [ -n "$pid" ] || return 0
+    $FUSERMOUNT -u "$mnt"
+    while kill -0 "$pid" 2>/dev/null; do
+        sleep 0.1
+    done
+    pid=
+}
+
+trap kfs_umount EXIT
+
+# Mount a new image with $1 and mount options $2, $pid is the daemon
+kfs_mount()
+{
+    local bin=$1 opts=${fuseopts}${fuseopts:+${2:+,}}$2 i
+
+    rm -f "$img"
+    "$MKFS" -f "$img" >/dev/null || return 1
+    "$bin" -f "$img" "$mnt" ${opts:+-o "$opts"} || return 1
+    for i in $(seq 50); do
+        grep -q " $mnt fuse" /proc/mounts && break
+        sleep 0.1
+    done
+    pid=$(pgrep -n -f -- "$bin -f $img $mnt")
+    if [ -z "$pid" ]; then
+        echo "$bin didn't mount $img"
+        return 1
+    fi
+}
+
+# utime+stime of the daemon in ticks
+kfs_cpu()
+{
+    awk '{ print $14 + $15 }' "/proc/$pid/stat"
+}
+
+# Run "$@" as step $1 of $2 ops, print the daemon CPU in $4 per op times $3
+kfs_step()
+{
+    local name=$1 ops=$2 scale=$3 unit=$4 t0 t1
+    shift 4
+
+    t0=$(kfs_cpu)
+    "$@" || return 1
+    t1=$(kfs_cpu)
+    awk -v fe="$fe" -v name="$name" -v ops="$ops" -v t="$((t1 - t0))" \
+        -v hz="$hz" -v scale="$scale" -v unit="$unit" \
+        'BEGIN { printf "%-8s %-14s %8u %12.2f %s\n", fe, name, ops, t * scale / hz / ops, unit }'
+}
+
+meta_names()
+{
+    seq -f "f%.0f" "$files"
+}
+
+meta_create()
+{
+    (cd "$leaf" && meta_names | xargs touch)
+}
+
+meta_stat()
+{
+    (cd "$leaf" && meta_names | xargs stat -c %s >/dev/null)
+}
+
+meta_unlink()
+{
+    (cd "$leaf" && meta_names | xargs rm -f)
+}
+
+bench_meta()
+{
+    local i
+
+    leaf=$mnt
+    for i in $(seq "$depth"); do
+        leaf=$leaf/d$i
+    done
+    mkdir -p "$leaf" || return 1
+
+    kfs_step create "$files" 1000000 us/file meta_create || return 1
+    kfs_step stat "$files" 1000000 us/file meta_stat || return 1
+    kfs_step unlink "$files" 1000000 us/file meta_unlink
+}
+
+io_write()
+{
+    dd if=/dev/zero of="$mnt/io" bs=1M count="$mb" 2>/dev/null
+}
+
+# No keep_cache, the open drops the pages the write left
+io_read()
+{
+    dd if="$mnt/io" of=/dev/null bs=1M 2>/dev/null
+}
+
+# $1 names the mode of the mount
+bench_io()
+{
+    kfs_step write/$1 "$mb" 1024 s/GB io_write || return 1
+    kfs_step read/$1 "$mb" 1024 s/GB io_read || return 1
+    rm -f "$mnt/io"
+}
+
+mkdir -p "$mnt" || exit 1
+printf "%-8s %-14s %8s %12s\n" "frontend" "step" "files/MB" "cpu"
+for fe in kfs kfs_ll; do
+    bin=$KFS
+    [ $fe = kfs_ll ] && bin=$KFS_LL
+    kfs_mount "$bin" || exit 1
+    if [ "$files" -gt 0 ]; then
+        bench_meta || exit 1
+    fi
+    if [ "$mb" -gt 0 ]; then
+        bench_io splice || exit 1
+    fi
+    kfs_umount
+
+    if [ "$mb" -gt 0 ]; then
+        kfs_mount "$bin" no_splice_read,no_splice_write,no_splice_move || exit 1
+        bench_io copy || exit 1
+        kfs_umount
+    fi
+done
+rm -f "$img"
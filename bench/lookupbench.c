@@ -0,0 +1,293 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * What a bg lookup costs as the threads go up
+ * - An image with a few inode and data groups is made and mounted.
+ * - 1, 2, 4, ... threads, up to the number asked for, look up the ibg of
+ *   random inodes with kfs_get_ibg() and walk the data bg list to the
+ *   dbg of random blocks, for a while. The lookups per second of all of
+ *   them are printed.
+ * - With -l every lookup also takes one shared rwlock for reading, as
+ *   the bg lists did before lock_bgs() went lock free.
+ */
+
+#include <kfs.h>
+
+static char *pname = NULL;
+
+int lookupbench_usage()
+{
+    printf("usage: %s\n", pname);
+    printf("options:\n");
+    printf("    -f|--file filename     image to create, removed at the end\n");
+    printf("    -n|--groups            inode and data groups each (default 16)\n");
+    printf("    -t|--threads           most threads to try (default 8)\n");
+    printf("    -s|--seconds           time of each run (default 1)\n");
+    printf("    -l|--rwlock            take a shared rwlock over each lookup\n");
+    return 1;
+}
+
+static struct option kfs_lookupbench_opts[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "file", required_argument, NULL, 'f' },
+    { "groups", required_argument, NULL, 'n' },
+    { "threads", required_argument, NULL, 't' },
+    { "seconds", required_argument, NULL, 's' },
+    { "rwlock", no_argument, NULL, 'l' },
+    { NULL, no_argument, NULL, 0 }
+};
+
+static char file[256] = "/tmp/lookupbench.kfs";
+static u32 groups = 16;
+static u32 max_threads = 8;
+static u32 seconds = 1;
+static int use_rwlock = 0;
+
+static pthread_rwlock_t lookupbench_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int lookupbench_stop;
+
+struct lookupbench_thread {
+    pthread_t tid;
+    struct kfs *fs;
+    u64 lookups;
+    u32 seed;
+    int err;
+} __attribute__((aligned(KFS_CACHELINE)));
+
+static void lookupbench_free_bgs(struct kfs *fs)
+{
+    struct kfs_bg *bg, *n;
+
+    list_for_each_entry_safe(bg, n, &fs->ibgs, link) {
+        list_del(&bg->link);
+        kfs_free_bg(bg);
+    }
+    list_for_each_entry_safe(bg, n, &fs->dbgs, link) {
+        list_del(&bg->link);
+        kfs_free_bg(bg);
+    }
+}
+
+/* An image with groups inode groups and groups data groups */
+static int lookupbench_mkimg(void)
+{
+    struct kfs fs;
+    u32 i;
+    int ret;
+
+    kfs_init(&fs);
+    fs.fd = open(file, O_CREAT|O_TRUNC|O_RDWR|O_NOFOLLOW, 0644);
+    if (fs.fd < 0) {
+        kerr("Open file %s failed: %s\n", file, strerror(errno));
+        return -errno;
+    }
+
+    ret = ftruncate(fs.fd, KFS_SB_SIZE);
+    if (ret < 0) {
+        kerr("Generate superblock failed: %s\n", strerror(errno));
+        ret = -errno;
+        goto out;
+    }
+
+    fs.sb->magic = KFS_SB_MAGIC;
+    fs.sb->version = KFS_SB_VERSION;
+    fs.sb->ibg_size = DEFAULT_IBG_SIZE;
+    fs.sb->dbg_size = MIN_BBG_SIZE;
+    fs.filesize = KFS_SB_SIZE;
+    fs.inode_per_bg = kfs_ibg_size(&fs) / KFS_INODE_SIZE;
+    fs.block_per_bg = kfs_dbg_size(&fs) / KFS_BLOCK_SIZE;
+
+    ret = kfs_create_gdt(&fs, ((2 * groups) / KFS_GDE_PER_BLOCK) + 1);
+    if (ret) {
+        goto out;
+    }
+    for (i = 0; !ret && (i < groups); i++) {
+        ret = kfs_extend_bg(&fs, KFS_BG_INODE);
+        if (!ret) {
+            ret = kfs_extend_bg(&fs, KFS_BG_DATA);
+        }
+    }
+    if (!ret) {
+        ret = kfs_sync_fs(&fs);
+    }
+
+  out:
+    lookupbench_free_bgs(&fs);
+    kfs_free_gdt(&fs);
+    close(fs.fd);
+    return ret;
+}
+
+/* The data bg holding bno, found by walking the list under lock_bgs() */
+static struct kfs_bg *lookupbench_find_dbg(struct kfs *fs, u64 bno)
+{
+    struct kfs_bg *dbg, *found = NULL;
+    u64 first;
+
+    lock_bgs(fs, KFS_BG_DATA);
+    list_for_each_entry_rcu(dbg, &fs->dbgs, link) {
+        first = bg_data_bno(dbg);
+        if ((bno >= first) && (bno < (first + fs->block_per_bg))) {
+            found = dbg;
+            break;
+        }
+    }
+    unlock_bgs(fs, KFS_BG_DATA);
+
+    return found;
+}
+
+static void *lookupbench_thread(void *data)
+{
+    struct lookupbench_thread *t = data;
+    struct kfs *fs = t->fs;
+    struct kfs_bg *dbg = list_first_entry(&fs->dbgs, struct kfs_bg, link);
+    u64 inodes = (u64)groups * fs->inode_per_bg;
+    u64 first = bg_data_bno(dbg);
+    u64 ino, bno;
+
+    while (!__atomic_load_n(&lookupbench_stop, __ATOMIC_RELAXED)) {
+        ino = rand_r(&t->seed) % inodes;
+        /* Anywhere from the first data group on, misses too */
+        bno = first + (rand_r(&t->seed) % ((u64)groups * fs->block_per_bg));
+
+        if (use_rwlock) {
+            pthread_rwlock_rdlock(&lookupbench_lock);
+        }
+        if (!kfs_get_ibg(fs, ino)) {
+            t->err = -ENOENT;
+        }
+        lookupbench_find_dbg(fs, bno);
+        if (use_rwlock) {
+            pthread_rwlock_unlock(&lookupbench_lock);
+        }
+        if (t->err) {
+            break;
+        }
+        t->lookups += 2;
+    }
+
+    return NULL;
+}
+
+static int lookupbench_threads(struct kfs *fs, u32 threads)
+{
+    struct lookupbench_thread *t;
+    u64 lookups = 0;
+    u32 i, started;
+    int ret = 0;
+
+    t = kfs_alloc(MEM_NORMAL, threads * sizeof(*t));
+    if (!t) {
+        return -ENOMEM;
+    }
+    memset(t, 0, threads * sizeof(*t));
+
+    lookupbench_stop = 0;
+    for (started = 0; started < threads; started++) {
+        t[started].fs = fs;
+        t[started].seed = started + 1;
+        ret = pthread_create(&t[started].tid, NULL, lookupbench_thread, &t[started]);
+        if (ret) {
+            kerr("Create thread failed: %s\n", strerror(ret));
+            ret = -ret;
+            break;
+        }
+    }
+    if (!ret) {
+        sleep(seconds);
+    }
+    __atomic_store_n(&lookupbench_stop, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(t[i].tid, NULL);
+        lookups += t[i].lookups;
+        if (t[i].err && !ret) {
+            kerr("Lookup failed %d\n", t[i].err);
+            ret = t[i].err;
+        }
+    }
+    if (!ret) {
+        printf("%8u %8u %14.0f %14.0f\n", threads, groups,
+                (double)lookups / seconds, (double)lookups / seconds / threads);
+    }
+
+    kfs_free(MEM_NORMAL, t);
+    return ret;
+}
+
+static int lookupbench_run(void)
+{
+    struct kfs fs;
+    u32 threads;
+    int ret;
+
+    ret = lookupbench_mkimg();
+    if (ret) {
+        kerr("Make image of %u groups failed %d\n", groups, ret);
+        return ret;
+    }
+
+    kfs_init(&fs);
+    ret = kfs_open_fs(&fs, file);
+    if (ret) {
+        kerr("Mount image of %u groups failed %d\n", groups, ret);
+        return ret;
+    }
+
+    for (threads = 1; !ret && (threads <= max_threads); threads <<= 1) {
+        ret = lookupbench_threads(&fs, threads);
+    }
+
+    kfs_close_fs(&fs);
+    lookupbench_free_bgs(&fs);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    char *p;
+    int c, ret;
+
+    pname = argv[0];
+    if ((p = strrchr(pname, '/')) != NULL)
+        pname = p+1;
+
+    while ((c = getopt_long(argc, argv, "hf:n:t:s:l", kfs_lookupbench_opts, NULL)) != -1) {
+        switch (c) {
+            case 'f':
+                snprintf(file, 256, "%s", optarg);
+                break;
+            case 'n':
+                groups = atoi(optarg);
+                break;
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 's':
+                seconds = atoi(optarg);
+                break;
+            case 'l':
+                use_rwlock = 1;
+                break;
+            default:
+                return lookupbench_usage();
+        }
+    }
+
+    if (!groups || !max_threads || !seconds) {
+        kerr("Invalid groups, threads or seconds\n");
+        return 1;
+    }
+
+    printf("%8s %8s %14s %14s\n", "threads", "groups", "lookups/s", "per thread");
+    ret = lookupbench_run();
+
+    remove(file);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,246 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * Mount time against image size
+ * - Images with 1, 4, 16, ... data groups are made like mkfs does,
+ *   up to the number asked for. Their data is sparse.
+ * - Each one is mounted with the page cache of the image dropped, the
+ *   time of kfs_open_fs(), the heap it took and the time of the first
+ *   block allocation, which reads a bitmap in, are printed.
+ * - Then a block is taken in every data group and the time of the
+ *   kfs_sync_fs() writing all the bitmaps back is printed, it's the
+ *   one flex groups (-x) make a few large writes of.
+ */
+
+#include <kfs.h>
+#include <malloc.h>
+
+static char *pname = NULL;
+
+int mntbench_usage()
+{
+    printf("usage: %s\n", pname);
+    printf("options:\n");
+    printf("    -f|--file filename     image to create, removed at the end\n");
+    printf("    -b|--block_bg_size     block group size (default %dM)\n", getm(MIN_BBG_SIZE));
+    printf("    -n|--groups            most data groups to try (default 4096)\n");
+    printf("    -m|--mmap_meta         mount with mmap_meta\n");
+    printf("    -x|--flex_bgs          bgs sharing a run of bitmaps (default 0)\n");
+    return 1;
+}
+
+static struct option kfs_mntbench_opts[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "file", required_argument, NULL, 'f' },
+    { "block_bg_size", required_argument, NULL, 'b' },
+    { "groups", required_argument, NULL, 'n' },
+    { "mmap_meta", no_argument, NULL, 'm' },
+    { "flex_bgs", required_argument, NULL, 'x' },
+    { NULL, no_argument, NULL, 0 }
+};
+
+static char file[256] = "/tmp/mntbench.kfs";
+static u32 block_bg_size = MIN_BBG_SIZE;
+static u32 max_groups = 4096;
+static u32 mnt_flags = 0;
+static u32 flex_bgs = 0;
+
+static u64 mntbench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void mntbench_free_bgs(struct kfs *fs)
+{
+    struct kfs_bg *bg, *n;
+
+    list_for_each_entry_safe(bg, n, &fs->ibgs, link) {
+        list_del(&bg->link);
+        kfs_free_bg(bg);
+    }
+    list_for_each_entry_safe(bg, n, &fs->dbgs, link) {
+        list_del(&bg->link);
+        kfs_free_bg(bg);
+    }
+}
+
+/* An image with one inode group and groups data groups */
+static int mntbench_mkimg(u32 groups)
+{
+    struct kfs fs;
+    u32 i;
+    int ret;
+
+    kfs_init(&fs);
+    fs.fd = open(file, O_CREAT|O_TRUNC|O_RDWR|O_NOFOLLOW, 0644);
+    if (fs.fd < 0) {
+        kerr("Open file %s failed: %s\n", file, strerror(errno));
+        return -errno;
+    }
+
+    ret = ftruncate(fs.fd, KFS_SB_SIZE);
+    if (ret < 0) {
+        kerr("Generate superblock failed: %s\n", strerror(errno));
+        ret = -errno;
+        goto out;
+    }
+
+    fs.sb->magic = KFS_SB_MAGIC;
+    fs.sb->version = KFS_SB_VERSION;
+    fs.sb->ibg_size = DEFAULT_IBG_SIZE;
+    fs.sb->dbg_size = block_bg_size;
+    fs.sb->flex_bgs = flex_bgs;
+    fs.filesize = KFS_SB_SIZE;
+    fs.inode_per_bg = kfs_ibg_size(&fs) / KFS_INODE_SIZE;
+    fs.block_per_bg = kfs_dbg_size(&fs) / KFS_BLOCK_SIZE;
+
+    ret = kfs_create_gdt(&fs, (groups / KFS_GDE_PER_BLOCK) + 1);
+    if (ret) {
+        goto out;
+    }
+    ret = kfs_extend_bg(&fs, KFS_BG_INODE);
+    for (i = 0; !ret && (i < groups); i++) {
+        ret = kfs_extend_bg(&fs, KFS_BG_DATA);
+    }
+    if (!ret) {
+        ret = kfs_sync_fs(&fs);
+    }
+    if (!ret && fsync(fs.fd)) {
+        ret = -errno;
+    }
+
+  out:
+    mntbench_free_bgs(&fs);
+    kfs_free_gdt(&fs);
+    close(fs.fd);
+    return ret;
+}
+
+static int mntbench_run(u32 groups)
+{
+    struct kfs fs;
+    struct kfs_bg *bg;
+    u64 t0, t1, t2, t3, t4, bno;
+    size_t heap;
+    int fd, ret;
+
+    ret = mntbench_mkimg(groups);
+    if (ret) {
+        kerr("Make image of %u groups failed %d\n", groups, ret);
+        return ret;
+    }
+
+    /* Cold cache, as at boot */
+    fd = open(file, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+
+    kfs_init(&fs);
+    fs.mntopt.flags |= mnt_flags;
+    heap = mallinfo2().uordblks;
+    t0 = mntbench_now();
+    ret = kfs_open_fs(&fs, file);
+    t1 = mntbench_now();
+    if (ret) {
+        kerr("Mount image of %u groups failed %d\n", groups, ret);
+        return ret;
+    }
+    heap = mallinfo2().uordblks - heap;
+
+    ret = kfs_alloc_block(&fs, &bno);
+    t2 = mntbench_now();
+    if (ret) {
+        kerr("Alloc block failed %d\n", ret);
+    }
+
+    /* Every bitmap dirty, all are written by one sync */
+    list_for_each_entry(bg, &fs.dbgs, link) {
+        lock_bg(bg);
+        if (!ret) {
+            ret = kfs_alloc_block_bg(bg, &bno);
+        }
+        unlock_bg(bg);
+    }
+    t3 = mntbench_now();
+    if (!ret) {
+        ret = kfs_sync_fs(&fs);
+    }
+    t4 = mntbench_now();
+    if (ret) {
+        kerr("Dirty and sync all bitmaps failed %d\n", ret);
+    }
+
+    printf("%8u %10llu %10.3f %10zu %10.1f %10.3f\n", groups,
+            fs.filesize >> 20, (t1 - t0) / 1000000.0, heap >> 10,
+            (t2 - t1) / 1000.0, (t4 - t3) / 1000000.0);
+
+    kfs_close_fs(&fs);
+    mntbench_free_bgs(&fs);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    char *p;
+    int c, ret = 0;
+    u32 groups;
+
+    pname = argv[0];
+    if ((p = strrchr(pname, '/')) != NULL)
+        pname = p+1;
+
+    while ((c = getopt_long(argc, argv, "hf:b:n:mx:", kfs_mntbench_opts, NULL)) != -1) {
+        switch (c) {
+            case 'f':
+                snprintf(file, 256, "%s", optarg);
+                break;
+            case 'b':
+                block_bg_size = atoi(optarg);
+                block_bg_size <<= 20;
+                break;
+            case 'n':
+                max_groups = atoi(optarg);
+                break;
+            case 'm':
+                mnt_flags |= KFS_MNT_MMAP;
+                break;
+            case 'x':
+                flex_bgs = atoi(optarg);
+                break;
+            default:
+                return mntbench_usage();
+        }
+    }
+
+    if ((block_bg_size < MIN_BBG_SIZE) || (block_bg_size > MAX_BBG_SIZE)) {
+        kerr("Invalid block block group size\n");
+        return 1;
+    }
+
+    if ((flex_bgs == 1) || (flex_bgs > KFS_FLEX_MAX)) {
+        kerr("Invalid flex_bgs\n");
+        return 1;
+    }
+
+    printf("%8s %10s %10s %10s %10s %10s\n", "groups", "size(M)", "mount(ms)",
+            "heap(K)", "alloc(us)", "sync(ms)");
+    for (groups = 1; groups <= max_groups; groups <<= 2) {
+        ret = mntbench_run(groups);
+        if (ret) {
+            break;
+        }
+    }
+
+    remove(file);
+    return ret ? 1 : 0;
+}
@@ -52,6 +52,7 @@
 #include <pthread.h>
 #include <fuse.h>
 #include <kfs.h>
+#include "kfs_fuse.h"
 
 struct kfs fs;
 struct kfs_dentry root;
@@ -59,9 +60,29 @@ struct kfs_dentry root;
 struct kfs_params {
     char *filename;
     int logLevel;
+    unsigned int updateDelay;
+    unsigned int dirtyThresh;
+    unsigned int dirtyLimit;
+    unsigned int inodeDirtyLimit;
+    char *ioEngine;
+    int odirect;
+    int mmapMeta;
+    int exactStatfs;
+    unsigned int threads;
+    int cpuPin;
 } kfs_param = {
     .filename = NULL,
-    .logLevel = DEFAULT_LOG_LEVEL
+    .logLevel = DEFAULT_LOG_LEVEL,
+    .updateDelay = DEFAULT_UPDATE_DELAY,
+    .dirtyThresh = DEFAULT_DIRTY_THRESH,
+    .dirtyLimit = DEFAULT_DIRTY_LIMIT,
+    .inodeDirtyLimit = DEFAULT_INODE_DIRTY_LIMIT,
+    .ioEngine = NULL,
+    .odirect = 0,
+    .mmapMeta = 0,
+    .exactStatfs = 0,
+    .threads = DEFAULT_THREAD_NUM,
+    .cpuPin = 0
 };
 
 #define KFS_OPT(t, p) { t, offsetof(struct kfs_params, p), 1 }
@@ -69,6 +90,16 @@ struct kfs_params {
 static const struct fuse_opt kfs_opts[] = {
     KFS_OPT("-f %s", filename),
     KFS_OPT("-l %d", logLevel),
+    KFS_OPT("update_delay=%u", updateDelay),
+    KFS_OPT("dirty_bytes=%u", dirtyThresh),
+    KFS_OPT("dirty_limit=%u", dirtyLimit),
+    KFS_OPT("inode_dirty_limit=%u", inodeDirtyLimit),
+    KFS_OPT("io_engine=%s", ioEngine),
+    KFS_OPT("odirect", odirect),
+    KFS_OPT("mmap_meta", mmapMeta),
+    KFS_OPT("exact_statfs", exactStatfs),
+    KFS_OPT("threads=%u", threads),
+    KFS_OPT("cpu_pin", cpuPin),
     FUSE_OPT_END
 };
 
@@ -90,61 +121,82 @@ static int kfs_process_arg(void *data, const char *arg, int key,
 
 #define KFS_LOOKUP_PARENT       0x0001
 
-static int kfs_dentry_lookup(struct kfs *fs, struct kfs_dentry *dir,
-        char *name, int namelen, struct kfs_dentry **dp)
+/* One name of a path in dir, return its inode with a lookup held */
+static int kfs_dentry_lookup(struct kfs *fs, struct kfs_inode *dir,
+        const char *name, int namelen, struct kfs_inode **ip)
 {
-    int ret;
-    struct kfs_dentry *dentry;
+    char buf[NAME_MAX + 1];
+
+    if (namelen > NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(buf, name, namelen);
+    buf[namelen] = '\0';
+
+    return kfs_lookup_inode(dir, buf, ip);
 }
 
+/*
+ * Walk path from the root, return its inode with a lookup held, to be
+ * dropped by kfs_put_inode(). With KFS_LOOKUP_PARENT it's the parent
+ * directory, and *last the last name of the path.
+ */
 static int kfs_lookup(struct kfs *fs, const char *path,
-        struct kfs_dentry **dp, int flags)
+        struct kfs_inode **ip, const char **last, int flags)
 {
-    int ret = -ENOENT;
-    int namelen = strlen(path);
+    struct kfs_inode *dir = root.inode, *inode;
+    const char *name = path, *end;
+    int ret;
 
-    if (namelen == 1 && path[0] == '/') {
-        kdebug(LOG_VFS, "Return root\n");
-        *dp = &root;
-        return 0;
+    kfs_hold_inode(dir);
+    for (;;) {
+        while (*name == '/') {
+            name++;
+        }
+        end = strchrnul(name, '/');
+        if (!*name || ((flags & KFS_LOOKUP_PARENT) && !*end)) {
+            break;
+        }
+
+        ret = kfs_dentry_lookup(fs, dir, name, end - name, &inode);
+        kfs_put_inode(dir, 1);
+        if (ret) {
+            kdebug(LOG_VFS, "Path %s not found\n", path);
+            return ret;
+        }
+        dir = inode;
+        name = end;
     }
 
     if (flags & KFS_LOOKUP_PARENT) {
-        return &root;
+        if (!*name) {
+            /* The root has no name in a parent */
+            kfs_put_inode(dir, 1);
+            return -EBUSY;
+        }
+        *last = name;
     }
-    kdebug(LOG_VFS, "Path %s not found\n", path);
-    return ret;
+    *ip = dir;
+    return 0;
 }
 
 static int kfs_getattr(const char *path, struct stat *stbuf)
 {
     int ret;
-    struct kfs_dentry *dentry;
     struct kfs_inode *inode;
 
     kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    ret = kfs_lookup(&fs, path, &dentry, 0);
+    ret = kfs_lookup(&fs, path, &inode, NULL, 0);
     if (ret) {
         return ret;
     }
 
-    inode = dentry->inode;
-
     kdebug3(LOG_VFS, "fill attr\n");
-    stbuf->st_dev = 200;
-    stbuf->st_ino = inode->ino;
-    stbuf->st_mode = inode->node.mode;
-    stbuf->st_nlink = inode->node.nlink;
-    stbuf->st_uid = inode->node.uid;
-    stbuf->st_gid = inode->node.gid;
-    stbuf->st_rdev = 0;
-    stbuf->st_size = inode->node.size;
-    stbuf->st_blksize = 512;
-    stbuf->st_blocks = (inode->node.size+511) >> 9;
-    stbuf->st_atime = inode->node.mtime;
-    stbuf->st_mtime = inode->node.mtime;
-    stbuf->st_ctime = inode->node.ctime;
+    kfs_lock_inode(inode);
+    kfs_inode_stat(inode, stbuf);
+    kfs_unlock_inode(inode);
+    kfs_put_inode(inode, 1);
 
     kdebug(LOG_VFS, "attr inode %lu mode %o\n",
             stbuf->st_ino, stbuf->st_mode);
@@ -166,212 +218,178 @@ static int kfs_access(const char *path, int mask)
     return 0;
 }
 
+/* There are no symlinks */
 static int kfs_readlink(const char *path, char *buf, size_t size)
 {
     int ret;
-    struct kfs_dentry *dentry;
+    struct kfs_inode *inode;
     kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    ret = kfs_lookup(&fs, path, &dentry, 0);
+    ret = kfs_lookup(&fs, path, &inode, NULL, 0);
     if (ret < 0) {
         return ret;
     }
+    kfs_put_inode(inode, 1);
 
-    buf[ret] = '\0';
-    return 0;
-}
-
-struct kfs_dir_info {
-    u64 ino;
-    u32 type;
-    off_t offset;
-    struct rest_dir_entry *de;
-    char *demem;
-};
-
-static int kfs_disk_Readdir(struct kfs *fs, const char *path, struct kfs_dir_info *di)
-{
-    int ret = -EIO;
-    return ret;
+    return -EINVAL;
 }
 
+/* The fh of a directory is its inode, looked up until releasedir */
 static int kfs_opendir(const char *path, struct fuse_file_info *fi)
 {
     int ret;
-    struct kfs_dentry *dentry;
     struct kfs_inode *inode;
 
     kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    ret = kfs_lookup(&fs, path, &dentry, 0);
+    ret = kfs_lookup(&fs, path, &inode, NULL, 0);
     if (ret < 0) {
         return ret;
     }
 
-    inode = dentry->inode;
-
-#if 0
-    //di = kfs_alloc(MEM_FS, sizeof(struct kfs_dir_info), 0);
-    if (!di) {
-        kerr("Allocate dir info failed\n");
-        return -ENOMEM;
+    if (!S_ISDIR(inode->node->mode)) {
+        kfs_put_inode(inode, 1);
+        return -ENOTDIR;
     }
-    di->ino = inode->ino;
-    di->type = inode->node.mode;
-    di->offset = 0;
-    di->de = NULL;
-    di->demem = NULL;
 
-    fi->fh = (unsigned long)di;
-#endif
+    fi->fh = (unsigned long)inode;
     return 0;
 }
 
 static int kfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
-    struct kfs_dir_info *di = (struct kfs_dir_info*)fi->fh;
+    struct kfs_inode *inode = (struct kfs_inode *)fi->fh;
 
     kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    if (di->demem) {
-        kfs_free(MEM_FS, di->demem);
+    if (inode) {
+        kfs_put_inode(inode, 1);
+        fi->fh = 0;
     }
-    fi->fh = 0;
     return 0;
 }
 
+static int kfs_fill_dir(void *buf, fuse_fill_dir_t filler, const char *name,
+        struct kfs_inode *inode)
+{
+    struct stat st;
+
+    memset(&st, 0, sizeof(st));
+    st.st_ino = inode->ino;
+    st.st_mode = inode->node->mode;
+    return filler(buf, name, &st, 0);
+}
+
+/* The whole directory at once, the offsets are left to libfuse */
 static int kfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                off_t offset, struct fuse_file_info *fi)
 {
-    int ret;
-    struct kfs_dir_info *di = (struct kfs_dir_info*)fi->fh;
-    char *p;
+    struct kfs_inode *dir = (struct kfs_inode *)fi->fh;
+    struct kfs_dentry *dentry, *parent;
 
     (void) offset;
-    (void) fi;
 
     kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    if (!di->demem) {
-        //ret = kfs_disk_Readdir(&fs, path, di);
-        if (ret < 0)
-            return ret;
-    } else {
-        /* check offset */
+    if (!dir) {
+        return -EBADF;
     }
 
-#if 0
-    de = di->de;
-
-    while (de->ino != 0) {
-        struct stat st;
-        char name[256];
-        memset(&st, 0, sizeof(st));
-        st.st_ino = de->ino;
-        st.st_mode = de->type;
-        snprintf(name, de->namelen+1, "%s", de->name);
-        kdebug(LOG_PROTOCOL, "entry name %s, ino %llu, type %o\n",
-                name, de->ino, de->type);
-        if (filler(buf, name, &st, 0))
+    lock_dentry(dir->dentry);
+    parent = dir->dentry->parent ? dir->dentry->parent : dir->dentry;
+    if (kfs_fill_dir(buf, filler, ".", dir)
+            || kfs_fill_dir(buf, filler, "..", parent->inode)) {
+        goto out;
+    }
+    list_for_each_entry(dentry, &dir->dentry->children, brothers) {
+        kdebug(LOG_PROTOCOL, "entry name %s, ino %llu\n",
+                dentry->name, dentry->inode->ino);
+        if (kfs_fill_dir(buf, filler, dentry->name, dentry->inode)) {
             break;
-        p = (char *)de;
-        p += de->length;
-        de = (struct rest_dir_entry*)p;
+        }
     }
-#endif
+  out:
+    unlock_dentry(dir->dentry);
 
     return 0;
 }
 
-static int kfs_mknod(const char *path, mode_t mode, dev_t rdev)
+/* Make the last name of path, with a lookup held if ip is given */
+static int kfs_make(const char *path, mode_t mode, struct kfs_inode **ip)
 {
     int ret;
+    struct kfs_inode *dir, *inode;
+    const char *name;
 
-    kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
-    /* On Linux this could just be 'mknod(path, mode, rdev)' but this
-       is more portable */
-
-    return -EPERM;
-
-    if (S_ISREG(mode)) {
-        ret = open(path, O_CREAT | O_EXCL | O_WRONLY, mode);
-        if (ret >= 0)
-            ret = close(ret);
-    } else if (S_ISFIFO(mode))
-        ret = mkfifo(path, mode);
-    else
-        ret = mknod(path, mode, rdev);
-    if (ret == -1)
-        return -errno;
+    ret = kfs_lookup(&fs, path, &dir, &name, KFS_LOOKUP_PARENT);
+    if (ret < 0) {
+        return ret;
+    }
 
+    ret = kfs_create_inode(dir, (char *)name, mode, fuse_get_context()->uid,
+            fuse_get_context()->gid, &inode);
+    kfs_put_inode(dir, 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (ip) {
+        *ip = inode;
+    } else {
+        kfs_put_inode(inode, 1);
+    }
     return 0;
 }
 
-
-static int kfs_mkdir(const char *path, mode_t mode)
+/* Nothing but the mode is kept, only regular files make sense */
+static int kfs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
-    int ret;
-    struct kfs_dentry *dentry;
-    char target_path[1024];
-
     kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    if (strlen(path) > (1024 - 2)) {
-        return -ENAMETOOLONG;
+    if (!S_ISREG(mode)) {
+        return -EPERM;
     }
 
-    sprintf(target_path, "%s/", path);
-#if 0
-    attr.uid = fuse_get_context()->uid;
-    attr.gid = fuse_get_context()->gid;
-    attr.mode = mode;
+    return kfs_make(path, mode, NULL);
+}
 
-    ret = kfs_disk_Create(&fs, target_path, &attr);
-#endif
-    if (ret < 0) {
-        return ret;
-    }
+static int kfs_mkdir(const char *path, mode_t mode)
+{
+    kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    return 0;
+    return kfs_make(path, (mode & ~S_IFMT) | S_IFDIR, NULL);
 }
 
-static int kfs_unlink(const char *path)
+static int kfs_remove(const char *path, int isdir)
 {
     int ret;
-    struct kfs_dentry *dentry;
-    struct kfs_inode *inode;
-    kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
+    struct kfs_inode *dir;
+    const char *name;
 
-    ret = kfs_lookup(&fs, path, &dentry, 0);
+    ret = kfs_lookup(&fs, path, &dir, &name, KFS_LOOKUP_PARENT);
     if (ret < 0) {
         return ret;
     }
 
-    //ret = kfs_disk_Remove(&fs, path, &attr);
-    if (ret < 0) {
-        return ret;
-    }
+    ret = kfs_remove_inode(dir, (char *)name, isdir);
+    kfs_put_inode(dir, 1);
 
-    return 0;
+    return ret;
 }
 
-
-static int kfs_rmdir(const char *path)
+static int kfs_unlink(const char *path)
 {
-    int ret;
-    struct kfs_dentry *dentry;
     kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    ret = kfs_lookup(&fs, path, &dentry, 0);
-    if (ret < 0) {
-        return ret;
-    }
+    return kfs_remove(path, 0);
+}
 
-    if (ret < 0) {
-        return ret;
-    }
 
-    return 0;
+static int kfs_rmdir(const char *path)
+{
+    kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
+
+    return kfs_remove(path, 1);
 }
 
 static int kfs_rename(const char *from, const char *to)
@@ -422,41 +440,51 @@ static int kfs_link(const char *from, const char *to)
 
 static int kfs_chmod(const char *path, mode_t mode)
 {
-    int ret; 
-    struct kfs_dentry *dentry;
+    int ret;
     struct kfs_inode *inode;
 
     kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    ret = kfs_lookup(&fs, path, &dentry, 0);
-    if (ret < 0) { 
-        return ret; 
-    }    
+    ret = kfs_lookup(&fs, path, &inode, NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
 
-    if (ret < 0) { 
-        return ret; 
-    }    
+    kfs_lock_inode(inode);
+    inode->node->mode = (inode->node->mode & S_IFMT) | (mode & ~S_IFMT);
+    inode->node->ctime = time(NULL);
+    mark_inode_dirty(inode);
+    kfs_unlock_inode(inode);
+    kfs_put_inode(inode, 1);
 
     return 0;
-
 }
 
 static int kfs_chown(const char *path, uid_t uid, gid_t gid)
 {
     int ret;
-    struct kfs_dentry *dentry;
+    struct kfs_inode *inode;
 
     kdebug(LOG_VFS, "%s: path %s uid %d gid %d\n",
             __FUNCTION__, path, uid, gid);
 
-    ret = kfs_lookup(&fs, path, &dentry, 0);
+    ret = kfs_lookup(&fs, path, &inode, NULL, 0);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret < 0) {
-        return ret;
+    kfs_lock_inode(inode);
+    /* -1 leaves it as it is */
+    if (uid != (uid_t)-1) {
+        inode->node->uid = uid;
+    }
+    if (gid != (gid_t)-1) {
+        inode->node->gid = gid;
     }
+    inode->node->ctime = time(NULL);
+    mark_inode_dirty(inode);
+    kfs_unlock_inode(inode);
+    kfs_put_inode(inode, 1);
 
     return 0;
 }
@@ -465,88 +493,145 @@ static int kfs_chown(const char *path, uid_t uid, gid_t gid)
 static int kfs_truncate(const char *path, off_t size)
 {
     int ret;
-    struct kfs_dentry *dentry;
+    struct kfs_inode *inode;
 
     kdebug(LOG_VFS, "%s: path %s, size %llu\n",
             __FUNCTION__, path, (u64)size);
 
-    ret = kfs_lookup(&fs, path, &dentry, 0);
-    if (ret < 0) {
-        return ret;
+    if (size < 0) {
+        return -EINVAL;
     }
 
+    ret = kfs_lookup(&fs, path, &inode, NULL, 0);
     if (ret < 0) {
         return ret;
     }
 
-    return 0;
+    kfs_lock_inode(inode);
+    if (S_ISDIR(inode->node->mode)) {
+        ret = -EISDIR;
+    } else {
+        ret = kfs_file_truncate(inode, size);
+    }
+    kfs_unlock_inode(inode);
+    kfs_put_inode(inode, 1);
+
+    return ret;
+}
+
+/* UTIME_NOW and UTIME_OMIT come from the setattr of the kernel */
+static u32 kfs_timespec(const struct timespec *ts, u32 old, time_t now)
+{
+    if (ts->tv_nsec == UTIME_NOW) {
+        return now;
+    }
+    if (ts->tv_nsec == UTIME_OMIT) {
+        return old;
+    }
+    return ts->tv_sec;
 }
 
 static int kfs_utimens(const char *path, const struct timespec ts[2])
 {
     int ret;
-    struct kfs_dentry *dentry;
+    struct kfs_inode *inode;
+    time_t now = time(NULL);
 
     kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    ret = kfs_lookup(&fs, path, &dentry, 0);
+    ret = kfs_lookup(&fs, path, &inode, NULL, 0);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret < 0) {
-        return ret;
-    }
+    kfs_lock_inode(inode);
+    inode->node->atime = kfs_timespec(&ts[0], inode->node->atime, now);
+    inode->node->mtime = kfs_timespec(&ts[1], inode->node->mtime, now);
+    inode->node->ctime = now;
+    mark_inode_dirty(inode);
+    kfs_unlock_inode(inode);
+    kfs_put_inode(inode, 1);
 
     return 0;
 }
 
+/*
+ * The fh of an open file. Its inode is looked up until release, so the
+ * dentry stays with it even once the file is unlinked.
+ */
 struct kfs_file_info {
     struct kfs_dentry *dentry;
 };
 
+/* Open inode, its lookup goes to the fh */
+static int kfs_open_file(struct kfs_inode *inode, struct fuse_file_info *fi)
+{
+    struct kfs_file_info *file;
+
+    file = kfs_alloc(MEM_FS, sizeof(*file));
+    if (!file) {
+        kerr("Allocate file info failed\n");
+        kfs_put_inode(inode, 1);
+        return -ENOMEM;
+    }
+    file->dentry = inode->dentry;
+    fi->fh = (unsigned long)file;
+
+    return 0;
+}
+
 static int kfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     int ret;
-    struct kfs_dentry *dentry;
     struct kfs_inode *inode;
 
     kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    ret = kfs_lookup(&fs, path, &dentry, KFS_LOOKUP_PARENT);
+    ret = kfs_make(path, (mode & ~S_IFMT) | S_IFREG, &inode);
     if (ret) {
         return ret;
     }
 
-    fi->fh = 0;
-
-    return 0;
+    kfs_balance_dirty(&fs, NULL);
+    return kfs_open_file(inode, fi);
 }
 
 static int kfs_open(const char *path, struct fuse_file_info *fi)
 {
     int ret;
+    struct kfs_inode *inode;
 
     kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    fi->fh = 0;
+    ret = kfs_lookup(&fs, path, &inode, NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
 
+    if (S_ISDIR(inode->node->mode)) {
+        kfs_put_inode(inode, 1);
+        return -EISDIR;
+    }
 
-    return 0;
+    return kfs_open_file(inode, fi);
 }
 
 static int kfs_disk_Read(struct kfs *fs, const char *path,
         struct kfs_file_info *file, char *buf, size_t size, u64 offset)
 {
-    int ret = -EIO;
-    return ret;
+    if (!file->dentry || !file->dentry->inode) {
+        return -EIO;
+    }
+    return kfs_file_read(file->dentry->inode, buf, size, offset);
 }
 
 static int kfs_disk_Write(struct kfs *fs, const char *path,
         struct kfs_file_info *file, const char *buf, size_t size, u64 offset)
 {
-    int ret = -EIO;
-    return ret;
+    if (!file->dentry || !file->dentry->inode) {
+        return -EIO;
+    }
+    return kfs_file_write(file->dentry->inode, buf, size, offset);
 }
 
 static int kfs_read(const char *path, char *buf, size_t size, off_t offset,
@@ -577,76 +662,134 @@ static int kfs_write(const char *path, const char *buf, size_t size,
 {
     int ret;
     struct kfs_file_info *file = (struct kfs_file_info *)fi->fh;
-    off_t noffset = offset;
-    size_t nsize = size;
-    char *nbuf = (char *)buf;
-    off_t ds = (offset & 0x1FF);
-    off_t de = ((offset+size) & 0x1FF);
 
-    if (de) {
-        de = 512 - de;
+    kdebug(LOG_VFS, "%s: path %s offset %lu - %lu size %zd\n",
+            __FUNCTION__, path, offset, offset+size, size);
+    if (!file) {
+        kerr("File %s not opened\n", path);
+        return -EACCES;
     }
 
+    /*
+     * No alignment needed, the partial head and tail blocks are merged
+     * by the lib without reading them back.
+     */
+    ret = kfs_disk_Write(&fs, path, file, buf, size, offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Throttle ourselves if the flusher can't keep up */
+    kfs_balance_dirty(&fs, file->dentry?file->dentry->inode:NULL);
+    return ret;
+}
+
+/*
+ * Zero copy read, hand libfuse the image ranges and let it splice
+ * them to /dev/fuse without passing through our memory.
+ * The splice runs after we return, out of the inode lock. A punch or a
+ * truncate racing with it may free the blocks under it, the high level
+ * lib has no hook to hold the lock over the reply as kfs_ll does.
+ */
+static int kfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+        size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct kfs_file_info *file = (struct kfs_file_info *)fi->fh;
+    struct kfs_inode *inode;
+    struct kfs_extent *ext;
+    struct fuse_bufvec *bufv;
+    int n, max = (size >> KFS_BLOCK_SHIFT) + 2;
+
     kdebug(LOG_VFS, "%s: path %s offset %lu - %lu size %zd\n",
             __FUNCTION__, path, offset, offset+size, size);
+
     if (!file) {
         kerr("File %s not opened\n", path);
         return -EACCES;
     }
+    if (!file->dentry || !file->dentry->inode) {
+        return -EIO;
+    }
+    inode = file->dentry->inode;
 
-    /* Only do get filesize if de is not 0 */
-    if (de) {
-        //ret = kfs_disk_Getattr(&fs, path, &file->attr);
-        if (ret < 0) {
-            return ret;
-        }
-        /* If this write is going to extend filesize, then no
-         * need to be align.
-         */
-#if 0
-        if ((offset + size) >= file->attr.size) {
-            de = 0;
-        }
-#endif
+    ext = kfs_alloc(MEM_IO, max * sizeof(*ext));
+    if (!ext) {
+        return -ENOMEM;
     }
 
-    kdebug2(LOG_VFS, "ds %lu de %lu\n", ds, de);
-    //kdebug2(LOG_VFS, "old size %llu newsize %lu\n", file->attr.size, (offset+size));
+    kfs_lock_inode(inode);
+    n = kfs_file_map(inode, offset, size, 0, ext, max);
+    kfs_unlock_inode(inode);
+    if (n < 0) {
+        kfs_free(MEM_IO, ext);
+        return n;
+    }
 
-    if (ds || de) {
-        noffset &= (~0x1FF);
-        nsize += ds;
-        nsize = (nsize + 511) & (~0x1FF);
-        nbuf = kfs_alloc(MEM_IO, nsize);
-        if (!nbuf) {
-            kerr("Allocate IO buffer failed\n");
-            return -ENOMEM;
-        }
-        kdebug(LOG_VFS, "do read on %s ds %lu noffset %lu - %lu nsize %zd\n",
-                path, ds, noffset, noffset+nsize, nsize);
-        ret = kfs_disk_Read(&fs, path, file, nbuf, nsize, noffset);
-        if (ret < 0) {
-            kfs_free(MEM_IO, nbuf);
-            return ret;
-        }
-        memcpy(nbuf + ds, buf, size);
-        nsize = size+ds+de;
+    bufv = kfs_fuse_bufvec(fs.fd, ext, n, 1);
+    kfs_free(MEM_IO, ext);
+    if (!bufv) {
+        return -ENOMEM;
     }
 
-    kdebug(LOG_VFS, "do write on %s ds %lu noffset %lu - %lu nsize %zd\n",
-            path, ds, noffset, noffset+nsize, nsize);
-    ret = kfs_disk_Write(&fs, path, file, nbuf, nsize, noffset);
-    if (ret < 0) {
-        if (ds) {
-            kfs_free(MEM_IO, nbuf);
-        }
-        return ret;
+    *bufp = bufv;
+    return 0;
+}
+
+/* Zero copy write, the data is spliced from /dev/fuse into the image */
+static int kfs_write_buf(const char *path, struct fuse_bufvec *buf,
+        off_t offset, struct fuse_file_info *fi)
+{
+    struct kfs_file_info *file = (struct kfs_file_info *)fi->fh;
+    struct kfs_inode *inode;
+    struct kfs_extent *ext;
+    struct fuse_bufvec *dst;
+    size_t size = fuse_buf_size(buf);
+    int n, max = (size >> KFS_BLOCK_SHIFT) + 2;
+    ssize_t ret;
+
+    kdebug(LOG_VFS, "%s: path %s offset %lu - %lu size %zd\n",
+            __FUNCTION__, path, offset, offset+size, size);
+
+    if (!file) {
+        kerr("File %s not opened\n", path);
+        return -EACCES;
     }
+    if (!file->dentry || !file->dentry->inode) {
+        return -EIO;
+    }
+    inode = file->dentry->inode;
 
-    if (ds) {
-        kfs_free(MEM_IO, nbuf);
+    ext = kfs_alloc(MEM_IO, max * sizeof(*ext));
+    if (!ext) {
+        return -ENOMEM;
     }
-    return size;
+
+    kfs_lock_inode(inode);
+    n = kfs_file_map(inode, offset, size, 1, ext, max);
+    if (n < 0) {
+        ret = n;
+        goto out;
+    }
+
+    dst = kfs_fuse_bufvec(fs.fd, ext, n, 0);
+    if (!dst) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = fuse_buf_copy(dst, buf, 0);
+    if (ret > 0) {
+        kfs_file_written(inode, offset, ret);
+    }
+    free(dst);
+
+  out:
+    kfs_unlock_inode(inode);
+    kfs_free(MEM_IO, ext);
+    if (ret > 0) {
+        kfs_balance_dirty(&fs, inode);
+    }
+    return ret;
 }
 
 static int kfs_disk_StatFS (struct kfs *fs)
@@ -657,22 +800,9 @@ static int kfs_disk_StatFS (struct kfs *fs)
 
 static int kfs_statfs(const char *path, struct statvfs *stbuf)
 {
-    int ret;
-    unsigned char blockbits;
-    unsigned long blockres;
-
     kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
 
-    stbuf->f_frsize = KFS_BLOCK_SIZE;
-    stbuf->f_bsize = KFS_BLOCK_SIZE;
-    blockbits = KFS_BLOCK_SHIFT;
-    blockres = (1 << blockbits) - 1;
-    stbuf->f_blocks = (fs.filesize + blockres) >> blockbits;
-    stbuf->f_bfree = stbuf->f_blocks - fs.sb.bused;
-    stbuf->f_bavail = ((fs.sb.dbg_num * fs.sb.dbg_size) >> blockbits) - fs.sb.bused;
-    stbuf->f_files = fs.sb.ibg_num * fs.inode_per_bg;
-    stbuf->f_ffree = (fs.sb.ibg_num * fs.inode_per_bg) - fs.sb.iused;
-    kdebug(LOG_VFS, "iuse %llu\n", fs.sb.iused);
+    kfs_fill_statfs(&fs, stbuf);
 
     return 0;
 }
@@ -682,6 +812,7 @@ static int kfs_release(const char *path, struct fuse_file_info *fi)
     struct kfs_file_info *file = (struct kfs_file_info *)fi->fh;
 
     if (file) {
+        kfs_put_inode(file->dentry->inode, 1);
         kfs_free(MEM_FS, file);
         fi->fh = 0;
     }
@@ -691,38 +822,40 @@ static int kfs_release(const char *path, struct fuse_file_info *fi)
 static int kfs_fsync(const char *path, int isdatasync,
              struct fuse_file_info *fi)
 {
-    /* Just a stub.     This method is optional and can safely be left
-       unimplemented */
+    struct kfs_file_info *file = (struct kfs_file_info *)fi->fh;
 
-    kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
-    (void) path;
-    (void) isdatasync;
-    (void) fi;
-    return 0;
+    kdebug(LOG_VFS, "%s: path %s datasync %d\n", __FUNCTION__, path, isdatasync);
+    if (!file) {
+        kerr("File %s not opened\n", path);
+        return -EACCES;
+    }
+    if (!file->dentry || !file->dentry->inode) {
+        return -EIO;
+    }
+
+    return kfs_sync_file(file->dentry->inode, isdatasync);
 }
 
 #ifdef KFS_SUPPORT_PREALLOC
 static int kfs_fallocate(const char *path, int mode,
             off_t offset, off_t length, struct fuse_file_info *fi)
 {
-    int fd;
-    int ret;
-    kdebug(LOG_VFS, "%s: path %s\n", __FUNCTION__, path);
-
-    return -EPROTONOSUPPORT;
-    (void) fi;
-
-    if (mode)
-        return -EOPNOTSUPP;
-
-    fd = open(path, O_WRONLY);
-    if (fd == -1)
-        return -errno;
+    struct kfs_file_info *file = (struct kfs_file_info *)fi->fh;
 
-    ret = -posix_fallocate(fd, offset, length);
+    kdebug(LOG_VFS, "%s: path %s mode %x offset %lu length %lu\n",
+            __FUNCTION__, path, mode, offset, length);
+    if (!file) {
+        kerr("File %s not opened\n", path);
+        return -EACCES;
+    }
+    if (!file->dentry || !file->dentry->inode) {
+        return -EIO;
+    }
+    if ((offset < 0) || (length <= 0)) {
+        return -EINVAL;
+    }
 
-    close(fd);
-    return ret;
+    return kfs_file_fallocate(file->dentry->inode, mode, offset, length);
 }
 #endif
 
@@ -771,7 +904,22 @@ static int kfs_removexattr(const char *path, const char *name)
 }
 #endif /* KFS_HAVE_SETXATTR */
 
+static void *kfs_fuse_init(struct fuse_conn_info *conn)
+{
+    conn->want |= (conn->capable & KFS_FUSE_SPLICE_CAPS);
+
+    /* Threads can't be created before fuse_main() daemonize */
+    if (kfs_start_flusher(&fs)) {
+        kwarn("Start flusher failed, metadata will be synced at umount\n");
+    }
+    if (kfs_lockstat_start()) {
+        kwarn("Start lock stats failed, only logged at umount\n");
+    }
+    return &fs;
+}
+
 static struct fuse_operations kfs_operations = {
+    .init       = kfs_fuse_init,
     .getattr    = kfs_getattr,
     .access        = kfs_access,
     .readlink    = kfs_readlink,
@@ -793,6 +941,8 @@ static struct fuse_operations kfs_operations = {
     .open        = kfs_open,
     .read        = kfs_read,
     .write        = kfs_write,
+    .read_buf    = kfs_read_buf,
+    .write_buf   = kfs_write_buf,
     .statfs        = kfs_statfs,
     .release    = kfs_release,
     .fsync        = kfs_fsync,
@@ -805,6 +955,8 @@ static struct fuse_operations kfs_operations = {
     .listxattr    = kfs_listxattr,
     .removexattr    = kfs_removexattr,
 #endif
+    /* The fh ops go on with a NULL path once the open file is unlinked */
+    .flag_nullpath_ok = 1,
 };
 
 static int kfs_mount()
@@ -812,22 +964,33 @@ static int kfs_mount()
     int ret;
 
     kfs_init(&fs);
-
-    fs.fd = open(kfs_param.filename, O_RDWR|O_NOFOLLOW);
-    if (fs.fd < 0) {
-        ret = -errno;
-        kerr("Open file %s failed: %s\n", kfs_param.filename, strerror(ret));
+    fs.mntopt.update_daley = kfs_param.updateDelay;
+    fs.mntopt.dirty_thresh = kfs_param.dirtyThresh;
+    fs.mntopt.dirty_limit = kfs_param.dirtyLimit;
+    fs.mntopt.inode_dirty_limit = kfs_param.inodeDirtyLimit;
+    if (kfs_param.odirect) {
+        fs.mntopt.flags |= KFS_MNT_ODIRECT;
+    }
+    if (kfs_param.mmapMeta) {
+        fs.mntopt.flags |= KFS_MNT_MMAP;
+    }
+    if (kfs_param.exactStatfs) {
+        fs.mntopt.flags |= KFS_MNT_EXACT_STATFS;
+    }
+    ret = kfs_check_mntopt(&fs.mntopt);
+    if (ret) {
         return ret;
     }
 
-    ret = kfs_read_sb(&fs);
+    ret = kfs_io_engine(kfs_param.ioEngine);
     if (ret < 0) {
-        goto err;
+        return ret;
     }
+    fs.mntopt.io_engine = ret;
 
-    ret = kfs_build_bgs(&fs);
+    ret = kfs_open_fs(&fs, kfs_param.filename);
     if (ret < 0) {
-        goto err;
+        return ret;
     }
 
     kfs_init_dentry(&root, "/", 1);
@@ -838,33 +1001,34 @@ static int kfs_mount()
 
     root.inode = kfs_get_inode(&fs, 0);
     if (!root.inode) {
+        ret = -EIO;
         goto err;
     }
+    root.inode->dentry = &root;
 
     return 0;
 
   err:
+    kfs_io_exit(&fs);
     close(fs.fd);
     return ret;
 }
 
 static void kfs_umount()
 {
-    int ret;
-    ret = kfs_sync_fs(&fs);
-    if (ret) {
-        kwarn("Sync filesystem failed\n");
-    }
-    ret = close(fs.fd);
-    if (ret) {
-        kwarn("Sync filesystem failed\n");
-    }
+    kfs_close_fs(&fs);
+    kfs_lockstat_report();
 }
 
 int main(int argc, char *argv[])
 {
     int ret;
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+#ifdef KFS_FS_THREADPOOL
+    struct fuse *f;
+    char *mountpoint;
+    int multithreaded;
+#endif
 
     openlog("KFS", LOG_PID|LOG_CONS, LOG_USER);
     setlogmask(LOG_UPTO(LOG_DEBUG));
@@ -879,6 +1043,15 @@ int main(int argc, char *argv[])
         return 1;
     }
     kfs_log_level = kfs_param.logLevel;
+
+    /*
+     * An open file keeps its inode once unlinked, no need for libfuse
+     * to hide it under another name.
+     */
+    if (fuse_opt_add_arg(&args, "-ohard_remove")) {
+        printf("failed to add option\n");
+        return 1;
+    }
     kdebug(LOG_OBJECT, "filename: %s\n", kfs_param.filename);
     kdebug(LOG_OBJECT, "logLevel: %d\n", kfs_param.logLevel);
 
@@ -889,7 +1062,36 @@ int main(int argc, char *argv[])
         goto no_mount;
     }
 
+    /*
+     * An O_DIRECT image can't be spliced at any offset, go through
+     * read/write and the aligned buffers of the lib instead.
+     */
+    if (fs.mntopt.flags & KFS_MNT_ODIRECT) {
+        kfs_operations.read_buf = NULL;
+        kfs_operations.write_buf = NULL;
+    }
+
+#ifdef KFS_FS_THREADPOOL
+    /* fuse_main() with our workers instead of fuse_loop_mt() */
+    f = fuse_setup(args.argc, args.argv, &kfs_operations,
+            sizeof(kfs_operations), &mountpoint, &multithreaded, NULL);
+    if (!f) {
+        ret = -EIO;
+    } else if (!multithreaded) {
+        ret = fuse_loop(f);
+    } else if (fuse_start_cleanup_thread(f)) {
+        ret = -EIO;
+    } else {
+        ret = kfs_session_loop_pool(fuse_get_session(f), kfs_param.threads,
+                kfs_param.cpuPin);
+        fuse_stop_cleanup_thread(f);
+    }
+    if (f) {
+        fuse_teardown(f, mountpoint);
+    }
+#else
     ret = fuse_main(args.argc, args.argv, &kfs_operations, NULL);
+#endif
     if (ret < 0) {
         kerr("Mount real fs error %d\n", ret);
     }
@@ -0,0 +1,103 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * Helpers shared by the fuse frontends
+ *
+ */
+#ifndef __KFS_FUSE_H__
+#define __KFS_FUSE_H__
+
+static const char kfs_fuse_zero[KFS_BLOCK_SIZE];
+
+#define KFS_FUSE_SPLICE_CAPS \
+    (FUSE_CAP_SPLICE_READ|FUSE_CAP_SPLICE_WRITE|FUSE_CAP_SPLICE_MOVE)
+
+/*
+ * Build a bufvec over the extents given by kfs_file_map(). The mapped
+ * ones point at the image fd, so libfuse can splice them to and from
+ * /dev/fuse, the holes point at a zero buffer. It must be released by
+ * free(). The high level lib also frees every buf->mem of a read_buf
+ * reply, so with own_zero each hole gets a zeroed buffer of its own.
+ */
+static inline struct fuse_bufvec *kfs_fuse_bufvec(int fd,
+        struct kfs_extent *ext, int n, int own_zero)
+{
+    struct fuse_bufvec *bufv;
+    struct fuse_buf *buf;
+    size_t count = 0, len;
+    u64 left;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (ext[i].pos || own_zero) {
+            count++;
+        } else {
+            count += (ext[i].len + KFS_BLOCK_MASK) >> KFS_BLOCK_SHIFT;
+        }
+    }
+
+    bufv = calloc(1, sizeof(*bufv) + (count ? (count - 1) : 0) * sizeof(*buf));
+    if (!bufv) {
+        return NULL;
+    }
+    *bufv = FUSE_BUFVEC_INIT(0);
+    if (count) {
+        bufv->count = count;
+    }
+
+    buf = bufv->buf;
+    for (i = 0; i < n; i++) {
+        if (ext[i].pos) {
+            memset(buf, 0, sizeof(*buf));
+            buf->size = ext[i].len;
+            buf->flags = FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK;
+            buf->fd = fd;
+            buf->pos = ext[i].pos;
+            buf++;
+            continue;
+        }
+        if (own_zero) {
+            memset(buf, 0, sizeof(*buf));
+            buf->size = ext[i].len;
+            buf->mem = calloc(1, ext[i].len);
+            buf->fd = -1;
+            if (!buf->mem) {
+                goto err;
+            }
+            buf++;
+            continue;
+        }
+        for (left = ext[i].len; left; left -= len) {
+            len = (left > KFS_BLOCK_SIZE) ? KFS_BLOCK_SIZE : left;
+            memset(buf, 0, sizeof(*buf));
+            buf->size = len;
+            buf->mem = (void *)kfs_fuse_zero;
+            buf->fd = -1;
+            buf++;
+        }
+    }
+
+    return bufv;
+
+  err:
+    while (buf-- != bufv->buf) {
+        if (!(buf->flags & FUSE_BUF_IS_FD)) {
+            free(buf->mem);
+        }
+    }
+    free(bufv);
+    return NULL;
+}
+
+#ifdef KFS_FS_THREADPOOL
+/* kfs_pool.c */
+extern int kfs_session_loop_pool(struct fuse_session *se, unsigned int threads,
+        int pin);
+#endif
+
+#endif //__KFS_FUSE_H__
@@ -0,0 +1,765 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * KFS in FUSE, low level (inode based) frontend
+ *
+ * The fuse nodeid is the address of the kfs_inode, with the root
+ * inode as FUSE_ROOT_ID. The generation of the node goes with it, so
+ * a reused inode number is never mistaken for the old file. Every
+ * entry replied holds a lookup of the inode, forget drops it, and the
+ * inode is evicted once it's neither looked up nor linked.
+ */
+
+#define FUSE_USE_VERSION 30
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fuse_lowlevel.h>
+#include <kfs.h>
+#include "kfs_fuse.h"
+
+struct kfs fs;
+struct kfs_dentry *root;
+
+struct kfs_params {
+    char *filename;
+    int logLevel;
+    unsigned int updateDelay;
+    unsigned int dirtyThresh;
+    unsigned int dirtyLimit;
+    unsigned int inodeDirtyLimit;
+    char *ioEngine;
+    int odirect;
+    int mmapMeta;
+    int exactStatfs;
+    unsigned int threads;
+    int cpuPin;
+} kfs_param = {
+    .filename = NULL,
+    .logLevel = DEFAULT_LOG_LEVEL,
+    .updateDelay = DEFAULT_UPDATE_DELAY,
+    .dirtyThresh = DEFAULT_DIRTY_THRESH,
+    .dirtyLimit = DEFAULT_DIRTY_LIMIT,
+    .inodeDirtyLimit = DEFAULT_INODE_DIRTY_LIMIT,
+    .ioEngine = NULL,
+    .odirect = 0,
+    .mmapMeta = 0,
+    .exactStatfs = 0,
+    .threads = DEFAULT_THREAD_NUM,
+    .cpuPin = 0
+};
+
+#define KFS_OPT(t, p) { t, offsetof(struct kfs_params, p), 1 }
+
+static const struct fuse_opt kfs_opts[] = {
+    KFS_OPT("-f %s", filename),
+    KFS_OPT("-l %d", logLevel),
+    KFS_OPT("update_delay=%u", updateDelay),
+    KFS_OPT("dirty_bytes=%u", dirtyThresh),
+    KFS_OPT("dirty_limit=%u", dirtyLimit),
+    KFS_OPT("inode_dirty_limit=%u", inodeDirtyLimit),
+    KFS_OPT("io_engine=%s", ioEngine),
+    KFS_OPT("odirect", odirect),
+    KFS_OPT("mmap_meta", mmapMeta),
+    KFS_OPT("exact_statfs", exactStatfs),
+    KFS_OPT("threads=%u", threads),
+    KFS_OPT("cpu_pin", cpuPin),
+    FUSE_OPT_END
+};
+
+static struct kfs_inode *kfs_ll_inode(fuse_ino_t ino)
+{
+    if (ino == FUSE_ROOT_ID) {
+        return root->inode;
+    }
+    return (struct kfs_inode *)(uintptr_t)ino;
+}
+
+static fuse_ino_t kfs_ll_ino(struct kfs_inode *inode)
+{
+    if (inode == root->inode) {
+        return FUSE_ROOT_ID;
+    }
+    return (fuse_ino_t)(uintptr_t)inode;
+}
+
+/* inode comes with the lookup the entry hands to the kernel */
+static void kfs_ll_fill_entry(struct kfs_inode *inode, struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->ino = kfs_ll_ino(inode);
+    e->attr_timeout = DEFAULT_ACTIMEOUT;
+    e->entry_timeout = DEFAULT_ACTIMEOUT;
+
+    kfs_lock_inode(inode);
+    e->generation = inode->node->generation;
+    kfs_inode_stat(inode, &e->attr);
+    kfs_unlock_inode(inode);
+}
+
+static void kfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    conn->want |= (conn->capable & KFS_FUSE_SPLICE_CAPS);
+
+    /* Threads can't be created before the daemonize */
+    if (kfs_start_flusher(&fs)) {
+        kwarn("Start flusher failed, metadata will be synced at umount\n");
+    }
+    if (kfs_lockstat_start()) {
+        kwarn("Start lock stats failed, only logged at umount\n");
+    }
+}
+
+static void kfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct kfs_inode *dir = kfs_ll_inode(parent);
+    struct kfs_inode *inode;
+    struct fuse_entry_param e;
+    int ret;
+
+    kdebug(LOG_VFS, "%s: parent %llu name %s\n", __FUNCTION__,
+            dir->ino, name);
+
+    ret = kfs_lookup_inode(dir, (char *)name, &inode);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    kfs_ll_fill_entry(inode, &e);
+    fuse_reply_entry(req, &e);
+}
+
+/* Make name in parent, reply the entry or create it with fi */
+static void kfs_ll_make(fuse_req_t req, fuse_ino_t parent, const char *name,
+        mode_t mode, struct fuse_file_info *fi)
+{
+    struct kfs_inode *dir = kfs_ll_inode(parent);
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    struct kfs_inode *inode;
+    struct fuse_entry_param e;
+    int ret;
+
+    kdebug(LOG_VFS, "%s: parent %llu name %s mode %o\n", __FUNCTION__,
+            dir->ino, name, mode);
+
+    ret = kfs_create_inode(dir, (char *)name, mode, ctx->uid, ctx->gid, &inode);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    kfs_ll_fill_entry(inode, &e);
+    if (fi) {
+        fi->fh = 0;
+        if (fuse_reply_create(req, &e, fi)) {
+            /* The kernel never saw it, no forget is coming */
+            kfs_put_inode(inode, 1);
+        }
+    } else if (fuse_reply_entry(req, &e)) {
+        kfs_put_inode(inode, 1);
+    }
+}
+
+static void kfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+        mode_t mode, struct fuse_file_info *fi)
+{
+    kfs_ll_make(req, parent, name, (mode & ~S_IFMT) | S_IFREG, fi);
+}
+
+/* Nothing but the mode is kept, only regular files make sense */
+static void kfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+        mode_t mode, dev_t rdev)
+{
+    if (!S_ISREG(mode)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    kfs_ll_make(req, parent, name, mode, NULL);
+}
+
+static void kfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+        mode_t mode)
+{
+    kfs_ll_make(req, parent, name, (mode & ~S_IFMT) | S_IFDIR, NULL);
+}
+
+static void kfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    fuse_reply_err(req, -kfs_remove_inode(kfs_ll_inode(parent), (char *)name, 0));
+}
+
+static void kfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    fuse_reply_err(req, -kfs_remove_inode(kfs_ll_inode(parent), (char *)name, 1));
+}
+
+static void kfs_ll_forget_one(fuse_ino_t ino, u64 nlookup)
+{
+    kfs_put_inode(kfs_ll_inode(ino), nlookup);
+}
+
+static void kfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    kfs_ll_forget_one(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void kfs_ll_forget_multi(fuse_req_t req, size_t count,
+        struct fuse_forget_data *forgets)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        kfs_ll_forget_one(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void kfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    struct kfs_inode *inode = kfs_ll_inode(ino);
+    struct stat st;
+
+    kfs_lock_inode(inode);
+    kfs_inode_stat(inode, &st);
+    kfs_unlock_inode(inode);
+
+    fuse_reply_attr(req, &st, DEFAULT_ACTIMEOUT);
+}
+
+static void kfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+        int to_set, struct fuse_file_info *fi)
+{
+    struct kfs_inode *inode = kfs_ll_inode(ino);
+    struct kfs_node *node = inode->node;
+    time_t now = time(NULL);
+    struct stat st;
+    int ret = 0;
+
+    kdebug(LOG_VFS, "%s: ino %llu to_set %x\n", __FUNCTION__, inode->ino, to_set);
+
+    kfs_lock_inode(inode);
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (S_ISDIR(node->mode)) {
+            ret = -EISDIR;
+            goto out;
+        }
+        ret = kfs_file_truncate(inode, attr->st_size);
+        if (ret) {
+            goto out;
+        }
+    }
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        node->mode = (node->mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+    }
+    if (to_set & FUSE_SET_ATTR_UID) {
+        node->uid = attr->st_uid;
+    }
+    if (to_set & FUSE_SET_ATTR_GID) {
+        node->gid = attr->st_gid;
+    }
+    if (to_set & FUSE_SET_ATTR_ATIME) {
+        node->atime = attr->st_atime;
+    } else if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+        node->atime = now;
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME) {
+        node->mtime = attr->st_mtime;
+    } else if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+        node->mtime = now;
+    }
+    node->ctime = now;
+    mark_inode_dirty(inode);
+    kfs_inode_stat(inode, &st);
+
+  out:
+    kfs_unlock_inode(inode);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_attr(req, &st, DEFAULT_ACTIMEOUT);
+}
+
+static void kfs_ll_open(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    struct kfs_inode *inode = kfs_ll_inode(ino);
+
+    if (S_ISDIR(inode->node->mode)) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    fi->fh = 0;
+    fuse_reply_open(req, fi);
+}
+
+/*
+ * Reply with the image ranges, libfuse splices them to /dev/fuse. The
+ * inode stays locked until the splice is done, so a punch or truncate
+ * can't free the blocks and have them reused under it.
+ */
+static void kfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+        off_t off, struct fuse_file_info *fi)
+{
+    struct kfs_inode *inode = kfs_ll_inode(ino);
+    struct kfs_extent *ext;
+    struct fuse_bufvec *bufv;
+    int n, max = (size >> KFS_BLOCK_SHIFT) + 2;
+
+    kdebug(LOG_VFS, "%s: ino %llu offset %lu size %zd\n",
+            __FUNCTION__, inode->ino, off, size);
+
+    ext = kfs_alloc(MEM_IO, max * sizeof(*ext));
+    if (!ext) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    kfs_lock_inode(inode);
+    n = kfs_file_map(inode, off, size, 0, ext, max);
+    if (n < 0) {
+        fuse_reply_err(req, -n);
+        goto out;
+    }
+
+    bufv = kfs_fuse_bufvec(fs.fd, ext, n, 0);
+    if (!bufv) {
+        fuse_reply_err(req, ENOMEM);
+        goto out;
+    }
+
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    free(bufv);
+
+  out:
+    kfs_unlock_inode(inode);
+    kfs_free(MEM_IO, ext);
+}
+
+/* Read into memory for odirect, the image fd can't be spliced */
+static void kfs_ll_read_copy(fuse_req_t req, fuse_ino_t ino, size_t size,
+        off_t off, struct fuse_file_info *fi)
+{
+    struct kfs_inode *inode = kfs_ll_inode(ino);
+    ssize_t ret;
+    char *buf;
+
+    kdebug(LOG_VFS, "%s: ino %llu offset %lu size %zd\n",
+            __FUNCTION__, inode->ino, off, size);
+
+    buf = kfs_alloc(MEM_IO, size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    ret = kfs_file_read(inode, buf, size, off);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_buf(req, buf, ret);
+    }
+    kfs_free(MEM_IO, buf);
+}
+
+static void kfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+        size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct kfs_inode *inode = kfs_ll_inode(ino);
+    ssize_t ret;
+
+    kdebug(LOG_VFS, "%s: ino %llu offset %lu size %zd\n",
+            __FUNCTION__, inode->ino, off, size);
+
+    ret = kfs_file_write(inode, buf, size, off);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    kfs_balance_dirty(&fs, inode);
+    fuse_reply_write(req, ret);
+}
+
+/* The request data is spliced from /dev/fuse into the image */
+static void kfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+    struct kfs_inode *inode = kfs_ll_inode(ino);
+    struct kfs_extent *ext;
+    struct fuse_bufvec *dst;
+    size_t size = fuse_buf_size(bufv);
+    int n, max = (size >> KFS_BLOCK_SHIFT) + 2;
+    ssize_t ret;
+
+    kdebug(LOG_VFS, "%s: ino %llu offset %lu size %zd\n",
+            __FUNCTION__, inode->ino, off, size);
+
+    ext = kfs_alloc(MEM_IO, max * sizeof(*ext));
+    if (!ext) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    kfs_lock_inode(inode);
+    n = kfs_file_map(inode, off, size, 1, ext, max);
+    if (n < 0) {
+        ret = n;
+        goto out;
+    }
+
+    dst = kfs_fuse_bufvec(fs.fd, ext, n, 0);
+    if (!dst) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = fuse_buf_copy(dst, bufv, 0);
+    if (ret > 0) {
+        kfs_file_written(inode, off, ret);
+    }
+    free(dst);
+
+  out:
+    kfs_unlock_inode(inode);
+    kfs_free(MEM_IO, ext);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    kfs_balance_dirty(&fs, inode);
+    fuse_reply_write(req, ret);
+}
+
+static void kfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, 0);
+}
+
+static void kfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+        struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, -kfs_sync_file(kfs_ll_inode(ino), datasync));
+}
+
+#ifdef KFS_SUPPORT_PREALLOC
+static void kfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+        off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    struct kfs_inode *inode = kfs_ll_inode(ino);
+
+    kdebug(LOG_VFS, "%s: ino %llu mode %x offset %lu length %lu\n",
+            __FUNCTION__, inode->ino, mode, offset, length);
+
+    if ((offset < 0) || (length <= 0)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    fuse_reply_err(req, -kfs_file_fallocate(inode, mode, offset, length));
+}
+#endif
+
+static void kfs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    struct kfs_inode *inode = kfs_ll_inode(ino);
+
+    if (!S_ISDIR(inode->node->mode)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    fi->fh = 0;
+    fuse_reply_open(req, fi);
+}
+
+static size_t kfs_ll_add_entry(fuse_req_t req, char *buf, size_t size,
+        size_t pos, const char *name, struct kfs_inode *inode, off_t next)
+{
+    struct stat st;
+    size_t len;
+
+    memset(&st, 0, sizeof(st));
+    st.st_ino = inode->ino;
+    st.st_mode = inode->node->mode;
+
+    len = fuse_add_direntry(req, buf + pos, size - pos, name, &st, next);
+    if (len > (size - pos)) {
+        return 0;
+    }
+    return len;
+}
+
+static void kfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+        off_t off, struct fuse_file_info *fi)
+{
+    struct kfs_inode *dir = kfs_ll_inode(ino);
+    struct kfs_dentry *dentry;
+    off_t index = 0;
+    size_t pos = 0, len;
+    char *buf;
+
+    buf = kfs_alloc(MEM_IO, size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    if (off < 1) {
+        len = kfs_ll_add_entry(req, buf, size, pos, ".", dir, 1);
+        if (!len) {
+            goto out;
+        }
+        pos += len;
+    }
+    if (off < 2) {
+        len = kfs_ll_add_entry(req, buf, size, pos, "..",
+                (dir->dentry && dir->dentry->parent)?dir->dentry->parent->inode:dir, 2);
+        if (!len) {
+            goto out;
+        }
+        pos += len;
+    }
+
+    if (dir->dentry) {
+        index = 2;
+        lock_dentry(dir->dentry);
+        list_for_each_entry(dentry, &dir->dentry->children, brothers) {
+            index++;
+            if (index <= off) {
+                continue;
+            }
+            len = kfs_ll_add_entry(req, buf, size, pos, dentry->name,
+                    dentry->inode, index);
+            if (!len) {
+                break;
+            }
+            pos += len;
+        }
+        unlock_dentry(dir->dentry);
+    }
+
+  out:
+    fuse_reply_buf(req, buf, pos);
+    kfs_free(MEM_IO, buf);
+}
+
+static void kfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, 0);
+}
+
+static void kfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs st;
+
+    memset(&st, 0, sizeof(st));
+    kfs_fill_statfs(&fs, &st);
+    fuse_reply_statfs(req, &st);
+}
+
+static void kfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops kfs_ll_operations = {
+    .init           = kfs_ll_init,
+    .lookup         = kfs_ll_lookup,
+    .forget         = kfs_ll_forget,
+    .forget_multi   = kfs_ll_forget_multi,
+    .getattr        = kfs_ll_getattr,
+    .setattr        = kfs_ll_setattr,
+    .mknod          = kfs_ll_mknod,
+    .mkdir          = kfs_ll_mkdir,
+    .unlink         = kfs_ll_unlink,
+    .rmdir          = kfs_ll_rmdir,
+    .create         = kfs_ll_create,
+    .access         = kfs_ll_access,
+    .open           = kfs_ll_open,
+    .read           = kfs_ll_read,
+    .write          = kfs_ll_write,
+    .write_buf      = kfs_ll_write_buf,
+    .release        = kfs_ll_release,
+    .fsync          = kfs_ll_fsync,
+#ifdef KFS_SUPPORT_PREALLOC
+    .fallocate      = kfs_ll_fallocate,
+#endif
+    .opendir        = kfs_ll_opendir,
+    .readdir        = kfs_ll_readdir,
+    .releasedir     = kfs_ll_releasedir,
+    .statfs         = kfs_ll_statfs,
+};
+
+static int kfs_ll_mount()
+{
+    int ret;
+
+    kfs_init(&fs);
+    fs.mntopt.update_daley = kfs_param.updateDelay;
+    fs.mntopt.dirty_thresh = kfs_param.dirtyThresh;
+    fs.mntopt.dirty_limit = kfs_param.dirtyLimit;
+    fs.mntopt.inode_dirty_limit = kfs_param.inodeDirtyLimit;
+    if (kfs_param.odirect) {
+        fs.mntopt.flags |= KFS_MNT_ODIRECT;
+    }
+    if (kfs_param.mmapMeta) {
+        fs.mntopt.flags |= KFS_MNT_MMAP;
+    }
+    if (kfs_param.exactStatfs) {
+        fs.mntopt.flags |= KFS_MNT_EXACT_STATFS;
+    }
+    ret = kfs_check_mntopt(&fs.mntopt);
+    if (ret) {
+        return ret;
+    }
+
+    ret = kfs_io_engine(kfs_param.ioEngine);
+    if (ret < 0) {
+        return ret;
+    }
+    fs.mntopt.io_engine = ret;
+
+    ret = kfs_open_fs(&fs, kfs_param.filename);
+    if (ret < 0) {
+        return ret;
+    }
+
+    root = kfs_alloc_dentry("/");
+    if (!root) {
+        ret = -ENOMEM;
+        goto err;
+    }
+    root->parent = root;
+    root->meta.type = S_IFDIR;
+
+    root->inode = kfs_get_inode(&fs, 0);
+    if (!root->inode) {
+        ret = -EIO;
+        goto err;
+    }
+    root->inode->dentry = root;
+    root->meta.ino = root->inode->ino;
+
+    return 0;
+
+  err:
+    if (root) {
+        kfs_free_dentry(root);
+    }
+    kfs_io_exit(&fs);
+    close(fs.fd);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = -1;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_chan *ch;
+    struct fuse_session *se;
+    char *mountpoint;
+    int foreground;
+    int multithreaded;
+
+    openlog("KFS", LOG_PID|LOG_CONS, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_DEBUG));
+
+    if (fuse_opt_parse(&args, &kfs_param, kfs_opts, NULL)) {
+        printf("failed to parse option\n");
+        return 1;
+    }
+
+    if (!kfs_param.filename) {
+        printf("need to give the filename\n");
+        return 1;
+    }
+    kfs_log_level = kfs_param.logLevel;
+
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) {
+        return 1;
+    }
+
+    ret = kfs_ll_mount();
+    if (ret < 0) {
+        goto no_mount;
+    }
+
+    ch = fuse_mount(mountpoint, &args);
+    if (!ch) {
+        ret = -EIO;
+        goto no_chan;
+    }
+
+    if (fs.mntopt.flags & KFS_MNT_ODIRECT) {
+        kfs_ll_operations.read = kfs_ll_read_copy;
+        kfs_ll_operations.write_buf = NULL;
+    }
+
+    se = fuse_lowlevel_new(&args, &kfs_ll_operations,
+            sizeof(kfs_ll_operations), NULL);
+    if (!se) {
+        ret = -EIO;
+        goto no_session;
+    }
+
+    if (fuse_set_signal_handlers(se) == -1) {
+        ret = -EIO;
+        goto no_signal;
+    }
+
+    fuse_session_add_chan(se, ch);
+    fuse_daemonize(foreground);
+#ifdef KFS_FS_THREADPOOL
+    if (multithreaded) {
+        ret = kfs_session_loop_pool(se, kfs_param.threads, kfs_param.cpuPin);
+    } else {
+        ret = fuse_session_loop(se);
+    }
+#else
+    ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+#endif
+    if (ret < 0) {
+        kerr("Mount real fs error %d\n", ret);
+    }
+    fuse_remove_signal_handlers(se);
+    fuse_session_remove_chan(ch);
+
+  no_signal:
+    fuse_session_destroy(se);
+  no_session:
+    fuse_unmount(mountpoint, ch);
+  no_chan:
+    kfs_close_fs(&fs);
+    kfs_lockstat_report();
+  no_mount:
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+    return ret;
+}
@@ -0,0 +1,242 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * Worker pool of the fuse frontends
+ * - A fixed number of workers is started, each one receives and runs
+ *   the requests of the session with its own receive buffer. Unlike
+ *   fuse_session_loop_mt() nothing is started or stopped on demand.
+ * - With cpu_pin worker i is bound to the i-th CPU the daemon may
+ *   run on, modulo their number.
+ * - Each worker keeps the time it spent waiting for a request (idle)
+ *   and running them (busy), logged when the loop ends.
+ */
+
+#define FUSE_USE_VERSION 30
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <time.h>
+#include <fuse_lowlevel.h>
+#include <kfs.h>
+#include "kfs_fuse.h"
+
+#ifdef KFS_FS_THREADPOOL
+
+struct kfs_pool;
+
+struct kfs_worker {
+    pthread_t thread;
+    int id;
+    int cpu;            /* -1 if not pinned */
+    struct kfs_pool *pool;
+    u64 requests;
+    u64 busy_ns;
+    u64 idle_ns;
+};
+
+struct kfs_pool {
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    sem_t finish;
+    int error;
+    int nr;
+    struct kfs_worker workers[MAX_THREAD_NUM];
+};
+
+static u64 kfs_pool_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void kfs_worker_pin(struct kfs_worker *w)
+{
+    cpu_set_t set;
+    int ret;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret) {
+        kwarn("Pin worker %d to cpu %d failed: %s\n",
+                w->id, w->cpu, strerror(ret));
+        w->cpu = -1;
+    }
+}
+
+static void kfs_worker_free(void *buf)
+{
+    kfs_free(MEM_IO, buf);
+}
+
+static void *kfs_worker_main(void *data)
+{
+    struct kfs_worker *w = data;
+    struct kfs_pool *pool = w->pool;
+    size_t bufsize = fuse_chan_bufsize(pool->ch);
+    struct fuse_buf fbuf;
+    struct fuse_chan *ch;
+    char *buf;
+    u64 t0, t1;
+    int res;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    if (w->cpu >= 0) {
+        kfs_worker_pin(w);
+    }
+
+    buf = kfs_alloc(MEM_IO, bufsize);
+    if (!buf) {
+        kerr("Alloc request buffer of worker %d failed\n", w->id);
+        pool->error = -ENOMEM;
+        goto out;
+    }
+    kdebug(LOG_THREADS, "worker %d started cpu %d\n", w->id, w->cpu);
+
+    pthread_cleanup_push(kfs_worker_free, buf);
+    t0 = kfs_pool_now();
+    while (!fuse_session_exited(pool->se)) {
+        memset(&fbuf, 0, sizeof(fbuf));
+        fbuf.mem = buf;
+        fbuf.size = bufsize;
+        ch = pool->ch;
+        /* Only cancelled while waiting, never in the middle of a request */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_session_receive_buf(pool->se, &fbuf, &ch);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            if (res < 0) {
+                pool->error = res;
+            }
+            break;
+        }
+
+        t1 = kfs_pool_now();
+        w->idle_ns += t1 - t0;
+        fuse_session_process_buf(pool->se, &fbuf, ch);
+        t0 = kfs_pool_now();
+        w->busy_ns += t0 - t1;
+        w->requests++;
+    }
+    pthread_cleanup_pop(1);
+
+  out:
+    /* The first one out ends the session */
+    fuse_session_exit(pool->se);
+    sem_post(&pool->finish);
+    return NULL;
+}
+
+static void kfs_pool_stats(struct kfs_pool *pool)
+{
+    struct kfs_worker *w;
+    u64 busy = 0, idle = 0, reqs = 0;
+    int i;
+
+    for (i = 0; i < pool->nr; i++) {
+        w = &pool->workers[i];
+        kinfo("worker %d cpu %d: %llu requests, busy %llu ms, idle %llu ms\n",
+                w->id, w->cpu, w->requests, w->busy_ns / 1000000,
+                w->idle_ns / 1000000);
+        busy += w->busy_ns;
+        idle += w->idle_ns;
+        reqs += w->requests;
+    }
+    kinfo("%d workers: %llu requests, busy %llu%%\n", pool->nr, reqs,
+            (busy + idle) ? (busy * 100 / (busy + idle)) : 0);
+}
+
+/*
+ * Run the session with threads workers until it exits, the fuse
+ * signal handlers end it the same way.
+ */
+int kfs_session_loop_pool(struct fuse_session *se, unsigned int threads, int pin)
+{
+    struct kfs_pool *pool;
+    struct kfs_worker *w;
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int ncpu = 0, i, ret = 0;
+
+    if ((threads < MIN_THREAD_NUM) || (threads > MAX_THREAD_NUM)) {
+        kerr("threads should be between %d and %d\n",
+                MIN_THREAD_NUM, MAX_THREAD_NUM);
+        return -EINVAL;
+    }
+
+    if (pin) {
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+            kwarn("Get cpu affinity failed: %s\n", strerror(errno));
+        }
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i, &allowed)) {
+                cpus[ncpu++] = i;
+            }
+        }
+    }
+
+    pool = kfs_alloc(MEM_FS, sizeof(*pool));
+    if (!pool) {
+        kerr("Alloc worker pool failed\n");
+        return -ENOMEM;
+    }
+    memset(pool, 0, sizeof(*pool));
+    pool->se = se;
+    pool->ch = fuse_session_next_chan(se, NULL);
+    sem_init(&pool->finish, 0, 0);
+
+    for (i = 0; i < threads; i++) {
+        w = &pool->workers[i];
+        w->id = i;
+        w->cpu = ncpu ? cpus[i % ncpu] : -1;
+        w->pool = pool;
+        ret = pthread_create(&w->thread, NULL, kfs_worker_main, w);
+        if (ret) {
+            kerr("Start worker %d failed: %s\n", i, strerror(ret));
+            fuse_session_exit(se);
+            ret = -ret;
+            break;
+        }
+        pool->nr++;
+    }
+    kinfo("Started %d workers%s\n", pool->nr, ncpu ? ", pinned" : "");
+
+    /* Also woken up by the signals ending the session */
+    while (pool->nr && !fuse_session_exited(se)) {
+        sem_wait(&pool->finish);
+    }
+
+    for (i = 0; i < pool->nr; i++) {
+        pthread_cancel(pool->workers[i].thread);
+    }
+    for (i = 0; i < pool->nr; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    kfs_pool_stats(pool);
+    if (!ret) {
+        ret = pool->error;
+    }
+    sem_destroy(&pool->finish);
+    kfs_free(MEM_FS, pool);
+
+    return ret;
+}
+
+#endif /* KFS_FS_THREADPOOL */
@@ -52,6 +52,8 @@
 #include <sys/time.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
 #ifdef KFS_HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
@@ -71,9 +73,44 @@ struct kfs_sb {
     u64 dbg_num;
     u64 ibg_num;
     u64 mount_times;
-    u64 umount_times;
+    u64 umount_times;   /* The same as mount_times after a clean umount */
     struct timespec mount_time;
     struct timespec umount_time;
+    u32 generation;
+    u64 journal;        /* First block of the journal, 0 if none */
+    u32 journal_blocks;
+    u64 gdt;            /* First block of the group descriptor table */
+    u32 gdt_blocks;
+    u32 flex_bgs;       /* bgs with their bitmaps in one run, 0 if not */
+    u64 icursor;        /* id of the first bg with room, at clean umount */
+    u64 dcursor;
+    u32 csum;           /* crc32c of the sb, see kfs_meta_csum() */
+} __attribute__((packed));
+
+/*
+ * Journal: block 0 is the jsb, the transactions follow from block 1.
+ * A transaction is a jhdr and its jrecs, then the bytes of the records
+ * from the next block on. csum covers it all with csum 0.
+ */
+struct kfs_jsb {
+    u32 magic;
+    u32 blocks;
+    u64 seq;            /* of the transaction at tail */
+    u32 tail;           /* First transaction not checkpointed */
+} __attribute__((packed));
+
+struct kfs_jhdr {
+    u32 magic;
+    u32 nr;             /* jrecs */
+    u64 seq;
+    u32 blocks;         /* The whole transaction */
+    u32 csum;
+} __attribute__((packed));
+
+struct kfs_jrec {
+    u64 pos;            /* Where the bytes go in the image */
+    u32 len;
+    u32 pad;
 } __attribute__((packed));
 
 #define KFS_BG_INODE    1
@@ -82,8 +119,37 @@ struct kfs_sb {
 struct kfs_bgd {
     u32 type;
     u32 used;
+    u32 cursor;     /* No free bit before it */
+    u32 maxrun;     /* Longest run of free bits, 0 if not known */
+    u32 csum;       /* crc32c of the bitmap, as last written */
+} __attribute__((packed));
+
+/*
+ * The group descriptor table has one entry per bg, in the order they
+ * were added. It's what mount reads, the bgd block of each bg is only
+ * a copy of it.
+ * With flex_bgs the bgs have no bgd block and bitmap of their own,
+ * the bitmaps of entries i * flex_bgs to (i + 1) * flex_bgs - 1 are
+ * the flex_bgs blocks right before the first of them.
+ * cursor and maxrun summarize the bitmap, so a clean mount can pick
+ * bgs without reading any. They are trusted only after a clean umount,
+ * see kfs_load_summary().
+ * The entry and the bitmap each have a crc32c here, checked when they
+ * are read in, see kfs_check_csum().
+ */
+struct kfs_gde {
+    u64 bno;        /* First block of the bg, its bgd block if any */
+    u64 pad;
+    u16 type;
+    u16 used;       /* The counts fit, a bitmap is a block */
+    u16 cursor;
+    u16 maxrun;
+    u32 map_csum;   /* bgd.csum */
+    u32 csum;       /* crc32c of the entry */
 } __attribute__((packed));
 
+#define KFS_GDE_PER_BLOCK (KFS_BLOCK_SIZE / sizeof(struct kfs_gde))
+
 struct kfs_bitmap {
     u8 bitmap[KFS_BLOCK_SIZE];
 };
@@ -94,46 +160,226 @@ struct ihash {
     pthread_mutex_t lock;
 };
 
+/* The bgd block and the bitmap, as they are on disk */
+struct kfs_bg_meta {
+    union {
+        struct kfs_bgd bgd;
+        u8 bgd_block[KFS_BGD_SIZE];
+    };
+    struct kfs_bitmap bitmap;
+};
+
 struct kfs_bg {
+    struct kfs_bgd bgd;     /* Always there, copied to meta when written */
+    /*
+     * Block aligned copy, or in place with mmap_meta. Read in on the
+     * first alloc or free in the bg, NULL while it's cold. With
+     * flex_bgs there is no meta, the bitmap is in the one of the flex.
+     */
+    struct kfs_bg_meta *meta;
+    struct kfs_bitmap *bitmap;
+    struct kfs_flex *flex;
+    u64 mapb;               /* Block of the bitmap */
     u64 bno;
     u64 bid;
     struct kfs *fs;
-    struct kfs_bgd bgd;
-    struct kfs_bitmap bitmap;
     struct list_head link;
-    struct ihash ihash[KFS_IHASH_SLOT];
+    struct ihash *ihash;    /* Inode bgs only */
+    time_t atime;           /* Last alloc or free */
+    u32 slot;               /* Entry in the group descriptor table */
     pthread_mutex_t lock;
-    u32 state;
-} __attribute__((packed));
+    u64 state;              /* KFS_*_BIT, see kfs_set_bit_atomic() */
+};
+
+/* flex_bgs consecutive bgs and their bitmaps, see flexbg.c */
+struct kfs_flex {
+    struct list_head link;
+    pthread_mutex_t lock;
+    u64 bno;                /* First block of the bitmaps */
+    struct kfs_bitmap *bitmaps;     /* Loaded like bg->meta */
+    u64 dirty;              /* Bitmaps to write, a bit per bg */
+    u64 writing;
+    u32 nr;
+    struct kfs_bg *bgs[0];
+};
+
+/* The journal as it's being written, see journal.c */
+struct kfs_journal {
+    u64 bno;            /* 0 without journal */
+    u32 blocks;
+    u32 head;           /* Where the next transaction goes */
+    u64 seq;            /* of the next transaction */
+    u64 tail_seq;       /* of the first one not checkpointed */
+    u32 tail;
+    int full;           /* Warned about a sync bigger than the journal */
+};
+
+/* kfs_mount_opt flags */
+#define KFS_MNT_ODIRECT     0x1     /* Open the image with O_DIRECT */
+#define KFS_MNT_MMAP        0x2     /* Metadata in place in a shared mapping */
+#define KFS_MNT_EXACT_STATFS 0x4    /* statfs counts the bgs, see kfs_fill_statfs() */
 
 struct kfs_mount_opt {
     u32 flags;
-    u32 update_daley;
+    u32 update_daley;   /* Seconds between background flushes, 0 = umount only */
+    u32 dirty_thresh;   /* Dirty bytes to wake the flusher early */
+    u32 dirty_limit;    /* Dirty bytes at which writers are blocked */
+    u32 inode_dirty_limit; /* Dirty bytes one inode may hold */
+    u32 io_engine;      /* KFS_IO_PSYNC or KFS_IO_URING */
 };
 
-#define kfs_ibg_size(fs)        ((fs)->sb.ibg_size)
-#define kfs_dbg_size(fs)        ((fs)->sb.dbg_size)
+#define kfs_ibg_size(fs)        ((fs)->sb->ibg_size)
+#define kfs_dbg_size(fs)        ((fs)->sb->dbg_size)
 
+/* state of the fs, bgs and inodes, changed with kfs_set_bit_atomic() and co */
 #define KFS_INIT_BIT     0
 #define KFS_OK_BIT       1
 #define KFS_DIRTY_BIT    2
+#define KFS_DSYNC_BIT    3   /* Inode: the data can't be read back without it */
+#define KFS_CLEAN_BIT    4   /* fs: mounted after a clean umount, checksums hold */
+#define KFS_DEAD_BIT     5   /* Inode: evicted, not in the ihash lookups */
+#define KFS_FREE_BIT     6   /* Inode: free the ino once the cleared node is written */
+
+/* kfs_bmap() allocated the block */
+#define KFS_BMAP_NEW     1
+
+/*
+ * Top bit of a data block pointer: the block is reserved by fallocate
+ * but never written, it reads as zeroes.
+ */
+#define KFS_BLOCK_UNWRITTEN     (1ULL << 63)
+#define kfs_block_bno(ptr)      ((ptr) & ~KFS_BLOCK_UNWRITTEN)
+
+/* Flusher state bits */
+#define KFS_FLUSH_RUN_BIT   0
+#define KFS_FLUSH_WAKE_BIT  1
+
+/* Lock classes of the contention profile, see KFS_LOCK_STAT */
+#define KFS_LOCK_EXTEND     0   /* fs->extend_lock */
+#define KFS_LOCK_IBGS       1   /* The inode bg list, lock_bgs() */
+#define KFS_LOCK_DBGS       2   /* The data bg list */
+#define KFS_LOCK_BG         3   /* bg->lock */
+#define KFS_LOCK_IHASH      4   /* ihash[].lock of an inode bg */
+#define KFS_LOCK_INODE      5   /* inode->lock */
+#define KFS_LOCK_DENTRY     6   /* dentry->lock */
+#define KFS_LOCK_CLASSES    7
+
+/* I/O backends */
+#define KFS_IO_PSYNC    0
+#define KFS_IO_URING    1
+
+#define KFS_IO_READ     0
+#define KFS_IO_WRITE    1
+#define KFS_IO_MSYNC    2       /* msync() of map + pos, len */
+
+#define KFS_IO_MAX_VEC  4
+#define KFS_IO_INLINE   4
+
+struct kfs_io {
+    u32 op;
+    int iovcnt;
+    struct iovec iov[KFS_IO_MAX_VEC];
+    u64 pos;
+    size_t len;
+    ssize_t ret;
+    void (*end_io)(struct kfs_io *io, int err);
+    void *private;
+};
+
+struct kfs_io_batch {
+    struct kfs *fs;
+    struct kfs_io *ios;
+    int nr;
+    int max;
+    struct kfs_io inline_ios[KFS_IO_INLINE];
+};
+
+struct kfs_io_ops {
+    const char *name;
+    int (*init)(struct kfs *fs);
+    void (*exit)(struct kfs *fs);
+    /* Run nr io and wait for all of them, the result is in io->ret */
+    int (*submit)(struct kfs *fs, struct kfs_io *ios, int nr);
+};
+
+/* Block aligned bounce buffers for odirect */
+struct kfs_dio {
+    pthread_mutex_t lock;
+    pthread_cond_t wait;
+    void *bufs[KFS_DIO_BUFS];
+    int nr_free;
+    int nr_alloc;
+    /* Serialize read-modify-write of the same block */
+    pthread_mutex_t rmw[KFS_DIO_RMW_LOCKS];
+};
+
+/*
+ * What was allocated and freed since the last fold into the sb, see
+ * kfs_fold_counts(). A thread adds to its own shard, a line each.
+ */
+struct kfs_count {
+    long long iused;
+    long long bused;
+} __attribute__((aligned(KFS_CACHELINE)));
+
+/* A thread walking the bg lists, see lock_bgs() */
+struct kfs_reader {
+    u64 epoch;              /* of fs when it went in, 0 when out */
+    u32 nest;
+} __attribute__((aligned(KFS_CACHELINE)));
 
 struct kfs {
-    struct kfs_sb sb;
+    struct kfs_sb *sb;      /* sb_buf, or in place with mmap_meta */
+    struct kfs_sb sb_buf;
     struct kfs_mount_opt mntopt;
     struct list_head ibgs;
     struct list_head dbgs;
-    pthread_rwlock_t extend_ibg_lock;
+    pthread_rwlock_t extend_ibg_lock;   /* Readers without a kfs_reader */
     pthread_rwlock_t extend_dbg_lock;
     pthread_rwlock_t sb_lock;
     pthread_mutex_t extend_lock;
     pthread_mutex_t lock;
+    pthread_t flusher;
+    pthread_mutex_t flush_lock;
+    pthread_cond_t flush_cond;
+    pthread_cond_t dirty_cond;
+    u64 dirty_bytes;
+    u64 flush_state;
+    pthread_mutex_t data_lock;
+    struct list_head data_inodes;   /* With data not fdatasync'ed yet */
+    pthread_mutex_t sync_lock;      /* One kfs_sync_fs() at a time */
+    pthread_mutex_t commit_lock;
+    pthread_cond_t commit_cond;
+    u64 commit_seq;         /* Last commit started */
+    u64 commit_done;        /* Last commit finished */
+    u64 commit_err_seq;     /* Last commit failed */
+    int commit_err;
+    int commit_meta;        /* The next commit writes the metadata back */
+    int committing;
     u64 filesize;
-    u32 state;
+    u64 state;
     u32 inode_per_bg;
     u32 block_per_bg;
     time_t synctime;
+    time_t evicttime;       /* Last look for cold bitmaps */
     int fd;
+    struct kfs_io_ops *io_ops;
+    void *io_priv;
+    struct kfs_dio dio;
+    char *map;              /* Image mapping of mmap_meta */
+    u64 map_size;
+    struct kfs_journal journal;
+    struct kfs_gde *gdt;    /* Block aligned copy, or in place with mmap_meta */
+    u64 *gdt_dirty;         /* A bit per block of the table */
+    struct kfs_bg **slots;  /* The bg of each entry of the table */
+    u32 nslots;             /* Entries with a bg, set with release */
+    struct list_head flexes;
+    struct kfs_bg *icursor; /* No room in the bgs before, atomic */
+    struct kfs_bg *dcursor;
+    u32 generation;         /* Goes to sb->generation at the fold */
+    struct kfs_count counts[KFS_COUNT_SHARDS];
+    u64 epoch;              /* Of the bg lists, from 1, see kfs_synchronize_bgs() */
+    struct kfs_reader readers[KFS_BG_READERS];
 };
 
 struct kfs_node {
@@ -146,18 +392,35 @@ struct kfs_node {
     u32 ctime;
     u32 mtime;
     u32 btime;
-    u64 pad[16 - 5];
+    u32 generation;
+    u32 csum;       /* crc32c of the node */
+    u64 dindb;
+    u64 blocks;     /* Data and indirect blocks mapped */
+    u64 pad[16 - 8];
     u64 db[KFS_DB_NUM];
     u64 indb;
 };
 
 struct kfs_inode {
-    struct kfs_node node;
+    struct kfs_node *node;  /* node_buf, or in place with mmap_meta */
+    struct kfs_node node_buf;
     struct list_head link;
     pthread_mutex_t lock;
     u64 ino;
     struct kfs_bg *bg;
-    u32 state;
+    struct kfs_dentry *dentry;
+    u64 nlookup;
+    u64 dirty_bytes;
+    struct list_head data_link;     /* On fs->data_inodes, under data_lock */
+    u64 dirty_data;     /* Of dirty_bytes, the data written, under data_lock */
+    u64 sync_data;      /* Of it, what a running kfs_sync_data() covers */
+    u64 state;
+};
+
+/* A physically contiguous piece of a file range, pos 0 is a hole */
+struct kfs_extent {
+    u64 pos;
+    u64 len;
 };
 
 struct kfs_entry_meta {
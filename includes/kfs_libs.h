@@ -14,8 +14,14 @@
 
 struct kfs;
 struct kfs_bg;
+struct kfs_bitmap;
 struct kfs_inode;
 struct kfs_dentry;
+struct kfs_mount_opt;
+struct kfs_extent;
+struct kfs_io;
+struct kfs_io_batch;
+struct kfs_io_ops;
 
 #ifndef KFS_KERNEL
 #include <stdio.h>
@@ -164,6 +170,17 @@ extern int kfs_log_level;
 #ifndef KFS_KERNEL
 #define kfs_alloc(mt, s) malloc(s)
 #define kfs_free(mt, p) free(p)
+
+/* Block aligned, for what may go to an O_DIRECT fd. Freed by kfs_free() */
+static inline void *kfs_alloc_aligned(size_t size)
+{
+    void *p;
+
+    if (posix_memalign(&p, KFS_BLOCK_SIZE, size)) {
+        return NULL;
+    }
+    return p;
+}
 #endif
 
 #define do_retry(i, retry) for(i = 0; ((!retry) || (i < retry)); i++)
@@ -220,6 +237,20 @@ static inline void list_add_tail(struct list_head *new, struct list_head *head)
 	__list_add(new, head->prev, head);
 }
 
+/*
+ * Add new at the tail of a list walked with list_for_each_entry_rcu()
+ * meanwhile: new is all set up before the walkers may see it.
+ */
+static inline void list_add_tail_rcu(struct list_head *new, struct list_head *head)
+{
+    struct list_head *prev = head->prev;
+
+    new->next = head;
+    new->prev = prev;
+    __atomic_store_n(&prev->next, new, __ATOMIC_RELEASE);
+    head->prev = new;
+}
+
 static inline void list_del(struct list_head *entry)
 {
 	struct list_head *prev = entry->prev;
@@ -269,6 +300,24 @@ static inline void list_splice(const struct list_head *list,
             &pos->member != (head);    \
             pos = list_entry(pos->member.next, typeof(*pos), member))
 
+#define list_for_each_entry_from(pos, head, member)             \
+    for (; &pos->member != (head);    \
+            pos = list_entry(pos->member.next, typeof(*pos), member))
+
+#define list_next_rcu(ptr)  __atomic_load_n(&(ptr)->next, __ATOMIC_ACQUIRE)
+
+#define list_first_entry_rcu(ptr, type, member) \
+        list_entry(list_next_rcu(ptr), type, member)
+
+#define list_for_each_entry_rcu(pos, head, member)              \
+    for (pos = list_entry(list_next_rcu(head), typeof(*pos), member);  \
+            &pos->member != (head);    \
+            pos = list_entry(list_next_rcu(&pos->member), typeof(*pos), member))
+
+#define list_for_each_entry_from_rcu(pos, head, member)             \
+    for (; &pos->member != (head);    \
+            pos = list_entry(list_next_rcu(&pos->member), typeof(*pos), member))
+
 #define list_for_each_entry_reverse(pos, head, member)          \
     for (pos = list_entry((head)->prev, typeof(*pos), member);  \
             &pos->member != (head);    \
@@ -294,36 +343,175 @@ extern int getm(int size);
 
 extern void kfs_init(struct kfs *fs);
 extern int kfs_build_bgs(struct kfs *fs);
-extern void kfs_init_bg(struct kfs *fs, struct kfs_bg *bg, u64 id, u32 type, u64 offset);
+extern int kfs_init_bg(struct kfs *fs, struct kfs_bg *bg, u64 id, u32 type, u64 offset);
+extern void kfs_free_bg(struct kfs_bg *bg);
+extern int kfs_load_bitmap(struct kfs_bg *bg);
+extern void kfs_evict_bgs(struct kfs *fs, u32 type);
+extern int kfs_create_gdt(struct kfs *fs, u32 blocks);
+extern int kfs_read_gdt(struct kfs *fs);
+extern void kfs_free_gdt(struct kfs *fs);
+extern void kfs_update_gde(struct kfs_bg *bg);
+extern int kfs_sync_gdt(struct kfs *fs, struct kfs_io_batch *batch);
+extern int kfs_convert_fs(struct kfs *fs, char *filename);
+extern void kfs_sync_bg_done(struct kfs_bg *bg, int err);
+extern int kfs_flex_add_bg(struct kfs_bg *bg, u64 bno);
+extern void kfs_flex_del_bg(struct kfs_bg *bg);
+extern int kfs_load_flex(struct kfs_bg *bg);
+extern int kfs_check_bitmap(struct kfs_bg *bg, struct kfs_bitmap *bitmap);
+extern void kfs_flex_dirty(struct kfs_bg *bg);
+extern int kfs_sync_flexes(struct kfs *fs, struct kfs_io_batch *batch);
+extern void kfs_evict_flexes(struct kfs *fs);
+extern void kfs_free_flexes(struct kfs *fs);
+extern void kfs_sum_bg(struct kfs_bg *bg);
+extern u32 kfs_bitmap_weight(struct kfs_bg *bg);
+extern int kfs_count_bg(struct kfs_bg *bg);
+extern int kfs_load_bitmaps(struct kfs *fs, struct kfs_bg **bgs, u32 nr);
+extern int kfs_scan_bgs(struct kfs *fs, u32 threads,
+        int (*fn)(struct kfs_bg *bg, void *priv), void *priv);
+extern struct kfs_bg *kfs_get_cursor(struct kfs *fs, u32 type);
+extern void kfs_set_cursor(struct kfs_bg *bg);
+extern void kfs_rewind_cursor(struct kfs_bg *bg);
+extern u32 kfs_crc32c(u32 crc, const void *buf, size_t len);
+extern u32 kfs_crc32c_soft(u32 crc, const void *buf, size_t len);
+extern u32 kfs_meta_csum(const void *buf, size_t len, size_t off);
+extern void kfs_set_meta_csum(void *buf, size_t len, size_t off);
+extern int kfs_check_csum(struct kfs *fs, u32 csum, u32 want, const char *what, u64 id);
 extern struct kfs_bg *kfs_get_ibg(struct kfs *fs, u64 ino);
 extern void lock_for_extend_fs(struct kfs *fs);
 extern void unlock_for_extend_fs(struct kfs *fs);
 extern void lock_bgs(struct kfs *fs, u32 type);
 extern void unlock_bgs(struct kfs *fs, u32 type);
+extern void publish_bg(struct kfs *fs, struct kfs_bg *bg);
+extern void kfs_synchronize_bgs(struct kfs *fs);
 extern u64 bg_offset(struct kfs_bg *bg);
 extern void lock_bg(struct kfs_bg *bg);
 extern void unlock_bg(struct kfs_bg *bg);
-extern void make_fs_ok(struct kfs *fs, int locked);
-extern void mark_fs_err(struct kfs *fs, int locked);
-extern void mark_fs_dirty(struct kfs *fs, int locked);
+#ifdef KFS_LOCK_STAT
+extern void kfs_mutex_lock(pthread_mutex_t *lock, u32 class);
+extern void kfs_mutex_unlock(pthread_mutex_t *lock, u32 class);
+extern void kfs_rwlock_rdlock(pthread_rwlock_t *lock, u32 class);
+extern void kfs_rwlock_wrlock(pthread_rwlock_t *lock, u32 class);
+extern void kfs_rwlock_unlock(pthread_rwlock_t *lock, u32 class);
+extern int kfs_lockstat_start(void);
+extern void kfs_lockstat_report(void);
+extern void kfs_lockstat_reset(void);
+#else
+#define kfs_mutex_lock(lock, class)     pthread_mutex_lock(lock)
+#define kfs_mutex_unlock(lock, class)   pthread_mutex_unlock(lock)
+#define kfs_rwlock_rdlock(lock, class)  pthread_rwlock_rdlock(lock)
+#define kfs_rwlock_wrlock(lock, class)  pthread_rwlock_wrlock(lock)
+#define kfs_rwlock_unlock(lock, class)  pthread_rwlock_unlock(lock)
+#define kfs_lockstat_start()            0
+#define kfs_lockstat_report()           do { } while (0)
+#define kfs_lockstat_reset()            do { } while (0)
+#endif
+extern void mark_fs_ok(struct kfs *fs);
+extern void mark_fs_err(struct kfs *fs);
+extern void mark_fs_dirty(struct kfs *fs);
+extern void mark_bg_dirty(struct kfs_bg *bg);
 extern void kfs_set_bit(u32 nr, void *addr, pthread_mutex_t *lock);
 extern void kfs_clear_bit(u32 nr, void *addr, pthread_mutex_t *lock);
 extern int kfs_test_bit(u32 nr, void *addr, pthread_mutex_t *lock);
+extern void kfs_set_bit_atomic(u32 nr, u64 *addr);
+extern void kfs_clear_bit_atomic(u32 nr, u64 *addr);
+extern int kfs_test_bit_atomic(u32 nr, const u64 *addr);
+extern int kfs_test_and_set_bit_atomic(u32 nr, u64 *addr);
+extern int kfs_test_and_clear_bit_atomic(u32 nr, u64 *addr);
+extern int kfs_find_and_set_bit_atomic(u64 *addr, u32 size, u32 from);
 extern int kfs_extend_bg(struct kfs *fs, u32 type);
 extern struct kfs_inode *kfs_get_inode(struct kfs *fs, u64 ino);
 extern int kfs_alloc_inode(struct kfs *fs, struct kfs_inode **inodep);
 extern int kfs_alloc_inode_bg(struct kfs_bg *ibg, u64 *ino);
+extern int kfs_free_inode_bg(struct kfs_bg *ibg, u64 ino);
+extern int kfs_free_ino(struct kfs_inode *inode);
 extern int kfs_read_sb(struct kfs *fs);
 extern int kfs_sync_fs(struct kfs *fs);
-extern int kfs_sync_sb(struct kfs *fs);
-extern int kfs_sync_bgs(struct kfs *fs, u32 type);
+extern int kfs_sync_sb(struct kfs *fs, struct kfs_io_batch *batch);
+extern int kfs_sync_bg(struct kfs_bg *bg, struct kfs_io_batch *batch);
+extern int kfs_sync_bgs(struct kfs *fs, u32 type, struct kfs_io_batch *batch);
 extern void kfs_lock_inode(struct kfs_inode *inode);
 extern void kfs_unlock_inode(struct kfs_inode *inode);
-extern void mark_inode_dirty(struct kfs_inode *inode, int locked);
-extern int kfs_sync_inode(struct kfs_inode *inode, int locked);
+extern void mark_inode_dirty(struct kfs_inode *inode);
+extern void kfs_hold_inode(struct kfs_inode *inode);
+extern void kfs_put_inode(struct kfs_inode *inode, u64 n);
+extern int kfs_sync_inode(struct kfs_inode *inode, struct kfs_io_batch *batch);
 extern u64 inode_offset(struct kfs_inode *inode);
 extern void kfs_init_dentry(struct kfs_dentry *dentry, char *name, int namelen);
 extern void kfs_ihash_insert(struct kfs_bg *ibg, struct kfs_inode *inode, int locked);
 extern void kfs_init_inode(struct kfs_inode *inode);
 extern void kfs_inc_iused(struct kfs *fs);
+extern void kfs_dec_iused(struct kfs *fs);
+extern void kfs_inc_bused(struct kfs *fs);
+extern void kfs_add_bused(struct kfs *fs, u64 n);
+extern void kfs_sub_bused(struct kfs *fs, u64 n);
+extern u32 kfs_next_generation(struct kfs *fs);
+extern int kfs_fold_counts(struct kfs *fs);
+extern u64 bg_data_bno(struct kfs_bg *bg);
+extern int kfs_alloc_block(struct kfs *fs, u64 *bno);
+extern int kfs_alloc_block_bg(struct kfs_bg *dbg, u64 *bno);
+extern int kfs_alloc_blocks(struct kfs *fs, u32 want, u64 *bno, u32 *got);
+extern u32 kfs_alloc_blocks_bg(struct kfs_bg *dbg, u32 want, u64 *bno);
+extern int kfs_free_block(struct kfs *fs, u64 bno);
+extern int kfs_free_block_bg(struct kfs_bg *dbg, u64 bno);
+extern void kfs_fill_statfs(struct kfs *fs, struct statvfs *stbuf);
+extern int kfs_check_mntopt(struct kfs_mount_opt *opt);
+extern int kfs_load_summary(struct kfs *fs);
+extern int kfs_save_summary(struct kfs *fs);
+extern int kfs_open_fs(struct kfs *fs, char *filename);
+extern void kfs_close_fs(struct kfs *fs);
+extern void kfs_inode_stat(struct kfs_inode *inode, struct stat *stbuf);
+extern int kfs_bmap(struct kfs_inode *inode, u64 iblock, int create, u64 *bno);
+extern int kfs_file_map(struct kfs_inode *inode, u64 offset, size_t size,
+        int create, struct kfs_extent *ext, int max);
+extern void kfs_file_written(struct kfs_inode *inode, u64 offset, size_t size);
+extern ssize_t kfs_file_read(struct kfs_inode *inode, char *buf, size_t size, u64 offset);
+extern ssize_t kfs_file_write(struct kfs_inode *inode, const char *buf, size_t size, u64 offset);
+extern int kfs_file_fallocate(struct kfs_inode *inode, int mode, u64 offset, u64 len);
+extern int kfs_file_truncate(struct kfs_inode *inode, u64 size);
+extern struct kfs_dentry *kfs_alloc_dentry(char *name);
+extern void kfs_free_dentry(struct kfs_dentry *dentry);
+extern void lock_dentry(struct kfs_dentry *dentry);
+extern void unlock_dentry(struct kfs_dentry *dentry);
+extern struct kfs_dentry *kfs_find_dentry(struct kfs_dentry *parent, char *name);
+extern int kfs_lookup_inode(struct kfs_inode *dir, char *name, struct kfs_inode **inodep);
+extern int kfs_create_inode(struct kfs_inode *dir, char *name, u32 mode,
+        u32 uid, u32 gid, struct kfs_inode **inodep);
+extern int kfs_remove_inode(struct kfs_inode *dir, char *name, int isdir);
+extern void kfs_inc_dirty(struct kfs *fs, u64 bytes);
+extern void kfs_dec_dirty(struct kfs *fs, u64 bytes);
+extern void kfs_inode_inc_dirty(struct kfs_inode *inode, u64 bytes);
+extern void kfs_inode_dec_dirty(struct kfs_inode *inode, u64 bytes);
+extern void kfs_inode_dirty_data(struct kfs_inode *inode, u64 bytes);
+extern int kfs_sync_data(struct kfs *fs, int force);
+extern void kfs_balance_dirty(struct kfs *fs, struct kfs_inode *inode);
+extern int kfs_sync_file(struct kfs_inode *inode, int datasync);
+extern int kfs_journal_replay(struct kfs *fs);
+extern int kfs_journal_load(struct kfs *fs);
+extern int kfs_journal_commit(struct kfs *fs, struct kfs_io_batch *batch);
+extern int kfs_journal_checkpoint(struct kfs *fs);
+extern void kfs_wakeup_flusher(struct kfs *fs);
+extern int kfs_start_flusher(struct kfs *fs);
+extern void kfs_stop_flusher(struct kfs *fs);
+extern struct kfs_io_ops kfs_psync_io_ops;
+extern int kfs_io_engine(const char *name);
+extern int kfs_io_init(struct kfs *fs);
+extern void kfs_io_exit(struct kfs *fs);
+extern void kfs_io_batch_init(struct kfs *fs, struct kfs_io_batch *batch);
+extern void kfs_io_batch_release(struct kfs_io_batch *batch);
+extern struct kfs_io *kfs_io_batch_add(struct kfs_io_batch *batch, u32 op, u64 pos,
+        void (*end_io)(struct kfs_io *io, int err), void *private);
+extern void kfs_io_add_vec(struct kfs_io *io, void *buf, size_t len);
+extern int kfs_io_batch_submit(struct kfs_io_batch *batch);
+extern void kfs_io_batch_cancel(struct kfs_io_batch *batch, int err);
+extern void *kfs_get_iobuf(struct kfs *fs);
+extern void kfs_put_iobuf(struct kfs *fs, void *buf);
+extern ssize_t kfs_pread(struct kfs *fs, void *buf, size_t len, u64 pos);
+extern ssize_t kfs_pwrite(struct kfs *fs, const void *buf, size_t len, u64 pos);
+extern int kfs_map_image(struct kfs *fs, u64 size);
+extern int kfs_map_grow(struct kfs *fs, u64 size);
+extern void kfs_unmap_image(struct kfs *fs);
+#define kfs_map_ptr(fs, pos)    ((void *)((fs)->map + (pos)))
+/* How the metadata is written back */
+#define kfs_meta_io_op(fs)      (((fs)->mntopt.flags & KFS_MNT_MMAP) ? \
+                                 KFS_IO_MSYNC : KFS_IO_WRITE)
 #endif //__KFS_LIBS_H__
@@ -110,7 +110,7 @@
 #define KFS_NO_CRYPTO
 #endif
 
-#if 0
+#if 1
 #define KFS_FS_THREADPOOL
 #endif
 
@@ -182,7 +182,7 @@
 #define KFS_HAVE_SETXATTR
 #endif
 
-#if 0
+#if 1
 #define KFS_SUPPORT_PREALLOC
 #endif
 
@@ -240,6 +240,11 @@
 #define KFS_PERF_TEST
 #endif
 
+/* Lock contention profile, see libs/locks.c */
+#if 0
+#define KFS_LOCK_STAT
+#endif
+
 #ifndef KFS_HIGH_PERF
 #if 0
 #define KFS_MOUNT_DEFAULT_QUOTA
@@ -402,6 +407,31 @@
 #define MAX_IO_MAX 512
 #define MIN_IO_MAX 1
 
+#define DEFAULT_UPDATE_DELAY 5
+#define MAX_UPDATE_DELAY     600
+#define DEFAULT_DIRTY_THRESH (4<<20)      // 4M
+#define MIN_DIRTY_THRESH     (64<<10)     // 64K
+#define DEFAULT_DIRTY_LIMIT  (16<<20)     // 16M
+#define DEFAULT_INODE_DIRTY_LIMIT (4<<20) // 4M
+#define MAX_DIRTY_PAUSE      200          // ms
+#define KFS_IO_DEPTH         64           // io_uring entries
+#define KFS_DIO_BUF_SIZE     (128<<10)    // 128K odirect bounce buffer
+#define KFS_DIO_BUFS         32
+#define KFS_JOURNAL_BLOCKS   1024         // 4M metadata journal
+#define KFS_BG_COLD_TIME     30           // s before a clean bitmap is dropped
+#define KFS_GDT_BLOCKS       64           // Group descriptor table, 8192 bgs
+#define KFS_FLEX_MAX         64           // Most bgs in a flex
+#define KFS_SCAN_THREADS     16           // Most threads of kfs_scan_bgs()
+#define KFS_SCAN_CHUNK       KFS_IO_DEPTH // bgs a scan thread takes at once
+#define KFS_DIO_RMW_LOCKS    64
+#define KFS_COUNT_SHARDS     16           // Of iused/bused, a power of 2
+#define KFS_CACHELINE        64
+#define KFS_BG_READERS       64           // Threads in the bg lists lock free, <= 64
+#define KFS_LOCK_SHARDS      16           // Of the lock stats, a power of 2
+#define KFS_LOCK_BUCKETS     32           // log2 ns of the wait and hold times
+#define KFS_LOCK_HELD        16           // Locks a thread holds at once, timed
+#define KFS_MMAP_MAX         (1ULL<<40)   // Address space kept for mmap_meta
+
 #define DEFAULT_HA_INTERVAL 30
 #define MAX_KFSHAD_INTERVAL 600
 #define MIN_KFSHAD_INTERVAL 1
@@ -435,6 +465,7 @@
 #ifndef KFS_KERNEL
 typedef unsigned long long u64;
 typedef unsigned int u32;
+typedef unsigned short u16;
 typedef unsigned char u8;
 #endif
 
@@ -455,7 +486,9 @@ typedef unsigned char u8;
 #define KFS_NAME "kfs"
 
 #define KFS_SB_MAGIC       0xABCDABCD
-#define KFS_SB_VERSION     1
+#define KFS_SB_VERSION     3          // 2: group descriptor table, 3: crc32c
+#define KFS_JOURNAL_MAGIC  0x4B46534A   // Journal jsb
+#define KFS_JTRANS_MAGIC   0x4B465354   // Journal transaction
 #define KFS_INODE_SIZE  256
 #define KFS_BLOCK_SIZE  4096
 #define KFS_BGD_SIZE    4096
@@ -463,9 +496,11 @@ typedef unsigned char u8;
 #define KFS_BITMAP_SIZE 4096
 #define KFS_BG_META_SIZE (KFS_BGD_SIZE+KFS_BITMAP_SIZE)
 #define KFS_DB_NUM      15
+#define KFS_ADDR_PER_BLOCK (KFS_BLOCK_SIZE / 8) /* u64 block numbers */
 #define KFS_BITMAP_BITS (KFS_BLOCK_SIZE * 8) /* Only 1 block for bitmap */
 #define KFS_BLOCK_SHIFT 12
 #define KFS_INODE_SHIFT 8
+#define KFS_BLOCK_MASK  (KFS_BLOCK_SIZE - 1)
 
 #define KFS_FILENAME_LEN 256
 #define KFS_PATH_LEN     1024
@@ -0,0 +1,492 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * Check an image, unmounted
+ * - The journal is replayed first, as mount does, then three
+ *   kfs_scan_bgs() passes run on the bgs in parallel.
+ * - Pass 1, bitmaps: the used bits of each bg against its table entry,
+ *   their sums against the sb, and the summary after a clean umount.
+ * - Pass 2, inodes: the block map of every used inode is walked, each
+ *   block found is counted for its data bg.
+ * - Pass 3, blocks: the counts against the bitmaps, a used block has one
+ *   inode mapping it, but for the journal, which none maps.
+ * Directories are only kept in memory, there is nothing of them on disk
+ * to check.
+ */
+
+#include <kfs.h>
+
+/* Exit codes, as fsck(8) */
+#define KFSCK_ERRORS    4
+#define KFSCK_FAILED    8
+#define KFSCK_USAGE     16
+
+#define KFSCK_READ      (1 << 20)   // Inode table read at once
+
+static char *pname = NULL;
+
+int kfsck_usage()
+{
+    printf("usage: %s\n", pname);
+    printf("options:\n");
+    printf("    -f|--file filename     image to check\n");
+    printf("    -j|--threads           scan threads (default one per CPU, up to %d)\n",
+            KFS_SCAN_THREADS);
+    return KFSCK_USAGE;
+}
+
+static struct option kfs_kfsck_opts[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "file", required_argument, NULL, 'f' },
+    { "threads", required_argument, NULL, 'j' },
+    { NULL, no_argument, NULL, 0 }
+};
+
+static char file[256];
+static u32 threads = 0;
+static struct kfs fs;
+static struct kfs_bg **dbgs;    /* By bid */
+static u16 **counts;            /* Inode references of each block of a dbg */
+static int clean;
+
+/* Found by the threads */
+static u64 errors;
+static u64 warnings;
+static u64 bytes;
+static u64 iused, bused;
+static u64 inodes, blocks;
+
+#define fsck_error(fmt, args...) do { \
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED); \
+    printf(fmt, ##args); \
+} while (0)
+
+#define fsck_warn(fmt, args...) do { \
+    __atomic_add_fetch(&warnings, 1, __ATOMIC_RELAXED); \
+    printf(fmt, ##args); \
+} while (0)
+
+static u64 kfsck_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static ssize_t kfsck_read(void *buf, size_t len, u64 pos)
+{
+    ssize_t ret;
+
+    ret = kfs_pread(&fs, buf, len, pos);
+    if (ret > 0) {
+        __atomic_add_fetch(&bytes, ret, __ATOMIC_RELAXED);
+    }
+    return ret;
+}
+
+static void kfsck_free_bgs(void)
+{
+    struct kfs_bg *bg, *n;
+
+    list_for_each_entry_safe(bg, n, &fs.ibgs, link) {
+        list_del(&bg->link);
+        kfs_free_bg(bg);
+    }
+    list_for_each_entry_safe(bg, n, &fs.dbgs, link) {
+        list_del(&bg->link);
+        kfs_free_bg(bg);
+    }
+}
+
+/* Pass 1 */
+static int kfsck_bitmap(struct kfs_bg *bg, void *priv)
+{
+    u32 used, saved, no;
+    u8 *bm;
+
+    lock_bg(bg);
+    used = kfs_bitmap_weight(bg);
+    if (used != bg->bgd.used) {
+        fsck_error("bg %llu type %u: %u bits used, its entry says %u\n",
+                bg->bid, bg->bgd.type, used, bg->bgd.used);
+    }
+    __atomic_add_fetch((bg->bgd.type == KFS_BG_INODE) ? &iused : &bused,
+            used, __ATOMIC_RELAXED);
+
+    /* Mount trusts the summary after a clean umount only */
+    if (clean) {
+        bm = bg->bitmap->bitmap;
+        for (no = 0; no < bg->bgd.cursor; no++) {
+            if (!kfs_test_bit(no, bm, NULL)) {
+                fsck_error("bg %llu type %u: bit %u free before cursor %u\n",
+                        bg->bid, bg->bgd.type, no, bg->bgd.cursor);
+                break;
+            }
+        }
+        if (bg->bgd.maxrun) {
+            saved = bg->bgd.maxrun;
+            bg->bgd.maxrun = 0;
+            kfs_sum_bg(bg);
+            if (bg->bgd.maxrun != saved) {
+                fsck_error("bg %llu type %u: longest free run %u, its entry says %u\n",
+                        bg->bid, bg->bgd.type, bg->bgd.maxrun, saved);
+            }
+            bg->bgd.maxrun = saved;
+        }
+    }
+    unlock_bg(bg);
+
+    return 0;
+}
+
+/* The data bg of bno, NULL if none */
+static struct kfs_bg *kfsck_find_dbg(u64 bno)
+{
+    u64 lo = 0, hi = fs.sb->dbg_num, mid;
+    u64 first;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        first = bg_data_bno(dbgs[mid]);
+        if (bno < first) {
+            hi = mid;
+        } else if (bno >= (first + fs.block_per_bg)) {
+            lo = mid + 1;
+        } else {
+            return dbgs[mid];
+        }
+    }
+    return NULL;
+}
+
+/* Count a block ino maps, 0 if it can be followed */
+static int kfsck_count(u64 ino, u64 bno)
+{
+    struct kfs_bg *dbg = kfsck_find_dbg(bno);
+
+    if (!dbg) {
+        fsck_error("ino %llu: block %llu is not in a data bg\n", ino, bno);
+        return -EINVAL;
+    }
+    __atomic_add_fetch(&counts[dbg->bid][bno - bg_data_bno(dbg)], 1,
+            __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Count the blocks of the indirect block bno, and of the ones they
+ * point to for depth 2. Return how many there are, buf is one block
+ * per depth.
+ */
+static u64 kfsck_walk(u64 ino, u64 bno, int depth, u64 *buf)
+{
+    u64 nr = 1;
+    u32 i;
+
+    if (kfsck_count(ino, bno)) {
+        return nr;
+    }
+    if (kfsck_read(buf, KFS_BLOCK_SIZE, bno << KFS_BLOCK_SHIFT) != KFS_BLOCK_SIZE) {
+        fsck_error("ino %llu: read indirect block %llu failed %s\n", ino, bno,
+                strerror(errno));
+        return nr;
+    }
+
+    for (i = 0; i < KFS_ADDR_PER_BLOCK; i++) {
+        if (!buf[i]) {
+            continue;
+        }
+        if (depth > 1) {
+            nr += kfsck_walk(ino, buf[i], depth - 1, buf + KFS_ADDR_PER_BLOCK);
+        } else if (!kfsck_count(ino, buf[i])) {
+            nr++;
+        }
+    }
+    return nr;
+}
+
+static void kfsck_inode(u64 ino, struct kfs_node *node, u64 *buf)
+{
+    u64 nr = 0;
+    u32 i;
+
+    for (i = 0; i < KFS_DB_NUM; i++) {
+        if (node->db[i] && !kfsck_count(ino, node->db[i])) {
+            nr++;
+        }
+    }
+    if (node->indb) {
+        nr += kfsck_walk(ino, node->indb, 1, buf);
+    }
+    if (node->dindb) {
+        nr += kfsck_walk(ino, node->dindb, 2, buf);
+    }
+
+    /* Images older than the count start it at 0 */
+    if (node->blocks != nr) {
+        fsck_warn("ino %llu: maps %llu blocks, its count says %llu\n", ino,
+                nr, node->blocks);
+    }
+    __atomic_add_fetch(&inodes, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&blocks, nr, __ATOMIC_RELAXED);
+}
+
+/* Pass 2, the inode table is read KFSCK_READ at a time */
+static int kfsck_inodes(struct kfs_bg *bg, void *priv)
+{
+    u32 per_read = KFSCK_READ >> KFS_INODE_SHIFT;
+    u32 no, i, last, nr;
+    u64 pos, *buf;
+    char *table;
+    u8 *bm;
+
+    if (bg->bgd.type != KFS_BG_INODE) {
+        return 0;
+    }
+
+    table = kfs_alloc(MEM_FS, KFSCK_READ + (2 * KFS_BLOCK_SIZE));
+    if (!table) {
+        kerr("Alloc inode table buffer failed\n");
+        return -ENOMEM;
+    }
+    buf = (u64 *)(table + KFSCK_READ);
+
+    bm = bg->bitmap->bitmap;
+    for (no = 0; no < fs.inode_per_bg; no += per_read) {
+        last = no + per_read;
+        if (last > fs.inode_per_bg) {
+            last = fs.inode_per_bg;
+        }
+        /* Only up to the last used inode of the piece */
+        for (nr = 0, i = no; i < last; i++) {
+            if (kfs_test_bit(i, bm, NULL)) {
+                nr = i - no + 1;
+            }
+        }
+        if (!nr) {
+            continue;
+        }
+
+        pos = (bg_data_bno(bg) << KFS_BLOCK_SHIFT) + ((u64)no << KFS_INODE_SHIFT);
+        if (kfsck_read(table, nr << KFS_INODE_SHIFT, pos) != (nr << KFS_INODE_SHIFT)) {
+            fsck_error("bg %llu: read inodes %u-%u failed %s\n", bg->bid, no,
+                    no + nr - 1, strerror(errno));
+            continue;
+        }
+        for (i = 0; i < nr; i++) {
+            if (kfs_test_bit(no + i, bm, NULL)) {
+                kfsck_inode((bg->bid * fs.inode_per_bg) + no + i,
+                        (struct kfs_node *)(table + (i << KFS_INODE_SHIFT)), buf);
+            }
+        }
+    }
+
+    kfs_free(MEM_FS, table);
+    return 0;
+}
+
+/* Blocks used by kfs itself, mapped by no inode */
+static int kfsck_reserved(struct kfs_bg *dbg, u64 bno)
+{
+    struct kfs_sb *sb = fs.sb;
+
+    return sb->journal && (bno >= sb->journal)
+        && (bno < (sb->journal + sb->journal_blocks));
+}
+
+/* Pass 3 */
+static int kfsck_blocks(struct kfs_bg *dbg, void *priv)
+{
+    u64 first = bg_data_bno(dbg), bno;
+    u16 *cnt;
+    u32 no;
+    int used;
+
+    if (dbg->bgd.type != KFS_BG_DATA) {
+        return 0;
+    }
+
+    cnt = counts[dbg->bid];
+    lock_bg(dbg);
+    for (no = 0; no < fs.block_per_bg; no++) {
+        used = kfs_test_bit(no, dbg->bitmap->bitmap, NULL);
+        if (!used && !cnt[no]) {
+            continue;
+        }
+
+        bno = first + no;
+        if (kfsck_reserved(dbg, bno)) {
+            if (!used) {
+                fsck_error("block %llu: kfs uses it, but it's free\n", bno);
+            }
+            if (cnt[no]) {
+                fsck_error("block %llu: kfs uses it, but %u inode references\n",
+                        bno, cnt[no]);
+            }
+        } else if (!cnt[no]) {
+            fsck_error("block %llu: used, but no inode maps it\n", bno);
+        } else if (!used) {
+            fsck_error("block %llu: free, but %u inode references\n", bno, cnt[no]);
+        } else if (cnt[no] > 1) {
+            fsck_error("block %llu: %u inode references\n", bno, cnt[no]);
+        }
+    }
+    unlock_bg(dbg);
+
+    return 0;
+}
+
+static int kfsck_open(void)
+{
+    struct kfs_bg *bg;
+    u64 i;
+    int ret;
+
+    kfs_init(&fs);
+    fs.fd = open(file, O_RDWR|O_NOFOLLOW);
+    if (fs.fd < 0) {
+        kerr("Open file %s failed: %s\n", file, strerror(errno));
+        return -errno;
+    }
+
+    ret = kfs_io_init(&fs);
+    if (ret < 0) {
+        goto err;
+    }
+
+    /* Replays the journal */
+    ret = kfs_read_sb(&fs);
+    if (ret < 0) {
+        goto err_io;
+    }
+    clean = (fs.sb->mount_times == fs.sb->umount_times);
+
+    ret = kfs_build_bgs(&fs);
+    if (ret < 0) {
+        goto err_bgs;
+    }
+
+    dbgs = kfs_alloc(MEM_FS, sizeof(*dbgs) * (fs.sb->dbg_num + 1));
+    counts = kfs_alloc(MEM_FS, sizeof(*counts) * (fs.sb->dbg_num + 1));
+    if (!dbgs || !counts) {
+        kerr("Alloc %llu data bgs failed\n", fs.sb->dbg_num);
+        ret = -ENOMEM;
+        goto err_bgs;
+    }
+    memset(counts, 0, sizeof(*counts) * (fs.sb->dbg_num + 1));
+    list_for_each_entry(bg, &fs.dbgs, link) {
+        dbgs[bg->bid] = bg;
+    }
+    for (i = 0; i < fs.sb->dbg_num; i++) {
+        counts[i] = kfs_alloc(MEM_FS, sizeof(**counts) * fs.block_per_bg);
+        if (!counts[i]) {
+            kerr("Alloc block counts of bg %llu failed\n", i);
+            ret = -ENOMEM;
+            goto err_bgs;
+        }
+        memset(counts[i], 0, sizeof(**counts) * fs.block_per_bg);
+    }
+
+    return 0;
+
+  err_bgs:
+    kfsck_free_bgs();
+    kfs_free_flexes(&fs);
+    kfs_free_gdt(&fs);
+  err_io:
+    kfs_io_exit(&fs);
+  err:
+    close(fs.fd);
+    return ret;
+}
+
+static void kfsck_close(void)
+{
+    u64 i;
+
+    for (i = 0; i < fs.sb->dbg_num; i++) {
+        kfs_free(MEM_FS, counts[i]);
+    }
+    kfs_free(MEM_FS, counts);
+    kfs_free(MEM_FS, dbgs);
+    kfsck_free_bgs();
+    kfs_free_flexes(&fs);
+    kfs_free_gdt(&fs);
+    kfs_io_exit(&fs);
+    close(fs.fd);
+}
+
+int main(int argc, char **argv)
+{
+    u64 t0, t1;
+    double secs;
+    char *p;
+    int c, ret;
+
+    pname = argv[0];
+    if ((p = strrchr(pname, '/')) != NULL)
+        pname = p+1;
+
+    while ((c = getopt_long(argc, argv, "hf:j:", kfs_kfsck_opts, NULL)) != -1) {
+        switch (c) {
+            case 'f':
+                snprintf(file, 256, "%s", optarg);
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            default:
+                return kfsck_usage();
+        }
+    }
+
+    if (!file[0]) {
+        return kfsck_usage();
+    }
+
+    t0 = kfsck_now();
+    if (kfsck_open()) {
+        return KFSCK_FAILED;
+    }
+    printf("%s: %llu inode and %llu data bgs, %s\n", file, fs.sb->ibg_num,
+            fs.sb->dbg_num, clean ? "clean" : "not cleanly umounted");
+
+    printf("Pass 1: bitmaps\n");
+    ret = kfs_scan_bgs(&fs, threads, kfsck_bitmap, NULL);
+    if (!ret) {
+        if (iused != fs.sb->iused) {
+            fsck_error("%llu inodes used, the sb says %llu\n", iused, fs.sb->iused);
+        }
+        if (bused != fs.sb->bused) {
+            fsck_error("%llu blocks used, the sb says %llu\n", bused, fs.sb->bused);
+        }
+        printf("Pass 2: inodes\n");
+        ret = kfs_scan_bgs(&fs, threads, kfsck_inodes, NULL);
+    }
+    if (!ret) {
+        printf("Pass 3: blocks\n");
+        ret = kfs_scan_bgs(&fs, threads, kfsck_blocks, NULL);
+    }
+    t1 = kfsck_now();
+
+    /* The bitmaps are read by the scan, outside kfsck_read() */
+    bytes += (fs.sb->ibg_num + fs.sb->dbg_num) << KFS_BLOCK_SHIFT;
+    secs = (t1 - t0) / 1000000000.0;
+    printf("%llu inodes, %llu blocks mapped\n", inodes, blocks);
+    printf("Read %llu MB in %.3f s, %.2f GB/s\n", bytes >> 20, secs,
+            secs ? (bytes / secs) / 1000000000.0 : 0);
+    printf("%llu errors, %llu warnings\n", errors, warnings);
+
+    kfsck_close();
+    if (ret) {
+        kerr("Check failed %d\n", ret);
+        return KFSCK_FAILED;
+    }
+    return errors ? KFSCK_ERRORS : 0;
+}
@@ -25,75 +25,555 @@ u64 bg_offset(struct kfs_bg *bg)
 
 u64 bgmap_offset(struct kfs_bg *bg)
 {
-    return (bg->bno << KFS_BLOCK_SHIFT) + KFS_BGD_SIZE;
+    return bg->mapb << KFS_BLOCK_SHIFT;
 }
 
-static int kfs_find_and_set_bitmap(struct kfs_bitmap *bm)
+/* Take the first free bit of the bitmap of bg, there is none before from */
+static int kfs_find_and_set_bitmap(struct kfs_bg *bg, u32 from)
 {
-    int no = 0;
-    u64 *data64 = (u64 *)(bm->bitmap);
-    u8 *data8;
-    u8 mask = 1;
+    u32 bits = (bg->bgd.type == KFS_BG_INODE) ? bg->fs->inode_per_bg
+        : bg->fs->block_per_bg;
 
-    while (*data64 == 0xFFFFFFFFFFFFFFFFULL) {
-        no += 64;
-        data64++;
-    }
-
-    data8 = (u8*)data64;
-    while (*data8 == 0xFF) {
-        no += 8;
-        data8++;
-    }
-
-    while (*data8 & mask) {
-        no++;
-        mask <<= 1;
-    }
-
-    *data8 |= mask;
-
-    return no;
+    return kfs_find_and_set_bit_atomic((u64 *)bg->bitmap->bitmap, bits, from);
 }
 
-void kfs_init_bg(struct kfs *fs, struct kfs_bg *bg, u64 id, u32 type, u64 offset)
+/*
+ * With mmap_meta the bgd and bitmap are in the map, and the bgd in it
+ * gets the type. Otherwise the bitmap is read in by kfs_load_bitmap()
+ * when the bg is first used. With flex_bgs, kfs_flex_add_bg() tells
+ * where the bitmap is.
+ */
+int kfs_init_bg(struct kfs *fs, struct kfs_bg *bg, u64 id, u32 type, u64 offset)
 {
     int i;
     memset(bg, 0, sizeof(*bg));
+    bg->fs = fs;
+    bg->mapb = (offset + KFS_BGD_SIZE) >> KFS_BLOCK_SHIFT;
+    if ((fs->mntopt.flags & KFS_MNT_MMAP) && !fs->sb->flex_bgs) {
+        bg->meta = kfs_map_ptr(fs, offset);
+        bg->meta->bgd.type = type;
+        bg->bgd = bg->meta->bgd;
+        bg->bitmap = &bg->meta->bitmap;
+    }
     bg->bid = id;
     bg->bgd.type = type;
     bg->state = 0;
 
-    INIT_LIST_HEAD(&bg->link);
-    for (i = 0; i < KFS_IHASH_SLOT; i++) {
-        INIT_LIST_HEAD(&bg->ihash[i].inodes);
-        pthread_mutex_init(&bg->ihash[i].lock, NULL);
+    if (type == KFS_BG_INODE) {
+        bg->ihash = kfs_alloc(MEM_FS, sizeof(*bg->ihash) * KFS_IHASH_SLOT);
+        if (!bg->ihash) {
+            kerr("Alloc inode hash of bg %llu failed\n", id);
+            return -ENOMEM;
+        }
+        for (i = 0; i < KFS_IHASH_SLOT; i++) {
+            INIT_LIST_HEAD(&bg->ihash[i].inodes);
+            pthread_mutex_init(&bg->ihash[i].lock, NULL);
+        }
     }
+
+    INIT_LIST_HEAD(&bg->link);
     pthread_mutex_init(&bg->lock, NULL);
-    bg->fs = fs;
     bg->bno = (offset >> KFS_BLOCK_SHIFT);
+
+    return 0;
+}
+
+void kfs_free_bg(struct kfs_bg *bg)
+{
+    if (bg->meta && !(bg->fs->mntopt.flags & KFS_MNT_MMAP)) {
+        kfs_free(MEM_FS, bg->meta);
+    }
+    if (bg->ihash) {
+        kfs_free(MEM_FS, bg->ihash);
+    }
+    kfs_free(MEM_FS, bg);
+}
+
+/*
+ * Check bitmap, just read in for bg, against the csum in its entry. A
+ * mismatch an unclean umount left is taken over. The bg must be locked.
+ */
+int kfs_check_bitmap(struct kfs_bg *bg, struct kfs_bitmap *bitmap)
+{
+    u32 want = kfs_crc32c(0, bitmap, sizeof(*bitmap));
+    int ret;
+
+    ret = kfs_check_csum(bg->fs, bg->bgd.csum, want, "bitmap of bg", bg->slot);
+    if (ret > 0) {
+        bg->bgd.csum = want;
+        kfs_update_gde(bg);
+        ret = 0;
+    }
+    return ret;
+}
+
+/*
+ * Read in the bitmap of bg, it's needed to alloc or free in it. The
+ * bg must be locked.
+ */
+int kfs_load_bitmap(struct kfs_bg *bg)
+{
+    struct kfs *fs = bg->fs;
+    struct kfs_bg_meta *meta;
+    int ret;
+
+    bg->atime = jiffies;
+    if (bg->bitmap) {
+        return 0;
+    }
+    if (bg->flex) {
+        return kfs_load_flex(bg);
+    }
+
+    meta = kfs_alloc_aligned(sizeof(*meta));
+    if (!meta) {
+        kerr("Alloc bitmap of bg %llu failed\n", bg->bid);
+        return -ENOMEM;
+    }
+    /* The bgd block is filled in when it's written */
+    memset(meta->bgd_block, 0, KFS_BGD_SIZE);
+    if (kfs_pread(fs, &meta->bitmap, sizeof(meta->bitmap),
+                bgmap_offset(bg)) != sizeof(meta->bitmap)) {
+        kerr("Read bitmap of bg %llu failed %s\n", bg->bid,
+                strerror(errno));
+        kfs_free(MEM_FS, meta);
+        return -EIO;
+    }
+    ret = kfs_check_bitmap(bg, &meta->bitmap);
+    if (ret) {
+        kfs_free(MEM_FS, meta);
+        return ret;
+    }
+    bg->meta = meta;
+    bg->bitmap = &meta->bitmap;
+    kdebug2(LOG_OBJECT, "Load bitmap of bg type %u id %llu\n",
+            bg->bgd.type, bg->bid);
+
+    return 0;
+}
+
+/*
+ * kfs_load_bitmap() of nr bgs, for the scans. The bitmaps are read in
+ * one batch, so the backend has all of them in flight, without any bg
+ * locked. One loaded meanwhile is kept. The flexes are read a run at a
+ * time, by the first of their bgs.
+ */
+int kfs_load_bitmaps(struct kfs *fs, struct kfs_bg **bgs, u32 nr)
+{
+    struct kfs_bg_meta **metas;
+    struct kfs_io_batch batch;
+    struct kfs_io *io;
+    struct kfs_bg *bg;
+    u32 i;
+    int ret = 0;
+
+    metas = kfs_alloc(MEM_FS, sizeof(*metas) * nr);
+    if (!metas) {
+        kerr("Alloc %u bitmaps failed\n", nr);
+        return -ENOMEM;
+    }
+    memset(metas, 0, sizeof(*metas) * nr);
+
+    kfs_io_batch_init(fs, &batch);
+    for (i = 0; i < nr; i++) {
+        bg = bgs[i];
+        if (bg->bitmap || bg->flex) {
+            continue;
+        }
+        metas[i] = kfs_alloc_aligned(sizeof(*metas[i]));
+        io = metas[i] ? kfs_io_batch_add(&batch, KFS_IO_READ, bgmap_offset(bg),
+                NULL, NULL) : NULL;
+        if (!io) {
+            kerr("Queue bitmap of bg %llu failed\n", bg->bid);
+            ret = -ENOMEM;
+            break;
+        }
+        memset(metas[i]->bgd_block, 0, KFS_BGD_SIZE);
+        kfs_io_add_vec(io, &metas[i]->bitmap, sizeof(metas[i]->bitmap));
+    }
+    if (ret) {
+        kfs_io_batch_cancel(&batch, ret);
+    } else {
+        ret = kfs_io_batch_submit(&batch);
+    }
+    kfs_io_batch_release(&batch);
+
+    for (i = 0; i < nr; i++) {
+        bg = bgs[i];
+        lock_bg(bg);
+        if (!ret && metas[i] && !bg->bitmap) {
+            ret = kfs_check_bitmap(bg, &metas[i]->bitmap);
+            if (!ret) {
+                bg->meta = metas[i];
+                bg->bitmap = &metas[i]->bitmap;
+                bg->atime = jiffies;
+                metas[i] = NULL;
+            }
+        } else if (!ret && bg->flex && !bg->bitmap) {
+            ret = kfs_load_flex(bg);
+        }
+        unlock_bg(bg);
+        if (metas[i]) {
+            kfs_free(MEM_FS, metas[i]);
+        }
+    }
+    kfs_free(MEM_FS, metas);
+
+    return ret;
+}
+
+/*
+ * Drop the bitmaps nobody used for KFS_BG_COLD_TIME. Only called by
+ * kfs_sync_fs() after its batch is done, so a clean bitmap is on disk
+ * and no write of it is in flight. kfs_evict_flexes() does the bgs of
+ * the flexes.
+ */
+void kfs_evict_bgs(struct kfs *fs, u32 type)
+{
+    struct list_head *bgs;
+    struct kfs_bg *bg;
+    time_t now = jiffies;
+    u32 nr = 0;
+
+    if (fs->mntopt.flags & KFS_MNT_MMAP) {
+        return;
+    }
+
+    bgs = (type == KFS_BG_INODE) ? &fs->ibgs : &fs->dbgs;
+    lock_bgs(fs, type);
+    list_for_each_entry_rcu(bg, bgs, link) {
+        lock_bg(bg);
+        if (bg->meta && ((now - bg->atime) >= KFS_BG_COLD_TIME)
+                && !kfs_test_bit_atomic(KFS_DIRTY_BIT, &bg->state)) {
+            /* Picked from the summary from now on */
+            kfs_sum_bg(bg);
+            kfs_free(MEM_FS, bg->meta);
+            bg->meta = NULL;
+            bg->bitmap = NULL;
+            nr++;
+        }
+        unlock_bg(bg);
+    }
+    unlock_bgs(fs, type);
+
+    if (nr) {
+        kdebug(LOG_OBJECT, "Dropped %u cold bitmaps of type %u\n", nr, type);
+    }
+}
+
+/* Bits of bg, inodes or blocks */
+static u32 kfs_bg_bits(struct kfs_bg *bg)
+{
+    return (bg->bgd.type == KFS_BG_INODE) ? bg->fs->inode_per_bg
+        : bg->fs->block_per_bg;
+}
+
+/*
+ * Work out the longest free run of bg while its bitmap is there, for
+ * the summary kfs_save_summary() leaves. The bg must be locked.
+ */
+void kfs_sum_bg(struct kfs_bg *bg)
+{
+    u8 *bm;
+    u32 no, run = 0, bits = kfs_bg_bits(bg);
+
+    if (!bg->bitmap || bg->bgd.maxrun || (bg->bgd.used == bits)) {
+        return;
+    }
+
+    bm = bg->bitmap->bitmap;
+    for (no = bg->bgd.cursor; no < bits; no++) {
+        if (!(no & 63) && ((bits - no) >= 64)
+                && (*(u64 *)(bm + (no >> 3)) == 0xFFFFFFFFFFFFFFFFULL)) {
+            run = 0;
+            no += 63;
+            continue;
+        }
+        if (kfs_test_bit(no, bm, NULL)) {
+            run = 0;
+            continue;
+        }
+        if (++run > bg->bgd.maxrun) {
+            bg->bgd.maxrun = run;
+        }
+    }
+}
+
+/* Used bits in the bitmap of bg, it must be loaded */
+u32 kfs_bitmap_weight(struct kfs_bg *bg)
+{
+    u64 *bm = (u64 *)bg->bitmap->bitmap;
+    u32 i, used = 0, bits = kfs_bg_bits(bg);
+
+    for (i = 0; i < (bits >> 6); i++) {
+        used += __builtin_popcountll(bm[i]);
+    }
+    for (i = bits & ~63; i < bits; i++) {
+        used += kfs_test_bit(i, bm, NULL) ? 1 : 0;
+    }
+
+    return used;
+}
+
+/*
+ * Count the used bits of bg again from its bitmap, when the summary
+ * can't be trusted, and start its summary over. The bg must be locked.
+ */
+int kfs_count_bg(struct kfs_bg *bg)
+{
+    u32 used;
+    int ret;
+
+    ret = kfs_load_bitmap(bg);
+    if (ret) {
+        return ret;
+    }
+
+    used = kfs_bitmap_weight(bg);
+    if (used != bg->bgd.used) {
+        kwarn("bg type %u id %llu has %u bits used, not %u\n",
+                bg->bgd.type, bg->bid, used, bg->bgd.used);
+        bg->bgd.used = used;
+        mark_bg_dirty(bg);
+    }
+    bg->bgd.cursor = 0;
+    bg->bgd.maxrun = 0;
+    kfs_sum_bg(bg);
+    kfs_update_gde(bg);
+
+    return 0;
+}
+
+/*
+ * The group descriptor table takes sb->gdt_blocks from sb->gdt, all of
+ * it is kept in memory. A bit of gdt_dirty is set for each block with
+ * an entry changed, kfs_sync_gdt() writes them back with the sb.
+ * slots has the bg of each entry, for kfs_find_dbg().
+ */
+static int kfs_alloc_gdt(struct kfs *fs)
+{
+    u32 size = fs->sb->gdt_blocks << KFS_BLOCK_SHIFT;
+    u32 dirty = ((fs->sb->gdt_blocks + 63) >> 6) * sizeof(u64);
+    u32 slots = fs->sb->gdt_blocks * KFS_GDE_PER_BLOCK * sizeof(*fs->slots);
+
+    fs->gdt_dirty = kfs_alloc(MEM_FS, dirty);
+    fs->slots = kfs_alloc(MEM_FS, slots);
+    if (!fs->gdt_dirty || !fs->slots) {
+        kerr("Alloc group descriptor table failed\n");
+        goto err;
+    }
+    memset(fs->gdt_dirty, 0, dirty);
+    memset(fs->slots, 0, slots);
+    fs->nslots = 0;
+
+    if (fs->mntopt.flags & KFS_MNT_MMAP) {
+        fs->gdt = kfs_map_ptr(fs, fs->sb->gdt << KFS_BLOCK_SHIFT);
+        return 0;
+    }
+    fs->gdt = kfs_alloc_aligned(size);
+    if (!fs->gdt) {
+        kerr("Alloc group descriptor table failed\n");
+        goto err;
+    }
+    memset(fs->gdt, 0, size);
+
+    return 0;
+
+  err:
+    kfs_free_gdt(fs);
+    return -ENOMEM;
+}
+
+void kfs_free_gdt(struct kfs *fs)
+{
+    if (fs->gdt && !(fs->mntopt.flags & KFS_MNT_MMAP)) {
+        kfs_free(MEM_FS, fs->gdt);
+    }
+    if (fs->gdt_dirty) {
+        kfs_free(MEM_FS, fs->gdt_dirty);
+    }
+    if (fs->slots) {
+        kfs_free(MEM_FS, fs->slots);
+    }
+    fs->gdt = NULL;
+    fs->gdt_dirty = NULL;
+    fs->slots = NULL;
+    fs->nslots = 0;
+}
+
+/*
+ * Add an empty table of blocks at the end of the image, right after
+ * the sb for mkfs. The caller writes the sb.
+ */
+int kfs_create_gdt(struct kfs *fs, u32 blocks)
+{
+    u64 new_filesize = fs->filesize + ((u64)blocks << KFS_BLOCK_SHIFT);
+    int ret;
+
+    if (ftruncate(fs->fd, new_filesize) < 0) {
+        kerr("Extend fs to %llu failed: %s\n",
+                new_filesize, strerror(errno));
+        return -errno;
+    }
+    fs->sb->gdt = fs->filesize >> KFS_BLOCK_SHIFT;
+    fs->sb->gdt_blocks = blocks;
+
+    ret = kfs_alloc_gdt(fs);
+    if (ret) {
+        fs->sb->gdt = 0;
+        fs->sb->gdt_blocks = 0;
+        if (ftruncate(fs->fd, fs->filesize) < 0) {
+            kerr("Trucate fs back to %llu failed: %s\n",
+                    fs->filesize, strerror(errno));
+        }
+        return ret;
+    }
+    fs->filesize = new_filesize;
+
+    return 0;
+}
+
+/* Read the entries of the bgs in the sb, in one go */
+int kfs_read_gdt(struct kfs *fs)
+{
+    u64 nr = fs->sb->ibg_num + fs->sb->dbg_num;
+    size_t len;
+    int ret;
+
+    if (!fs->sb->gdt || (nr > (fs->sb->gdt_blocks * KFS_GDE_PER_BLOCK))) {
+        kerr("Bad group descriptor table at %llu, %u blocks for %llu bgs\n",
+                fs->sb->gdt, fs->sb->gdt_blocks, nr);
+        return -EINVAL;
+    }
+
+    ret = kfs_alloc_gdt(fs);
+    if (ret || (fs->mntopt.flags & KFS_MNT_MMAP)) {
+        return ret;
+    }
+
+    len = ((nr * sizeof(struct kfs_gde)) + KFS_BLOCK_MASK) & ~KFS_BLOCK_MASK;
+    if (len && (kfs_pread(fs, fs->gdt, len, fs->sb->gdt << KFS_BLOCK_SHIFT) != len)) {
+        kerr("Read group descriptor table failed %s\n", strerror(errno));
+        kfs_free_gdt(fs);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* Copy the bgd of bg to its entry, the bg must be locked */
+void kfs_update_gde(struct kfs_bg *bg)
+{
+    struct kfs *fs = bg->fs;
+    struct kfs_gde *gde = &fs->gdt[bg->slot];
+
+    gde->bno = bg->bno;
+    gde->type = bg->bgd.type;
+    gde->used = bg->bgd.used;
+    gde->cursor = bg->bgd.cursor;
+    gde->maxrun = bg->bgd.maxrun;
+    gde->map_csum = bg->bgd.csum;
+    kfs_set_meta_csum(gde, sizeof(*gde), offsetof(struct kfs_gde, csum));
+    kfs_set_bit_atomic(bg->slot / KFS_GDE_PER_BLOCK, fs->gdt_dirty);
+}
+
+/* The entry of a new bg goes to disk right away, as its bgd block */
+static int kfs_write_gde(struct kfs_bg *bg)
+{
+    struct kfs *fs = bg->fs;
+    u32 block = bg->slot / KFS_GDE_PER_BLOCK;
+
+    kfs_update_gde(bg);
+    if (fs->mntopt.flags & KFS_MNT_MMAP) {
+        return 0;
+    }
+    if (kfs_pwrite(fs, (char *)fs->gdt + (block << KFS_BLOCK_SHIFT),
+                KFS_BLOCK_SIZE, (fs->sb->gdt + block) << KFS_BLOCK_SHIFT)
+            != KFS_BLOCK_SIZE) {
+        kerr("Write group descriptor table failed %s\n", strerror(errno));
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static void kfs_sync_gdt_end(struct kfs_io *io, int err)
+{
+    struct kfs *fs = io->private;
+
+    if (err) {
+        kfs_set_bit_atomic((io->pos >> KFS_BLOCK_SHIFT) - fs->sb->gdt, fs->gdt_dirty);
+        mark_fs_dirty(fs);
+    }
+}
+
+/* Queue the blocks of the table with entries changed to batch */
+int kfs_sync_gdt(struct kfs *fs, struct kfs_io_batch *batch)
+{
+    struct kfs_io *io;
+    u32 i;
+
+    for (i = 0; i < fs->sb->gdt_blocks; i++) {
+        if (!kfs_test_and_clear_bit_atomic(i, fs->gdt_dirty)) {
+            continue;
+        }
+        io = kfs_io_batch_add(batch, kfs_meta_io_op(fs),
+                (fs->sb->gdt + i) << KFS_BLOCK_SHIFT, kfs_sync_gdt_end, fs);
+        if (!io) {
+            kerr("Queue group descriptor table failed\n");
+            kfs_set_bit_atomic(i, fs->gdt_dirty);
+            return -ENOMEM;
+        }
+        kfs_io_add_vec(io, (char *)fs->gdt + (i << KFS_BLOCK_SHIFT),
+                KFS_BLOCK_SIZE);
+    }
+
+    return 0;
 }
 
+/* What a new bg starts with */
+static const struct kfs_bitmap kfs_zero_bitmap;
+
 int kfs_extend_bg(struct kfs *fs, u32 type)
 {
     int ret = 0;
-    u64 new_filesize;
+    u64 new_filesize, offset, run = 0;
     u64 new_id;
     struct kfs_bg *bg;
+    u32 head = KFS_BG_META_SIZE;
 
     bg = kfs_alloc(MEM_FS, sizeof(*bg));
     if (!bg) {
         kerr("Alloc block group object failed\n");
         return -ENOMEM;
     }
+    memset(bg, 0, sizeof(*bg));
+    bg->fs = fs;
 
     lock_for_extend_fs(fs);
+    bg->slot = fs->sb->ibg_num + fs->sb->dbg_num;
+    if (bg->slot >= (fs->sb->gdt_blocks * KFS_GDE_PER_BLOCK)) {
+        kerr("Group descriptor table full, %u bgs\n", bg->slot);
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    offset = fs->filesize;
+    if (fs->sb->flex_bgs) {
+        /* The first bg of a flex comes after the bitmaps of all */
+        head = 0;
+        if (!(bg->slot % fs->sb->flex_bgs)) {
+            run = offset >> KFS_BLOCK_SHIFT;
+            offset += (u64)fs->sb->flex_bgs << KFS_BLOCK_SHIFT;
+        }
+    }
+
     if (type == KFS_BG_INODE) {
-        new_filesize = fs->filesize + kfs_ibg_size(fs) + KFS_BG_META_SIZE;
-        new_id = fs->sb.ibg_num;
+        new_filesize = offset + kfs_ibg_size(fs) + head;
+        new_id = fs->sb->ibg_num;
     } else {
-        new_filesize = fs->filesize + kfs_dbg_size(fs) + KFS_BG_META_SIZE;
-        new_id = fs->sb.dbg_num;
+        new_filesize = offset + kfs_dbg_size(fs) + head;
+        new_id = fs->sb->dbg_num;
     }
 
     ret = ftruncate(fs->fd, new_filesize);
@@ -103,110 +583,324 @@ int kfs_extend_bg(struct kfs *fs, u32 type)
         goto out;
     }
 
-    kfs_init_bg(fs, bg, new_id, type, fs->filesize);
+    if (fs->mntopt.flags & KFS_MNT_MMAP) {
+        /* The map never moves, the bgs and inodes point into it */
+        ret = kfs_map_grow(fs, new_filesize);
+        if (ret) {
+            goto err_truncate;
+        }
+    }
+
+    ret = kfs_init_bg(fs, bg, new_id, type, offset);
+    if (ret) {
+        goto err_truncate;
+    }
+    bg->slot = fs->sb->ibg_num + fs->sb->dbg_num;
+    bg->bgd.maxrun = kfs_bg_bits(bg);
+    bg->bgd.csum = kfs_crc32c(0, &kfs_zero_bitmap, sizeof(kfs_zero_bitmap));
+
+    if (fs->sb->flex_bgs) {
+        /* The bitmap is in the new or zeroed run, nothing to write */
+        ret = kfs_flex_add_bg(bg, run);
+        if (ret) {
+            goto err_truncate;
+        }
+        goto added;
+    }
+
+    if (fs->mntopt.flags & KFS_MNT_MMAP) {
+        /* The type is in the shared page already */
+        ret = 0;
+        goto added;
+    }
 
-    ret = pwrite(fs->fd, &bg->bgd, sizeof(bg->bgd), fs->filesize);
-    if (ret != sizeof(bg->bgd)) {
+    /* Nothing to read, the bitmap of a new bg is empty */
+    bg->meta = kfs_alloc_aligned(sizeof(*bg->meta));
+    if (!bg->meta) {
+        kerr("Alloc bg meta failed\n");
+        ret = -ENOMEM;
+        goto err_truncate;
+    }
+    memset(bg->meta, 0, sizeof(*bg->meta));
+    bg->meta->bgd = bg->bgd;
+    bg->bitmap = &bg->meta->bitmap;
+    bg->atime = jiffies;
+    if (kfs_pwrite(fs, bg->meta->bgd_block, KFS_BGD_SIZE,
+                fs->filesize) != KFS_BGD_SIZE) {
         kerr("Write block group discriptor failed %s\n",
                 strerror(errno));
-        ret = ftruncate(fs->fd, fs->filesize);
-        if (ret < 0) {
-            kerr("Trucate fs back to %llu failed: %s\n",
-                    fs->filesize, strerror(errno));
-            mark_fs_err(fs, 0);
-            /* Can't fix it */
-        }
         ret = -EIO;
-        goto out;
-    } else {
-        ret = 0;
+        goto err_truncate;
     }
 
+  added:
+    /* Mount finds the bg in the table, before the sb counts it */
+    ret = kfs_write_gde(bg);
+    if (ret) {
+        if (bg->flex) {
+            kfs_flex_del_bg(bg);
+        }
+        goto err_truncate;
+    }
     fs->filesize = new_filesize;
 
     if (type == KFS_BG_INODE) {
-        fs->sb.ibg_num++;
-        pthread_rwlock_wrlock(&fs->extend_ibg_lock);
-        list_add_tail(&bg->link, &fs->ibgs);
-        pthread_rwlock_unlock(&fs->extend_ibg_lock);
+        fs->sb->ibg_num++;
     } else {
-        fs->sb.dbg_num++;
-        pthread_rwlock_wrlock(&fs->extend_dbg_lock);
-        list_add_tail(&bg->link, &fs->dbgs);
-        pthread_rwlock_unlock(&fs->extend_dbg_lock);
+        fs->sb->dbg_num++;
+    }
+    publish_bg(fs, bg);
+    mark_fs_dirty(fs);
+    goto out;
+
+  err_truncate:
+    if (ftruncate(fs->fd, fs->filesize) < 0) {
+        kerr("Trucate fs back to %llu failed: %s\n",
+                fs->filesize, strerror(errno));
+        mark_fs_err(fs);
+        /* Can't fix it */
     }
-    mark_fs_dirty(fs, 0);
-
   out:
     unlock_for_extend_fs(fs);
     /* For the success case, the bg will be released by umount */
     if (ret) {
-        kfs_free(MEM_FS, bg);
+        kfs_free_bg(bg);
     }
     return ret;
 }
 
-void mark_bg_dirty(struct kfs_bg *bg, int locked)
+void mark_bg_dirty(struct kfs_bg *bg)
 {
-    kfs_set_bit(KFS_DIRTY_BIT, &bg->state, locked?NULL:&bg->lock);
-    /* Do issue bg update async */
+    /* The bitmap may have changed, the longest run is unknown again */
+    bg->bgd.maxrun = 0;
+    if (!kfs_test_and_set_bit_atomic(KFS_DIRTY_BIT, &bg->state)) {
+        /* The flusher will pick it up */
+        kfs_inc_dirty(bg->fs, sizeof(bg->bgd) + sizeof(*bg->bitmap));
+    }
 }
 
 int kfs_alloc_inode_bg(struct kfs_bg *ibg, u64 *ino)
 {
-    int no;
+    int no, ret;
 
-    no = kfs_find_and_set_bitmap(&ibg->bitmap);
+    ret = kfs_load_bitmap(ibg);
+    if (ret) {
+        return ret;
+    }
+    no = kfs_find_and_set_bitmap(ibg, ibg->bgd.cursor);
+    if (no < 0) {
+        kerr("No free inode in bg %llu, %u used\n", ibg->bid, ibg->bgd.used);
+        return -EIO;
+    }
 
     *ino = (ibg->bid * ibg->fs->inode_per_bg) + no;
     ibg->bgd.used++;
+    ibg->bgd.cursor = no + 1;
 
     KFS_ASSERT(ibg->bgd.used <= ibg->fs->inode_per_bg);
 
-    mark_bg_dirty(ibg, 1);
+    mark_bg_dirty(ibg);
     kfs_inc_iused(ibg->fs);
 
     return 0;
 }
 
-int kfs_sync_bg(struct kfs_bg *bg, int locked)
+/* First data block of a data bg, or the inodes of an inode bg */
+u64 bg_data_bno(struct kfs_bg *bg)
+{
+    if (bg->flex) {
+        return bg->bno;
+    }
+    return bg->bno + (KFS_BG_META_SIZE >> KFS_BLOCK_SHIFT);
+}
+
+int kfs_alloc_block_bg(struct kfs_bg *dbg, u64 *bno)
+{
+    int no, ret;
+
+    ret = kfs_load_bitmap(dbg);
+    if (ret) {
+        return ret;
+    }
+    no = kfs_find_and_set_bitmap(dbg, dbg->bgd.cursor);
+    if (no < 0) {
+        kerr("No free block in bg %llu, %u used\n", dbg->bid, dbg->bgd.used);
+        return -EIO;
+    }
+
+    *bno = bg_data_bno(dbg) + no;
+    dbg->bgd.used++;
+    dbg->bgd.cursor = no + 1;
+
+    KFS_ASSERT(dbg->bgd.used <= dbg->fs->block_per_bg);
+
+    mark_bg_dirty(dbg);
+    kfs_inc_bused(dbg->fs);
+
+    return 0;
+}
+
+/*
+ * Take a run of up to want free blocks of dbg, the first at *bno. The
+ * first run long enough is used, the longest one if none is. Return
+ * the number of blocks taken. The bitmap must be loaded.
+ */
+u32 kfs_alloc_blocks_bg(struct kfs_bg *dbg, u32 want, u64 *bno)
+{
+    struct kfs *fs = dbg->fs;
+    u8 *bm = dbg->bitmap->bitmap;
+    u32 no = dbg->bgd.cursor & ~63, start, best = 0, nbest = 0, i;
+
+    while ((no < fs->block_per_bg) && (nbest < want)) {
+        if (!(no & 63) && (*(u64 *)(bm + (no >> 3)) == 0xFFFFFFFFFFFFFFFFULL)) {
+            no += 64;
+            continue;
+        }
+        if (kfs_test_bit(no, bm, NULL)) {
+            no++;
+            continue;
+        }
+        start = no;
+        while ((no < fs->block_per_bg) && ((no - start) < want)
+                && !kfs_test_bit(no, bm, NULL)) {
+            no++;
+        }
+        if ((no - start) > nbest) {
+            best = start;
+            nbest = no - start;
+        }
+    }
+
+    for (i = best; i < (best + nbest); i++) {
+        kfs_set_bit(i, bm, NULL);
+    }
+    *bno = bg_data_bno(dbg) + best;
+    dbg->bgd.used += nbest;
+    if (best == dbg->bgd.cursor) {
+        dbg->bgd.cursor = best + nbest;
+    }
+
+    KFS_ASSERT(dbg->bgd.used <= fs->block_per_bg);
+
+    mark_bg_dirty(dbg);
+    kfs_add_bused(fs, nbest);
+
+    return nbest;
+}
+
+/* bno must be one of the data blocks of dbg */
+int kfs_free_block_bg(struct kfs_bg *dbg, u64 bno)
+{
+    u32 no = bno - bg_data_bno(dbg);
+    int ret;
+
+    ret = kfs_load_bitmap(dbg);
+    if (ret) {
+        return ret;
+    }
+
+    KFS_ASSERT(kfs_test_bit(no, dbg->bitmap->bitmap, NULL));
+    kfs_clear_bit(no, dbg->bitmap->bitmap, NULL);
+    dbg->bgd.used--;
+    if (no < dbg->bgd.cursor) {
+        dbg->bgd.cursor = no;
+    }
+    kfs_rewind_cursor(dbg);
+
+    mark_bg_dirty(dbg);
+    kfs_sub_bused(dbg->fs, 1);
+
+    return 0;
+}
+
+/* ino must be one of the inodes of ibg */
+int kfs_free_inode_bg(struct kfs_bg *ibg, u64 ino)
+{
+    u32 no = ino - (ibg->bid * ibg->fs->inode_per_bg);
+    int ret;
+
+    ret = kfs_load_bitmap(ibg);
+    if (ret) {
+        return ret;
+    }
+
+    KFS_ASSERT(kfs_test_bit(no, ibg->bitmap->bitmap, NULL));
+    kfs_clear_bit(no, ibg->bitmap->bitmap, NULL);
+    ibg->bgd.used--;
+    if (no < ibg->bgd.cursor) {
+        ibg->bgd.cursor = no;
+    }
+    kfs_rewind_cursor(ibg);
+
+    mark_bg_dirty(ibg);
+    kfs_dec_iused(ibg->fs);
+
+    return 0;
+}
+
+/* The write of bg queued by kfs_sync_bg() is done */
+void kfs_sync_bg_done(struct kfs_bg *bg, int err)
+{
+    if (err) {
+        /* Still dirty, don't count it twice if it was dirtied again */
+        if (kfs_test_and_set_bit_atomic(KFS_DIRTY_BIT, &bg->state)) {
+            kfs_dec_dirty(bg->fs, sizeof(bg->bgd) + sizeof(*bg->bitmap));
+        }
+        return;
+    }
+    kfs_dec_dirty(bg->fs, sizeof(bg->bgd) + sizeof(*bg->bitmap));
+}
+
+static void kfs_sync_bg_end(struct kfs_io *io, int err)
+{
+    kfs_sync_bg_done(io->private, err);
+}
+
+/*
+ * Queue the dirty inodes of the bg and the bg itself to batch. The
+ * end_io takes bg->lock, so the batch is submitted after unlock_bg().
+ */
+int kfs_sync_bg(struct kfs_bg *bg, struct kfs_io_batch *batch)
 {
     int ret = 0, i;
     struct kfs_inode *inode;
+    struct kfs_io *io;
 
     if (bg->bgd.type == KFS_BG_INODE) {
         for (i = 0; i < KFS_IHASH_SLOT; i++) {
-            pthread_mutex_lock(&bg->ihash[i].lock);
+            kfs_mutex_lock(&bg->ihash[i].lock, KFS_LOCK_IHASH);
             list_for_each_entry(inode, &bg->ihash[i].inodes, link) {
                 kfs_lock_inode(inode);
-                ret = kfs_sync_inode(inode, 1);
+                ret = kfs_sync_inode(inode, batch);
                 if (ret) {
                     kfs_unlock_inode(inode);
-                    pthread_mutex_unlock(&bg->ihash[i].lock);
+                    kfs_mutex_unlock(&bg->ihash[i].lock, KFS_LOCK_IHASH);
                     goto out;
                 }
                 kfs_unlock_inode(inode);
             }
-            pthread_mutex_unlock(&bg->ihash[i].lock);
+            kfs_mutex_unlock(&bg->ihash[i].lock, KFS_LOCK_IHASH);
         }
     }
 
-    if (kfs_test_bit(KFS_DIRTY_BIT, &bg->state, locked?NULL:&bg->lock)) {
-        ret = pwrite(bg->fs->fd, &bg->bgd, sizeof(bg->bgd), bg_offset(bg));
-        if (ret != sizeof(bg->bgd)) {
-            kerr("Write block group discriptor failed %s\n",
-                    strerror(errno));
-            ret = -EIO;
-            goto out;
-        }
-        ret = pwrite(bg->fs->fd, &bg->bitmap, sizeof(bg->bitmap), bgmap_offset(bg));
-        if (ret != sizeof(bg->bitmap)) {
-            kerr("Write block group bitmap failed %s\n",
-                    strerror(errno));
-            ret = -EIO;
-            goto out;
+    if (kfs_test_and_clear_bit_atomic(KFS_DIRTY_BIT, &bg->state)) {
+        /* A dirty bg has its bitmap loaded, it's not dropped until written */
+        bg->bgd.csum = kfs_crc32c(0, bg->bitmap, sizeof(*bg->bitmap));
+        kfs_update_gde(bg);
+        if (bg->flex) {
+            /* Written with the other bitmaps of the flex */
+            kfs_flex_dirty(bg);
         } else {
-            ret = 0;
+            io = kfs_io_batch_add(batch, kfs_meta_io_op(bg->fs), bg_offset(bg),
+                    kfs_sync_bg_end, bg);
+            if (!io) {
+                kfs_set_bit_atomic(KFS_DIRTY_BIT, &bg->state);
+                ret = -ENOMEM;
+                goto out;
+            }
+            /* bgd block and bitmap are laid out as on disk, one write */
+            bg->meta->bgd = bg->bgd;
+            kfs_io_add_vec(io, bg->meta->bgd_block, KFS_BG_META_SIZE);
         }
     }
 
@@ -214,7 +908,7 @@ out:
     return ret;
 }
 
-int kfs_sync_bgs(struct kfs *fs, u32 type)
+int kfs_sync_bgs(struct kfs *fs, u32 type, struct kfs_io_batch *batch)
 {
     int ret = 0;
     struct kfs_bg *bg;
@@ -226,9 +920,9 @@ int kfs_sync_bgs(struct kfs *fs, u32 type)
         bgs = &fs->dbgs;
     }
     lock_bgs(fs, type);
-    list_for_each_entry(bg, bgs, link) {
+    list_for_each_entry_rcu(bg, bgs, link) {
         lock_bg(bg);
-        ret = kfs_sync_bg(bg, 1);
+        ret = kfs_sync_bg(bg, batch);
         unlock_bg(bg);
         if (ret) {
             break;
@@ -247,7 +941,7 @@ struct kfs_bg *kfs_get_ibg(struct kfs *fs, u64 ino)
     int bid = ino / fs->inode_per_bg;
 
     lock_bgs(fs, KFS_BG_INODE);
-    list_for_each_entry(ibg, &fs->ibgs, link) {
+    list_for_each_entry_rcu(ibg, &fs->ibgs, link) {
         if (ibg->bid == bid) {
             found = 1;
             break;
@@ -265,3 +959,46 @@ struct kfs_bg *kfs_get_ibg(struct kfs *fs, u64 ino)
 
     return NULL;
 }
+
+/*
+ * The cursors of the fs say from which bg on there may be room, what
+ * is before is full. They are only a hint, kfs_find_bg() still looks
+ * from the first bg before it gives up. They are read and moved with
+ * atomics, the allocators and kfs_free_block() don't take fs->lock.
+ */
+struct kfs_bg *kfs_get_cursor(struct kfs *fs, u32 type)
+{
+    struct list_head *bgs = (type == KFS_BG_INODE) ? &fs->ibgs : &fs->dbgs;
+    struct kfs_bg *bg;
+
+    bg = __atomic_load_n((type == KFS_BG_INODE) ? &fs->icursor : &fs->dcursor,
+            __ATOMIC_ACQUIRE);
+
+    return bg ? bg : list_first_entry_rcu(bgs, struct kfs_bg, link);
+}
+
+/* There is room in bg, the allocator stops there */
+void kfs_set_cursor(struct kfs_bg *bg)
+{
+    struct kfs *fs = bg->fs;
+    struct kfs_bg **cursor;
+
+    cursor = (bg->bgd.type == KFS_BG_INODE) ? &fs->icursor : &fs->dcursor;
+    /* Mostly where it is already, don't dirty the line for nothing */
+    if (__atomic_load_n(cursor, __ATOMIC_RELAXED) != bg) {
+        __atomic_store_n(cursor, bg, __ATOMIC_RELEASE);
+    }
+}
+
+/* Something was freed in bg, move the cursor back to it if it's after */
+void kfs_rewind_cursor(struct kfs_bg *bg)
+{
+    struct kfs *fs = bg->fs;
+    struct kfs_bg **cursor, *old;
+
+    cursor = (bg->bgd.type == KFS_BG_INODE) ? &fs->icursor : &fs->dcursor;
+    old = __atomic_load_n(cursor, __ATOMIC_ACQUIRE);
+    while (old && (old->bid > bg->bid)
+            && !__atomic_compare_exchange_n(cursor, &old, bg, 0,
+                __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
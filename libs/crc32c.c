@@ -0,0 +1,276 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * crc32c (Castagnoli) of the metadata
+ * - With SSE4.2 the crc32 instruction does 8 bytes at a time, on three
+ *   streams at once to hide its latency. The crcs of the streams are
+ *   put together with tables that shift a crc over a run of zeros.
+ * - Anywhere else it's slicing by 8 from tables.
+ * - The tables are made at the first call, the instruction is picked
+ *   then too.
+ * - kfs_crc32c() goes like crc32() of zlib, start with 0 and pass the
+ *   last result on to go on.
+ */
+#include <kfs.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY     0x82f63b78  /* Reversed */
+#define CRC32C_LONG     8192        /* Bytes of a stream, big buffers */
+#define CRC32C_SHORT    256         /* Bytes of a stream, a block and less */
+#define CRC32C_TINY     64          /* Bytes of a stream, an inode */
+
+static pthread_once_t kfs_crc32c_once = PTHREAD_ONCE_INIT;
+static u32 (*kfs_crc32c_fn)(u32 crc, const void *buf, size_t len);
+static u32 kfs_crc32c_table[8][256];
+static u32 kfs_crc32c_long[4][256];
+static u32 kfs_crc32c_short[4][256];
+static u32 kfs_crc32c_tiny[4][256];
+
+static u32 kfs_gf2_times(const u32 *mat, u32 vec)
+{
+    u32 sum = 0;
+
+    while (vec) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void kfs_gf2_square(u32 *square, const u32 *mat)
+{
+    int n;
+
+    for (n = 0; n < 32; n++) {
+        square[n] = kfs_gf2_times(mat, mat[n]);
+    }
+}
+
+/* The operator appending len zero bytes to a crc, len > 0 */
+static void kfs_crc32c_zeros_op(u32 *even, size_t len)
+{
+    u32 odd[32], row = 1;
+    int n;
+
+    /* One zero bit */
+    odd[0] = CRC32C_POLY;
+    for (n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    /* Two, then four */
+    kfs_gf2_square(even, odd);
+    kfs_gf2_square(odd, even);
+
+    /* Eight and on, one square per bit of len */
+    do {
+        kfs_gf2_square(even, odd);
+        len >>= 1;
+        if (!len) {
+            return;
+        }
+        kfs_gf2_square(odd, even);
+        len >>= 1;
+    } while (len);
+
+    memcpy(even, odd, sizeof(odd));
+}
+
+/* Tables of the operator for len zeros, a byte of the crc each */
+static void kfs_crc32c_zeros(u32 zeros[][256], size_t len)
+{
+    u32 op[32], n;
+
+    kfs_crc32c_zeros_op(op, len);
+    for (n = 0; n < 256; n++) {
+        zeros[0][n] = kfs_gf2_times(op, n);
+        zeros[1][n] = kfs_gf2_times(op, n << 8);
+        zeros[2][n] = kfs_gf2_times(op, n << 16);
+        zeros[3][n] = kfs_gf2_times(op, n << 24);
+    }
+}
+
+static inline u32 kfs_crc32c_shift(u32 zeros[][256], u32 crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff]
+        ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static u32 kfs_crc32c_sw(u32 crc, const void *buf, size_t len)
+{
+    const u8 *p = buf;
+    u64 word;
+
+    crc = ~crc;
+    while (len && ((uintptr_t)p & 7)) {
+        crc = kfs_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        word = crc ^ *(const u64 *)p;
+        crc = kfs_crc32c_table[7][word & 0xff]
+            ^ kfs_crc32c_table[6][(word >> 8) & 0xff]
+            ^ kfs_crc32c_table[5][(word >> 16) & 0xff]
+            ^ kfs_crc32c_table[4][(word >> 24) & 0xff]
+            ^ kfs_crc32c_table[3][(word >> 32) & 0xff]
+            ^ kfs_crc32c_table[2][(word >> 40) & 0xff]
+            ^ kfs_crc32c_table[1][(word >> 48) & 0xff]
+            ^ kfs_crc32c_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = kfs_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+/* 3 * size bytes at p on three streams, crc0 goes on with the result */
+#define KFS_CRC32C_3WAY(size, zeros) do { \
+    while (len >= (3 * (size))) { \
+        crc1 = 0; \
+        crc2 = 0; \
+        end = p + (size); \
+        do { \
+            crc0 = _mm_crc32_u64(crc0, *(const u64 *)p); \
+            crc1 = _mm_crc32_u64(crc1, *(const u64 *)(p + (size))); \
+            crc2 = _mm_crc32_u64(crc2, *(const u64 *)(p + (2 * (size)))); \
+            p += 8; \
+        } while (p < end); \
+        crc0 = kfs_crc32c_shift(zeros, crc0) ^ crc1; \
+        crc0 = kfs_crc32c_shift(zeros, crc0) ^ crc2; \
+        p += 2 * (size); \
+        len -= 3 * (size); \
+    } \
+} while (0)
+
+__attribute__((target("sse4.2")))
+static u32 kfs_crc32c_hw(u32 crc, const void *buf, size_t len)
+{
+    const u8 *p = buf, *end;
+    u64 crc0, crc1, crc2;
+
+    crc0 = ~crc;
+    while (len && ((uintptr_t)p & 7)) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        len--;
+    }
+
+    KFS_CRC32C_3WAY(CRC32C_LONG, kfs_crc32c_long);
+    KFS_CRC32C_3WAY(CRC32C_SHORT, kfs_crc32c_short);
+    KFS_CRC32C_3WAY(CRC32C_TINY, kfs_crc32c_tiny);
+
+    while (len >= 8) {
+        crc0 = _mm_crc32_u64(crc0, *(const u64 *)p);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+    }
+
+    return ~(u32)crc0;
+}
+#endif
+
+static void kfs_crc32c_init(void)
+{
+    u32 n, k, crc;
+
+    for (n = 0; n < 256; n++) {
+        crc = n;
+        for (k = 0; k < 8; k++) {
+            crc = (crc & 1) ? ((crc >> 1) ^ CRC32C_POLY) : (crc >> 1);
+        }
+        kfs_crc32c_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++) {
+        crc = kfs_crc32c_table[0][n];
+        for (k = 1; k < 8; k++) {
+            crc = kfs_crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            kfs_crc32c_table[k][n] = crc;
+        }
+    }
+    kfs_crc32c_fn = kfs_crc32c_sw;
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        kfs_crc32c_zeros(kfs_crc32c_long, CRC32C_LONG);
+        kfs_crc32c_zeros(kfs_crc32c_short, CRC32C_SHORT);
+        kfs_crc32c_zeros(kfs_crc32c_tiny, CRC32C_TINY);
+        kfs_crc32c_fn = kfs_crc32c_hw;
+    }
+#endif
+    kdebug(LOG_VFS, "crc32c with %s\n",
+            (kfs_crc32c_fn == kfs_crc32c_sw) ? "tables" : "sse4.2");
+}
+
+u32 kfs_crc32c(u32 crc, const void *buf, size_t len)
+{
+    pthread_once(&kfs_crc32c_once, kfs_crc32c_init);
+    return kfs_crc32c_fn(crc, buf, len);
+}
+
+/* The portable one, whatever the CPU has, for csumbench */
+u32 kfs_crc32c_soft(u32 crc, const void *buf, size_t len)
+{
+    pthread_once(&kfs_crc32c_once, kfs_crc32c_init);
+    return kfs_crc32c_sw(crc, buf, len);
+}
+
+/*
+ * crc32c of a metadata structure of len bytes at buf, with its csum
+ * field, the u32 at off, taken as 0. The structures are packed, the
+ * field is given by its offset and not its address.
+ */
+u32 kfs_meta_csum(const void *buf, size_t len, size_t off)
+{
+    static const u32 zero = 0;
+    u32 crc;
+
+    crc = kfs_crc32c(0, buf, off);
+    crc = kfs_crc32c(crc, &zero, sizeof(zero));
+    return kfs_crc32c(crc, (const u8 *)buf + off + sizeof(zero),
+            len - off - sizeof(zero));
+}
+
+/* Store the kfs_meta_csum() of buf in its csum field at off */
+void kfs_set_meta_csum(void *buf, size_t len, size_t off)
+{
+    u32 csum = kfs_meta_csum(buf, len, off);
+
+    memcpy((u8 *)buf + off, &csum, sizeof(csum));
+}
+
+/*
+ * Check csum, found on metadata of fs read in, against want. After a
+ * clean umount a mismatch is an error. Otherwise the metadata in place
+ * may be newer than its csum, as it's written while it changes, so it's
+ * warned about and 1 returned: the caller takes want and writes it back.
+ */
+int kfs_check_csum(struct kfs *fs, u32 csum, u32 want, const char *what, u64 id)
+{
+    if (csum == want) {
+        return 0;
+    }
+    if (kfs_test_bit_atomic(KFS_CLEAN_BIT, &fs->state)) {
+        kerr("Bad checksum of %s %llu: %08x, not %08x\n", what, id, csum, want);
+        return -EIO;
+    }
+    kwarn("Checksum of %s %llu is %08x, not %08x, after an unclean umount\n",
+            what, id, csum, want);
+    return 1;
+}
@@ -25,7 +25,7 @@ struct kfs_dentry *kfs_alloc_dentry(char *name)
     struct kfs_dentry *dentry;
     int namelen = strlen(name);
 
-    dentry = malloc(sizeof(*dentry) + namelen);
+    dentry = malloc(sizeof(*dentry) + namelen + 1);
     if (!dentry) {
         return NULL;
     }
@@ -50,12 +50,12 @@ void kfs_free_dentry(struct kfs_dentry *dentry)
 
 void lock_dentry(struct kfs_dentry *dentry)
 {
-    pthread_mutex_lock(&dentry->lock);
+    kfs_mutex_lock(&dentry->lock, KFS_LOCK_DENTRY);
 }
 
 void unlock_dentry(struct kfs_dentry *dentry)
 {
-    pthread_mutex_unlock(&dentry->lock);
+    kfs_mutex_unlock(&dentry->lock, KFS_LOCK_DENTRY);
 }
 
 /* Parent must be locked */
@@ -63,7 +63,7 @@ void unlock_dentry(struct kfs_dentry *dentry)
 struct kfs_dentry *kfs_find_dentry(struct kfs_dentry *parent, char *name)
 {
     struct kfs_dentry *dentry;
-    int found, namelen = strlen(name);
+    int found = 0, namelen = strlen(name);
 
     list_for_each_entry(dentry, &parent->children, brothers) {
         lock_dentry(dentry);
@@ -81,3 +81,164 @@ struct kfs_dentry *kfs_find_dentry(struct kfs_dentry *parent, char *name)
 
     return found?dentry:NULL;
 }
+
+/*
+ * The namespace is only kept in memory, shared by the frontends:
+ * - The parent dentry is locked, then the child, then the inodes.
+ * - A removed dentry is off its parent with a NULL parent, the root is
+ *   its own parent. It lives on until its inode is evicted, so the
+ *   inode->dentry of a looked up inode is always there.
+ * - Directories have one link, like the root mkfs makes.
+ */
+
+static void kfs_dir_changed(struct kfs_inode *dir)
+{
+    kfs_lock_inode(dir);
+    dir->node->mtime = dir->node->ctime = time(NULL);
+    mark_inode_dirty(dir);
+    kfs_unlock_inode(dir);
+}
+
+/* Find name in dir, return its inode with a lookup held */
+int kfs_lookup_inode(struct kfs_inode *dir, char *name, struct kfs_inode **inodep)
+{
+    struct kfs_dentry *dentry;
+
+    if (!S_ISDIR(dir->node->mode) || !dir->dentry) {
+        return -ENOTDIR;
+    }
+
+    lock_dentry(dir->dentry);
+    dentry = kfs_find_dentry(dir->dentry, name);
+    if (dentry) {
+        *inodep = dentry->inode;
+        kfs_hold_inode(dentry->inode);
+        unlock_dentry(dentry);
+    }
+    unlock_dentry(dir->dentry);
+
+    return dentry ? 0 : -ENOENT;
+}
+
+/* Make name in dir, a new inode with a lookup held for the caller */
+int kfs_create_inode(struct kfs_inode *dir, char *name, u32 mode,
+        u32 uid, u32 gid, struct kfs_inode **inodep)
+{
+    struct kfs_dentry *dentry, *old;
+    struct kfs_inode *inode;
+    struct kfs_node *node;
+    int ret;
+
+    if (!S_ISDIR(dir->node->mode) || !dir->dentry) {
+        return -ENOTDIR;
+    }
+
+    dentry = kfs_alloc_dentry(name);
+    if (!dentry) {
+        return -ENOMEM;
+    }
+
+    lock_dentry(dir->dentry);
+    if (!dir->dentry->parent) {
+        ret = -ENOENT;
+        goto out;
+    }
+    old = kfs_find_dentry(dir->dentry, name);
+    if (old) {
+        unlock_dentry(old);
+        ret = -EEXIST;
+        goto out;
+    }
+
+    ret = kfs_alloc_inode(dir->bg->fs, &inode);
+    if (ret) {
+        goto out;
+    }
+
+    kfs_lock_inode(inode);
+    node = inode->node;
+    node->mode = mode;
+    node->uid = uid;
+    node->gid = gid;
+    node->nlink = 1;
+    node->atime = node->ctime = node->mtime = node->btime = time(NULL);
+    inode->dentry = dentry;
+    inode->nlookup = 1;
+    kfs_set_bit_atomic(KFS_DSYNC_BIT, &inode->state);
+    mark_inode_dirty(inode);
+    kfs_unlock_inode(inode);
+
+    dentry->inode = inode;
+    dentry->meta.ino = inode->ino;
+    dentry->meta.type = mode & S_IFMT;
+    dentry->meta.length = dentry->namelen + 1 + sizeof(dentry->meta);
+    dentry->parent = dir->dentry;
+    list_add_tail(&dentry->brothers, &dir->dentry->children);
+    kfs_dir_changed(dir);
+
+    kdebug(LOG_VFS, "create %s inode %llu mode %o\n", name, inode->ino, mode);
+    *inodep = inode;
+    dentry = NULL;
+
+  out:
+    unlock_dentry(dir->dentry);
+    if (dentry) {
+        kfs_free_dentry(dentry);
+    }
+    return ret;
+}
+
+/* Unlink name from dir, isdir for rmdir */
+int kfs_remove_inode(struct kfs_inode *dir, char *name, int isdir)
+{
+    struct kfs_dentry *dentry;
+    struct kfs_inode *inode = NULL;
+    int ret = 0;
+
+    if (!S_ISDIR(dir->node->mode) || !dir->dentry) {
+        return -ENOTDIR;
+    }
+
+    lock_dentry(dir->dentry);
+    dentry = kfs_find_dentry(dir->dentry, name);
+    if (!dentry) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    inode = dentry->inode;
+    if (isdir && !S_ISDIR(inode->node->mode)) {
+        ret = -ENOTDIR;
+    } else if (!isdir && S_ISDIR(inode->node->mode)) {
+        ret = -EISDIR;
+    } else if (isdir && !list_empty(&dentry->children)) {
+        ret = -ENOTEMPTY;
+    }
+    if (ret) {
+        unlock_dentry(dentry);
+        goto out;
+    }
+
+    list_del_init(&dentry->brothers);
+    dentry->parent = NULL;
+
+    kfs_lock_inode(inode);
+    if (inode->node->nlink) {
+        inode->node->nlink--;
+    }
+    inode->node->ctime = time(NULL);
+    mark_inode_dirty(inode);
+    kfs_unlock_inode(inode);
+    unlock_dentry(dentry);
+    kfs_dir_changed(dir);
+
+    kdebug(LOG_VFS, "remove %s inode %llu\n", name, inode->ino);
+
+  out:
+    unlock_dentry(dir->dentry);
+    if (!ret) {
+        /* Evicted now unless it's still looked up */
+        kfs_put_inode(inode, 0);
+    }
+    return ret;
+}
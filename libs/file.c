@@ -0,0 +1,1100 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+#include <kfs.h>
+
+/*
+ * File data lib, shared by the fuse frontends:
+ * - db[] are the direct blocks, indb the indirect block and dindb the
+ *   double indirect block. All of them keep image block numbers.
+ * - Block 0 is the superblock, so 0 means no block is mapped.
+ * - The inode must be locked by the caller of kfs_bmap().
+ */
+
+static const char kfs_zero_block[KFS_BLOCK_SIZE] __attribute__((aligned(KFS_BLOCK_SIZE)));
+static pthread_key_t kfs_scratch_key;
+static pthread_once_t kfs_scratch_once = PTHREAD_ONCE_INIT;
+
+/* The indirect blocks of the single and the double indirect levels */
+struct kfs_bmap_cache {
+    u64 ind[2];
+    u64 entry[2][KFS_ADDR_PER_BLOCK] __attribute__((aligned(KFS_BLOCK_SIZE)));
+};
+
+/*
+ * Scratch space of the thread, so a worker allocates it once and not
+ * for every request. A request runs on one thread and doesn't nest.
+ */
+struct kfs_scratch {
+    char blk[KFS_BLOCK_SIZE];   /* Partial writes */
+    struct kfs_bmap_cache bc;   /* Indirect blocks of one request */
+};
+
+static void kfs_scratch_init(void)
+{
+    pthread_key_create(&kfs_scratch_key, free);
+}
+
+static struct kfs_scratch *kfs_scratch(void)
+{
+    struct kfs_scratch *sc;
+
+    pthread_once(&kfs_scratch_once, kfs_scratch_init);
+    sc = pthread_getspecific(kfs_scratch_key);
+    if (!sc) {
+        if (posix_memalign((void **)&sc, KFS_BLOCK_SIZE, sizeof(*sc))) {
+            return NULL;
+        }
+        pthread_setspecific(kfs_scratch_key, sc);
+    }
+
+    return sc;
+}
+
+/* Block aligned buffer of the thread, reused by all its partial writes */
+static char *kfs_blkbuf(void)
+{
+    struct kfs_scratch *sc = kfs_scratch();
+
+    return sc ? sc->blk : NULL;
+}
+
+/* The bmap cache of the thread, reset for a new request. NULL is fine */
+static struct kfs_bmap_cache *kfs_bmap_cache(void)
+{
+    struct kfs_scratch *sc = kfs_scratch();
+
+    if (!sc) {
+        return NULL;
+    }
+    sc->bc.ind[0] = sc->bc.ind[1] = 0;
+    return &sc->bc;
+}
+
+static int kfs_zero_range(struct kfs *fs, u64 pos, size_t len)
+{
+    int ret;
+
+    ret = kfs_pwrite(fs, kfs_zero_block, len, pos);
+    if (ret != len) {
+        kerr("Zero %zd bytes at %llu failed %s\n", len, pos, strerror(errno));
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int kfs_new_block(struct kfs *fs, u64 *bno, int zero)
+{
+    int ret;
+
+    ret = kfs_alloc_block(fs, bno);
+    if (ret) {
+        return ret;
+    }
+
+    if (zero) {
+        ret = kfs_pwrite(fs, kfs_zero_block, KFS_BLOCK_SIZE,
+                *bno << KFS_BLOCK_SHIFT);
+        if (ret != KFS_BLOCK_SIZE) {
+            kerr("Zero block %llu failed %s\n", *bno, strerror(errno));
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
+/* The block pointer lives in the inode itself */
+static int kfs_bmap_slot(struct kfs_inode *inode, u64 *slot, int create,
+        int zero, u64 *bno)
+{
+    int ret;
+
+    if (!*slot && create) {
+        ret = kfs_new_block(inode->bg->fs, slot, zero);
+        if (ret) {
+            return ret;
+        }
+        inode->node->blocks++;
+        kfs_set_bit_atomic(KFS_DSYNC_BIT, &inode->state);
+        mark_inode_dirty(inode);
+        *bno = *slot;
+        return KFS_BMAP_NEW;
+    }
+
+    *bno = *slot;
+    return 0;
+}
+
+/*
+ * Read the whole indirect block ind to level of the cache, unless it's
+ * there already. The next lookups of the same request are free then.
+ */
+static u64 *kfs_bmap_cache_get(struct kfs *fs, struct kfs_bmap_cache *bc,
+        int level, u64 ind)
+{
+    int ret;
+
+    if (bc->ind[level] == ind) {
+        return bc->entry[level];
+    }
+
+    ret = kfs_pread(fs, bc->entry[level], KFS_BLOCK_SIZE, ind << KFS_BLOCK_SHIFT);
+    if (ret != KFS_BLOCK_SIZE) {
+        bc->ind[level] = 0;
+        return NULL;
+    }
+    bc->ind[level] = ind;
+
+    return bc->entry[level];
+}
+
+/*
+ * The block pointer is entry idx of the indirect block ind. Without a
+ * cache only the entry itself is read.
+ */
+static int kfs_bmap_ind(struct kfs_inode *inode, u64 ind, u32 idx, int create,
+        int zero, u64 *bno, struct kfs_bmap_cache *bc, int level)
+{
+    struct kfs *fs = inode->bg->fs;
+    u64 entry, *entries = NULL;
+    u64 pos = (ind << KFS_BLOCK_SHIFT) + (idx * sizeof(entry));
+    int ret;
+
+    if (bc) {
+        entries = kfs_bmap_cache_get(fs, bc, level, ind);
+        ret = entries ? sizeof(entry) : -EIO;
+        entry = entries ? entries[idx] : 0;
+    } else {
+        ret = kfs_pread(fs, &entry, sizeof(entry), pos);
+    }
+    if (ret != sizeof(entry)) {
+        kerr("Read indirect block %llu failed %s\n", ind, strerror(errno));
+        return -EIO;
+    }
+
+    if (!entry && create) {
+        ret = kfs_new_block(fs, &entry, zero);
+        if (ret) {
+            return ret;
+        }
+        ret = kfs_pwrite(fs, &entry, sizeof(entry), pos);
+        if (ret != sizeof(entry)) {
+            kerr("Write indirect block %llu failed %s\n", ind, strerror(errno));
+            return -EIO;
+        }
+        if (entries) {
+            entries[idx] = entry;
+        }
+        inode->node->blocks++;
+        mark_inode_dirty(inode);
+        *bno = entry;
+        return KFS_BMAP_NEW;
+    }
+
+    *bno = entry;
+    return 0;
+}
+
+/* Where the data block pointer of a file block lives */
+struct kfs_bmap_ptr {
+    u64 *slot;          /* In the inode, or */
+    u64 ind;            /* entry idx of the indirect block ind */
+    u32 idx;
+    int level;          /* of ind in the bmap cache */
+};
+
+/*
+ * Find the data block pointer of iblock. The missing indirect blocks
+ * are allocated with create, otherwise both slot and ind are left 0
+ * when there is none, and the block is a hole.
+ */
+static int kfs_bmap_locate(struct kfs_inode *inode, u64 iblock, int create,
+        struct kfs_bmap_cache *bc, struct kfs_bmap_ptr *ptr)
+{
+    u64 ind;
+    int ret;
+
+    memset(ptr, 0, sizeof(*ptr));
+    if (iblock < KFS_DB_NUM) {
+        ptr->slot = &inode->node->db[iblock];
+        return 0;
+    }
+
+    iblock -= KFS_DB_NUM;
+    if (iblock < KFS_ADDR_PER_BLOCK) {
+        ret = kfs_bmap_slot(inode, &inode->node->indb, create, 1, &ind);
+        if (ret < 0) {
+            return ret;
+        }
+        ptr->ind = ind;
+        ptr->idx = iblock;
+        return 0;
+    }
+
+    iblock -= KFS_ADDR_PER_BLOCK;
+    if (iblock < ((u64)KFS_ADDR_PER_BLOCK * KFS_ADDR_PER_BLOCK)) {
+        ret = kfs_bmap_slot(inode, &inode->node->dindb, create, 1, &ind);
+        if ((ret < 0) || !ind) {
+            return ret;
+        }
+        ret = kfs_bmap_ind(inode, ind, iblock / KFS_ADDR_PER_BLOCK, create, 1,
+                &ind, bc, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        ptr->ind = ind;
+        ptr->idx = iblock % KFS_ADDR_PER_BLOCK;
+        ptr->level = 1;
+        return 0;
+    }
+
+    return -EFBIG;
+}
+
+/* The data block pointer as it's stored, KFS_BLOCK_UNWRITTEN included */
+static int kfs_bmap_get(struct kfs_inode *inode, struct kfs_bmap_ptr *ptr,
+        struct kfs_bmap_cache *bc, u64 *val)
+{
+    if (ptr->slot) {
+        *val = *ptr->slot;
+        return 0;
+    }
+    if (!ptr->ind) {
+        *val = 0;
+        return 0;
+    }
+
+    return kfs_bmap_ind(inode, ptr->ind, ptr->idx, 0, 0, val, bc, ptr->level);
+}
+
+/* Also keeps the count of blocks in the inode */
+static int kfs_bmap_set(struct kfs_inode *inode, struct kfs_bmap_ptr *ptr,
+        struct kfs_bmap_cache *bc, u64 val)
+{
+    struct kfs *fs = inode->bg->fs;
+    u64 old;
+    int ret;
+
+    ret = kfs_bmap_get(inode, ptr, bc, &old);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!old != !val) {
+        /* Images older than the count start at 0 */
+        if (val) {
+            inode->node->blocks++;
+        } else if (inode->node->blocks) {
+            inode->node->blocks--;
+        }
+        mark_inode_dirty(inode);
+    }
+
+    if (ptr->slot) {
+        *ptr->slot = val;
+        mark_inode_dirty(inode);
+    } else {
+        ret = kfs_pwrite(fs, &val, sizeof(val),
+                (ptr->ind << KFS_BLOCK_SHIFT) + (ptr->idx * sizeof(val)));
+        if (ret != sizeof(val)) {
+            kerr("Write indirect block %llu failed %s\n", ptr->ind,
+                    strerror(errno));
+            return -EIO;
+        }
+        if (bc && (bc->ind[ptr->level] == ptr->ind)) {
+            bc->entry[ptr->level][ptr->idx] = val;
+        }
+    }
+    kfs_set_bit_atomic(KFS_DSYNC_BIT, &inode->state);
+
+    return 0;
+}
+
+/*
+ * Map file block iblock to the image block *bno, 0 for a hole.
+ * With create the missing blocks are allocated, and KFS_BMAP_NEW is
+ * returned if the data block itself is new. New data blocks are not
+ * zeroed, it's up to the caller. An unwritten block reads as a hole,
+ * and becomes a new one with create, without being allocated again.
+ * bc keeps the indirect blocks between the calls of one request, it
+ * comes from kfs_bmap_cache() and the inode is locked all along.
+ */
+static int kfs_bmap_bc(struct kfs_inode *inode, u64 iblock, int create,
+        u64 *bno, struct kfs_bmap_cache *bc)
+{
+    struct kfs_bmap_ptr ptr;
+    u64 val;
+    int ret;
+
+    *bno = 0;
+    ret = kfs_bmap_locate(inode, iblock, create, bc, &ptr);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = kfs_bmap_get(inode, &ptr, bc, &val);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!(val & KFS_BLOCK_UNWRITTEN)) {
+        if (val || !create) {
+            *bno = val;
+            return 0;
+        }
+        ret = kfs_new_block(inode->bg->fs, &val, 0);
+        if (ret) {
+            return ret;
+        }
+    } else if (!create) {
+        return 0;
+    }
+
+    ret = kfs_bmap_set(inode, &ptr, bc, kfs_block_bno(val));
+    if (ret < 0) {
+        return ret;
+    }
+    *bno = kfs_block_bno(val);
+
+    return KFS_BMAP_NEW;
+}
+
+int kfs_bmap(struct kfs_inode *inode, u64 iblock, int create, u64 *bno)
+{
+    return kfs_bmap_bc(inode, iblock, create, bno, NULL);
+}
+
+/*
+ * The bytes past EOF in the last block are not zeroed when the block is
+ * written, so clear them once the file grows over them, here to offset.
+ */
+static int kfs_zero_eof(struct kfs_inode *inode, u64 offset)
+{
+    u64 isize = inode->node->size;
+    u64 bno, end;
+    int ret;
+
+    if ((offset <= isize) || !(isize & KFS_BLOCK_MASK)) {
+        return 0;
+    }
+
+    ret = kfs_bmap(inode, isize >> KFS_BLOCK_SHIFT, 0, &bno);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!bno) {
+        return 0;
+    }
+
+    end = (isize | KFS_BLOCK_MASK) + 1;
+    if (end > offset) {
+        end = offset;
+    }
+    return kfs_zero_range(inode->bg->fs, (bno << KFS_BLOCK_SHIFT)
+            + (isize & KFS_BLOCK_MASK), end - isize);
+}
+
+/*
+ * [boff, boff+len) of the new block at file offset fpos is going to be
+ * written. Return where the zeroes after the data must end: the rest
+ * of the block up to the old EOF, nothing past it.
+ */
+static u64 kfs_new_block_end(struct kfs_inode *inode, u64 fpos, u64 boff, size_t len)
+{
+    u64 isize = inode->node->size;
+
+    if (isize <= (fpos + boff + len)) {
+        return boff + len;
+    }
+    if (isize >= (fpos + KFS_BLOCK_SIZE)) {
+        return KFS_BLOCK_SIZE;
+    }
+    return isize - fpos;
+}
+
+/*
+ * Write a new block only partly covered by data. The zeroes before and
+ * after it are merged with the data in the thread block buffer, so it's
+ * one write and nothing is read back.
+ */
+static int kfs_write_new_block(struct kfs_inode *inode, u64 bno, u64 fpos,
+        const char *data, u64 boff, size_t len)
+{
+    struct kfs *fs = inode->bg->fs;
+    u64 end = kfs_new_block_end(inode, fpos, boff, len);
+    char *buf = (char *)data;
+    int ret;
+
+    /* With odirect the whole block is cheaper than a read-modify-write */
+    if (fs->mntopt.flags & KFS_MNT_ODIRECT) {
+        end = KFS_BLOCK_SIZE;
+    }
+
+    if (boff || (end > (boff + len))) {
+        buf = kfs_blkbuf();
+        if (!buf) {
+            kerr("Allocate block buffer failed\n");
+            return -ENOMEM;
+        }
+        memset(buf, 0, boff);
+        memcpy(buf + boff, data, len);
+        memset(buf + boff + len, 0, end - boff - len);
+        boff = 0;
+        len = end;
+    }
+
+    ret = kfs_pwrite(fs, buf, len, (bno << KFS_BLOCK_SHIFT) + boff);
+    if (ret != len) {
+        kerr("Write block %llu failed %s\n", bno, strerror(errno));
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Translate [offset, offset+size) to the image ranges in ext, merging
+ * the physically contiguous blocks and the holes. The range is cut at
+ * EOF unless create is set, in which case the missing blocks are
+ * allocated, and the parts of the new blocks the caller is not going
+ * to write are zeroed up to the old EOF.
+ * The inode must be locked. Return the number of extents used.
+ */
+int kfs_file_map(struct kfs_inode *inode, u64 offset, size_t size,
+        int create, struct kfs_extent *ext, int max)
+{
+    struct kfs *fs = inode->bg->fs;
+    struct kfs_bmap_cache *bc;
+    size_t done = 0, len;
+    u64 bno, boff, pos, end;
+    int ret, n = 0;
+
+    if (!create) {
+        if (offset >= inode->node->size) {
+            return 0;
+        }
+        if (size > (inode->node->size - offset)) {
+            size = inode->node->size - offset;
+        }
+    } else {
+        ret = kfs_zero_eof(inode, offset);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    bc = kfs_bmap_cache();
+    while (done < size) {
+        boff = (offset + done) & KFS_BLOCK_MASK;
+        len = KFS_BLOCK_SIZE - boff;
+        if (len > (size - done)) {
+            len = size - done;
+        }
+
+        ret = kfs_bmap_bc(inode, (offset + done) >> KFS_BLOCK_SHIFT, create,
+                &bno, bc);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if ((ret == KFS_BMAP_NEW) && (len < KFS_BLOCK_SIZE)) {
+            pos = bno << KFS_BLOCK_SHIFT;
+            end = kfs_new_block_end(inode, offset + done - boff, boff, len);
+            ret = boff ? kfs_zero_range(fs, pos, boff) : 0;
+            if (!ret && (end > (boff + len))) {
+                ret = kfs_zero_range(fs, pos + boff + len, end - boff - len);
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        pos = bno ? ((bno << KFS_BLOCK_SHIFT) + boff) : 0;
+        if (n && (((pos == 0) && (ext[n-1].pos == 0))
+                    || (pos && (pos == (ext[n-1].pos + ext[n-1].len))))) {
+            ext[n-1].len += len;
+        } else {
+            if (n == max) {
+                break;
+            }
+            ext[n].pos = pos;
+            ext[n].len = len;
+            n++;
+        }
+        done += len;
+    }
+
+    return n;
+}
+
+/* [offset, offset+size) of inode changed, the inode must be locked */
+static void kfs_file_changed(struct kfs_inode *inode, u64 offset, size_t size)
+{
+    if (!size) {
+        return;
+    }
+    if ((offset + size) > inode->node->size) {
+        inode->node->size = offset + size;
+        kfs_set_bit_atomic(KFS_DSYNC_BIT, &inode->state);
+    }
+    inode->node->mtime = inode->node->ctime = time(NULL);
+    mark_inode_dirty(inode);
+}
+
+/* Data went to the blocks of kfs_file_map(), the inode must be locked */
+void kfs_file_written(struct kfs_inode *inode, u64 offset, size_t size)
+{
+    if (size && !(inode->bg->fs->mntopt.flags & KFS_MNT_ODIRECT)) {
+        kfs_inode_dirty_data(inode, size);
+    }
+    kfs_file_changed(inode, offset, size);
+}
+
+/* One kfs_file_read() or kfs_file_write() going through an io batch */
+struct kfs_file_rw {
+    struct kfs_io_batch batch;
+    struct kfs_bmap_cache *bc;
+    u32 op;
+    char *buf;
+    size_t fail;        /* Where the first failed io starts in buf */
+};
+
+static void kfs_file_rw_end(struct kfs_io *io, int err)
+{
+    struct kfs_file_rw *rw = io->private;
+    size_t start = (char *)io->iov[0].iov_base - rw->buf;
+
+    if (err && (start < rw->fail)) {
+        rw->fail = start;
+    }
+}
+
+/*
+ * Queue len bytes of buf at the image pos. When both the data and the
+ * buffer continue the last io, it just grows, so a physically
+ * contiguous range is one preadv/pwritev whatever the block size is.
+ */
+static int kfs_file_rw_add(struct kfs_file_rw *rw, char *buf, size_t len, u64 pos)
+{
+    struct kfs_io_batch *batch = &rw->batch;
+    struct kfs_io *io;
+    struct iovec *iov;
+
+    if (batch->nr) {
+        io = &batch->ios[batch->nr - 1];
+        iov = &io->iov[io->iovcnt - 1];
+        if (((io->pos + io->len) == pos)
+                && (((char *)iov->iov_base + iov->iov_len) == buf)) {
+            iov->iov_len += len;
+            io->len += len;
+            return 0;
+        }
+    }
+
+    io = kfs_io_batch_add(batch, rw->op, pos, kfs_file_rw_end, rw);
+    if (!io) {
+        return -ENOMEM;
+    }
+    kfs_io_add_vec(io, buf, len);
+
+    return 0;
+}
+
+static void kfs_file_rw_init(struct kfs *fs, struct kfs_file_rw *rw,
+        u32 op, const char *buf)
+{
+    kfs_io_batch_init(fs, &rw->batch);
+    rw->bc = kfs_bmap_cache();
+    rw->op = op;
+    rw->buf = (char *)buf;
+    rw->fail = (size_t)-1;
+}
+
+/* Run the queued io, return how much of [0, done) is really there */
+static size_t kfs_file_rw_submit(struct kfs_file_rw *rw, size_t done)
+{
+    kfs_io_batch_submit(&rw->batch);
+    kfs_io_batch_release(&rw->batch);
+
+    return (rw->fail < done) ? rw->fail : done;
+}
+
+/*
+ * The blocks are gathered in one batch and read straight into buf, the
+ * holes are zeroed in place. The inode must be locked.
+ */
+static ssize_t kfs_file_do_read(struct kfs_inode *inode, char *buf, size_t size,
+        u64 offset)
+{
+    struct kfs *fs = inode->bg->fs;
+    struct kfs_file_rw rw;
+    size_t done = 0, len;
+    u64 bno, boff;
+    int ret = 0;
+
+    if (offset >= inode->node->size) {
+        return 0;
+    }
+    if (size > (inode->node->size - offset)) {
+        size = inode->node->size - offset;
+    }
+
+    kfs_file_rw_init(fs, &rw, KFS_IO_READ, buf);
+    while (done < size) {
+        boff = (offset + done) & KFS_BLOCK_MASK;
+        len = KFS_BLOCK_SIZE - boff;
+        if (len > (size - done)) {
+            len = size - done;
+        }
+
+        ret = kfs_bmap_bc(inode, (offset + done) >> KFS_BLOCK_SHIFT, 0, &bno,
+                rw.bc);
+        if (ret < 0) {
+            break;
+        }
+
+        if (!bno) {
+            memset(buf + done, 0, len);
+        } else {
+            ret = kfs_file_rw_add(&rw, buf + done, len,
+                    (bno << KFS_BLOCK_SHIFT) + boff);
+            if (ret < 0) {
+                break;
+            }
+        }
+        done += len;
+        ret = 0;
+    }
+
+    len = kfs_file_rw_submit(&rw, done);
+    if (len < done) {
+        kerr("Read inode %llu at %llu failed\n", inode->ino, offset + len);
+        done = len;
+        ret = -EIO;
+    }
+
+    return done ? done : ret;
+}
+
+ssize_t kfs_file_read(struct kfs_inode *inode, char *buf, size_t size, u64 offset)
+{
+    ssize_t ret;
+
+    kfs_lock_inode(inode);
+    ret = kfs_file_do_read(inode, buf, size, offset);
+    kfs_unlock_inode(inode);
+
+    return ret;
+}
+
+/*
+ * Like kfs_file_read(), the blocks already there and the new full ones
+ * are written from buf in one batch. A new block only partly covered
+ * is written alone with its zeroes. The inode must be locked.
+ */
+static ssize_t kfs_file_do_write(struct kfs_inode *inode, const char *buf,
+        size_t size, u64 offset)
+{
+    struct kfs *fs = inode->bg->fs;
+    struct kfs_file_rw rw;
+    size_t done = 0, len;
+    u64 bno, boff;
+    int ret = 0;
+
+    ret = kfs_zero_eof(inode, offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    kfs_file_rw_init(fs, &rw, KFS_IO_WRITE, buf);
+    while (done < size) {
+        boff = (offset + done) & KFS_BLOCK_MASK;
+        len = KFS_BLOCK_SIZE - boff;
+        if (len > (size - done)) {
+            len = size - done;
+        }
+
+        ret = kfs_bmap_bc(inode, (offset + done) >> KFS_BLOCK_SHIFT, 1, &bno,
+                rw.bc);
+        if (ret < 0) {
+            break;
+        }
+
+        if ((ret == KFS_BMAP_NEW) && (len < KFS_BLOCK_SIZE)) {
+            ret = kfs_write_new_block(inode, bno, offset + done - boff,
+                    buf + done, boff, len);
+            if (ret < 0) {
+                break;
+            }
+            done += len;
+            continue;
+        }
+
+        ret = kfs_file_rw_add(&rw, (char *)buf + done, len,
+                (bno << KFS_BLOCK_SHIFT) + boff);
+        if (ret < 0) {
+            break;
+        }
+        done += len;
+        ret = 0;
+    }
+
+    len = kfs_file_rw_submit(&rw, done);
+    if (len < done) {
+        kerr("Write inode %llu at %llu failed\n", inode->ino, offset + len);
+        done = len;
+        ret = -EIO;
+    }
+    kfs_file_written(inode, offset, done);
+
+    return done ? done : ret;
+}
+
+ssize_t kfs_file_write(struct kfs_inode *inode, const char *buf, size_t size, u64 offset)
+{
+    ssize_t ret;
+
+    kfs_lock_inode(inode);
+    ret = kfs_file_do_write(inode, buf, size, offset);
+    kfs_unlock_inode(inode);
+
+    return ret;
+}
+
+/* The data block pointer of iblock, 0 if nothing maps it */
+static int kfs_bmap_peek(struct kfs_inode *inode, u64 iblock,
+        struct kfs_bmap_cache *bc, u64 *val)
+{
+    struct kfs_bmap_ptr ptr;
+    int ret;
+
+    ret = kfs_bmap_locate(inode, iblock, 0, bc, &ptr);
+    if (ret < 0) {
+        return ret;
+    }
+    return kfs_bmap_get(inode, &ptr, bc, val);
+}
+
+static int kfs_bmap_store(struct kfs_inode *inode, u64 iblock,
+        struct kfs_bmap_cache *bc, u64 val)
+{
+    struct kfs_bmap_ptr ptr;
+    int ret;
+
+    ret = kfs_bmap_locate(inode, iblock, 1, bc, &ptr);
+    if (ret < 0) {
+        return ret;
+    }
+    return kfs_bmap_set(inode, &ptr, bc, val);
+}
+
+/*
+ * Reserve the holes from iblock on, up to last, as unwritten blocks.
+ * The holes in a row are asked for in one run, so they're contiguous
+ * on the image as far as the data groups allow. Return the number of
+ * file blocks done.
+ */
+static int kfs_file_reserve(struct kfs_inode *inode, u64 iblock, u64 last,
+        struct kfs_bmap_cache *bc)
+{
+    struct kfs *fs = inode->bg->fs;
+    u64 bno, val;
+    u32 n = 1, got, i;
+    int ret;
+
+    while (((iblock + n) <= last) && (n < fs->block_per_bg)) {
+        if (kfs_bmap_peek(inode, iblock + n, bc, &val) || val) {
+            break;
+        }
+        n++;
+    }
+
+    ret = kfs_alloc_blocks(fs, n, &bno, &got);
+    if (ret) {
+        return ret;
+    }
+
+    for (i = 0; i < got; i++) {
+        ret = kfs_bmap_store(inode, iblock + i, bc,
+                (bno + i) | KFS_BLOCK_UNWRITTEN);
+        if (ret < 0) {
+            break;
+        }
+    }
+    /* The blocks not mapped go back */
+    for (n = i; n < got; n++) {
+        kfs_free_block(fs, bno + n);
+    }
+
+    return i ? i : ret;
+}
+
+/*
+ * Mode 0 reserves the holes of [offset, offset+len) as unwritten
+ * blocks and grows the file over them unless FALLOC_FL_KEEP_SIZE is
+ * set. FALLOC_FL_PUNCH_HOLE frees the blocks fully in the range and
+ * zeroes the written parts of the others. FALLOC_FL_ZERO_RANGE turns
+ * the blocks fully in the range to unwritten ones, reserving the
+ * holes, and zeroes the written parts of the others.
+ * The emptied indirect blocks are kept.
+ */
+int kfs_file_fallocate(struct kfs_inode *inode, int mode, u64 offset, u64 len)
+{
+    struct kfs *fs = inode->bg->fs;
+    struct kfs_bmap_cache *bc;
+    u64 end = offset + len;
+    u64 iblock, last, val, bstart, from, to;
+    int ret = 0;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE
+                | FALLOC_FL_ZERO_RANGE)) {
+        return -EOPNOTSUPP;
+    }
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && (!(mode & FALLOC_FL_KEEP_SIZE)
+                || (mode & FALLOC_FL_ZERO_RANGE))) {
+        return -EOPNOTSUPP;
+    }
+    if (!len) {
+        return -EINVAL;
+    }
+    if (end < offset) {
+        return -EFBIG;
+    }
+
+    kfs_lock_inode(inode);
+    bc = kfs_bmap_cache();
+    iblock = offset >> KFS_BLOCK_SHIFT;
+    last = (end - 1) >> KFS_BLOCK_SHIFT;
+    while (iblock <= last) {
+        ret = kfs_bmap_peek(inode, iblock, bc, &val);
+        if (ret < 0) {
+            goto out;
+        }
+
+        bstart = iblock << KFS_BLOCK_SHIFT;
+        from = (offset > bstart) ? (offset - bstart) : 0;
+        to = ((end - bstart) < KFS_BLOCK_SIZE) ? (end - bstart) : KFS_BLOCK_SIZE;
+
+        if (!val) {
+            if (!(mode & FALLOC_FL_PUNCH_HOLE)) {
+                ret = kfs_file_reserve(inode, iblock, last, bc);
+                if (ret < 0) {
+                    goto out;
+                }
+                iblock += ret;
+                continue;
+            }
+        } else if ((from == 0) && (to == KFS_BLOCK_SIZE)) {
+            if (mode & FALLOC_FL_PUNCH_HOLE) {
+                ret = kfs_bmap_store(inode, iblock, bc, 0);
+                if (!ret) {
+                    ret = kfs_free_block(fs, kfs_block_bno(val));
+                }
+            } else if ((mode & FALLOC_FL_ZERO_RANGE)
+                    && !(val & KFS_BLOCK_UNWRITTEN)) {
+                ret = kfs_bmap_store(inode, iblock, bc, val | KFS_BLOCK_UNWRITTEN);
+            }
+        } else if ((mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+                && !(val & KFS_BLOCK_UNWRITTEN)) {
+            ret = kfs_zero_range(fs, (val << KFS_BLOCK_SHIFT) + from, to - from);
+        }
+        if (ret < 0) {
+            goto out;
+        }
+        iblock++;
+    }
+    ret = 0;
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && (end > inode->node->size)) {
+        ret = kfs_zero_eof(inode, end);
+        if (ret < 0) {
+            goto out;
+        }
+        inode->node->size = end;
+        kfs_set_bit_atomic(KFS_DSYNC_BIT, &inode->state);
+    }
+    inode->node->mtime = inode->node->ctime = time(NULL);
+    mark_inode_dirty(inode);
+
+  out:
+    kfs_unlock_inode(inode);
+    return ret;
+}
+
+/* A mapped block of inode goes back, val as it's stored in the map */
+static int kfs_drop_block(struct kfs_inode *inode, u64 val)
+{
+    if (inode->node->blocks) {
+        inode->node->blocks--;
+    }
+    return kfs_free_block(inode->bg->fs, kfs_block_bno(val));
+}
+
+/*
+ * Free the blocks mapped by the entries of the indirect block ind from
+ * first on, at level of the bmap cache. With dind the entries are the
+ * indirect blocks of the double indirect block, freed with their own
+ * entries. The indirect block itself is left to the caller.
+ */
+static int kfs_truncate_ind(struct kfs_inode *inode, u64 ind, u32 first,
+        struct kfs_bmap_cache *bc, int level, int dind)
+{
+    struct kfs *fs = inode->bg->fs;
+    u64 *entries;
+    u32 i, dirty = 0;
+    int ret;
+
+    entries = kfs_bmap_cache_get(fs, bc, level, ind);
+    if (!entries) {
+        kerr("Read indirect block %llu failed %s\n", ind, strerror(errno));
+        return -EIO;
+    }
+
+    for (i = first; i < KFS_ADDR_PER_BLOCK; i++) {
+        if (!entries[i]) {
+            continue;
+        }
+        if (dind) {
+            ret = kfs_truncate_ind(inode, entries[i], 0, bc, 1, 0);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        ret = kfs_drop_block(inode, entries[i]);
+        if (ret < 0) {
+            return ret;
+        }
+        entries[i] = 0;
+        dirty++;
+    }
+
+    /* An emptied one is freed by the caller, no need to write it */
+    if (dirty && first) {
+        ret = kfs_pwrite(fs, &entries[first],
+                (KFS_ADDR_PER_BLOCK - first) * sizeof(*entries),
+                (ind << KFS_BLOCK_SHIFT) + (first * sizeof(*entries)));
+        if (ret != ((KFS_ADDR_PER_BLOCK - first) * sizeof(*entries))) {
+            kerr("Write indirect block %llu failed %s\n", ind, strerror(errno));
+            return -EIO;
+        }
+    }
+    if (!first) {
+        bc->ind[level] = 0;
+    }
+
+    return 0;
+}
+
+/* Free the blocks of inode from file block iblock on */
+static int kfs_truncate_blocks(struct kfs_inode *inode, u64 iblock)
+{
+    struct kfs_node *node = inode->node;
+    struct kfs_bmap_cache *bc;
+    u64 base, first;
+    int ret;
+
+    for (; iblock < KFS_DB_NUM; iblock++) {
+        if (node->db[iblock]) {
+            ret = kfs_drop_block(inode, node->db[iblock]);
+            if (ret < 0) {
+                return ret;
+            }
+            node->db[iblock] = 0;
+        }
+    }
+
+    bc = kfs_bmap_cache();
+    if (!bc) {
+        return -ENOMEM;
+    }
+
+    base = KFS_DB_NUM;
+    if (node->indb && (iblock < (base + KFS_ADDR_PER_BLOCK))) {
+        first = iblock - base;
+        ret = kfs_truncate_ind(inode, node->indb, first, bc, 0, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!first) {
+            ret = kfs_drop_block(inode, node->indb);
+            if (ret < 0) {
+                return ret;
+            }
+            node->indb = 0;
+        }
+    }
+
+    base += KFS_ADDR_PER_BLOCK;
+    if (iblock < base) {
+        iblock = base;
+    }
+    if (node->dindb
+            && ((iblock - base) < ((u64)KFS_ADDR_PER_BLOCK * KFS_ADDR_PER_BLOCK))) {
+        first = iblock - base;
+        if (first % KFS_ADDR_PER_BLOCK) {
+            /* The indirect block first is in keeps its head */
+            u64 ind, *entries;
+
+            entries = kfs_bmap_cache_get(inode->bg->fs, bc, 0, node->dindb);
+            if (!entries) {
+                return -EIO;
+            }
+            ind = entries[first / KFS_ADDR_PER_BLOCK];
+            if (ind) {
+                ret = kfs_truncate_ind(inode, ind, first % KFS_ADDR_PER_BLOCK,
+                        bc, 1, 0);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            first += KFS_ADDR_PER_BLOCK;
+        }
+        first /= KFS_ADDR_PER_BLOCK;
+        if (first < KFS_ADDR_PER_BLOCK) {
+            ret = kfs_truncate_ind(inode, node->dindb, first, bc, 0, 1);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        if (!first) {
+            ret = kfs_drop_block(inode, node->dindb);
+            if (ret < 0) {
+                return ret;
+            }
+            node->dindb = 0;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Set the size of inode, the blocks past the new EOF are freed, the
+ * emptied indirect blocks too. The inode must be locked.
+ */
+int kfs_file_truncate(struct kfs_inode *inode, u64 size)
+{
+    u64 isize = inode->node->size;
+    int ret = 0;
+
+    if (size > isize) {
+        ret = kfs_zero_eof(inode, size);
+    } else if (size < isize || inode->node->blocks) {
+        /* Blocks fallocate reserved past EOF go too */
+        ret = kfs_truncate_blocks(inode, (size + KFS_BLOCK_MASK) >> KFS_BLOCK_SHIFT);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    inode->node->size = size;
+    inode->node->mtime = inode->node->ctime = time(NULL);
+    kfs_set_bit_atomic(KFS_DSYNC_BIT, &inode->state);
+    mark_inode_dirty(inode);
+
+    return 0;
+}
@@ -0,0 +1,252 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * Flex groups, mkfs -x
+ * - sb->flex_bgs consecutive bgs of the group descriptor table share
+ *   one run of bitmaps, a block per bg, right before the first of
+ *   them. The bgs have no bgd block and bitmap in front of their data,
+ *   the table has their bgds.
+ * - The bitmaps of a flex are read in together when one of them is
+ *   first needed, and dropped together once all of its bgs are cold.
+ * - kfs_sync_bg() only marks the bitmap dirty in the flex, then
+ *   kfs_sync_flexes() writes the dirty ones of each flex in one io,
+ *   from the first to the last.
+ */
+#include <kfs.h>
+
+/*
+ * Put bg, a new one in the table, in its flex. The first bg of a flex
+ * starts it, with the bitmaps at bno.
+ */
+int kfs_flex_add_bg(struct kfs_bg *bg, u64 bno)
+{
+    struct kfs *fs = bg->fs;
+    struct kfs_flex *flex;
+    u32 idx = bg->slot % fs->sb->flex_bgs;
+
+    if (!idx) {
+        flex = kfs_alloc(MEM_FS, sizeof(*flex)
+                + (fs->sb->flex_bgs * sizeof(flex->bgs[0])));
+        if (!flex) {
+            kerr("Alloc flex of bg %u failed\n", bg->slot);
+            return -ENOMEM;
+        }
+        memset(flex, 0, sizeof(*flex));
+        pthread_mutex_init(&flex->lock, NULL);
+        flex->bno = bno;
+        if (fs->mntopt.flags & KFS_MNT_MMAP) {
+            flex->bitmaps = kfs_map_ptr(fs, bno << KFS_BLOCK_SHIFT);
+        }
+        list_add_tail(&flex->link, &fs->flexes);
+    } else {
+        KFS_ASSERT(!list_empty(&fs->flexes));
+        flex = list_entry(fs->flexes.prev, struct kfs_flex, link);
+        KFS_ASSERT(flex->nr == idx);
+    }
+
+    flex->bgs[flex->nr++] = bg;
+    bg->flex = flex;
+    bg->mapb = flex->bno + idx;
+    if (fs->mntopt.flags & KFS_MNT_MMAP) {
+        bg->bitmap = &flex->bitmaps[idx];
+    } else if (flex->bitmaps) {
+        /* Loaded for the others already, a new bitmap is empty */
+        memset(&flex->bitmaps[idx], 0, sizeof(flex->bitmaps[idx]));
+    }
+
+    return 0;
+}
+
+/* Undo kfs_flex_add_bg() of the last bg */
+void kfs_flex_del_bg(struct kfs_bg *bg)
+{
+    struct kfs *fs = bg->fs;
+    struct kfs_flex *flex = bg->flex;
+
+    KFS_ASSERT(flex->bgs[flex->nr - 1] == bg);
+    flex->nr--;
+    bg->flex = NULL;
+    bg->bitmap = NULL;
+    if (!flex->nr) {
+        list_del(&flex->link);
+        if (flex->bitmaps && !(fs->mntopt.flags & KFS_MNT_MMAP)) {
+            kfs_free(MEM_FS, flex->bitmaps);
+        }
+        kfs_free(MEM_FS, flex);
+    }
+}
+
+/*
+ * kfs_load_bitmap() of a bg in a flex, the bg must be locked. The
+ * others have no bitmap yet, kfs_check_bitmap() of them is safe.
+ */
+int kfs_load_flex(struct kfs_bg *bg)
+{
+    struct kfs *fs = bg->fs;
+    struct kfs_flex *flex = bg->flex;
+    size_t len = (size_t)fs->sb->flex_bgs << KFS_BLOCK_SHIFT;
+    u32 i;
+    int ret = 0;
+
+    pthread_mutex_lock(&flex->lock);
+    if (!flex->bitmaps) {
+        flex->bitmaps = kfs_alloc_aligned(len);
+        if (!flex->bitmaps) {
+            kerr("Alloc bitmaps of flex %llu failed\n", flex->bno);
+            ret = -ENOMEM;
+            goto out;
+        }
+        if (kfs_pread(fs, flex->bitmaps, len, flex->bno << KFS_BLOCK_SHIFT) != len) {
+            kerr("Read bitmaps of flex %llu failed %s\n", flex->bno,
+                    strerror(errno));
+            kfs_free(MEM_FS, flex->bitmaps);
+            flex->bitmaps = NULL;
+            ret = -EIO;
+            goto out;
+        }
+        for (i = 0; !ret && (i < flex->nr); i++) {
+            ret = kfs_check_bitmap(flex->bgs[i], &flex->bitmaps[i]);
+        }
+        if (ret) {
+            kfs_free(MEM_FS, flex->bitmaps);
+            flex->bitmaps = NULL;
+            goto out;
+        }
+        kdebug2(LOG_OBJECT, "Load bitmaps of flex %llu\n", flex->bno);
+    }
+    bg->bitmap = &flex->bitmaps[bg->slot % fs->sb->flex_bgs];
+
+  out:
+    pthread_mutex_unlock(&flex->lock);
+    return ret;
+}
+
+/* The bitmap of bg has to be written, the bg must be locked */
+void kfs_flex_dirty(struct kfs_bg *bg)
+{
+    struct kfs_flex *flex = bg->flex;
+
+    pthread_mutex_lock(&flex->lock);
+    flex->dirty |= 1ULL << (bg->slot % bg->fs->sb->flex_bgs);
+    pthread_mutex_unlock(&flex->lock);
+}
+
+static void kfs_sync_flex_end(struct kfs_io *io, int err)
+{
+    struct kfs_flex *flex = io->private;
+    u32 i;
+
+    for (i = 0; i < flex->nr; i++) {
+        if (flex->writing & (1ULL << i)) {
+            kfs_sync_bg_done(flex->bgs[i], err);
+        }
+    }
+    flex->writing = 0;
+}
+
+/*
+ * Queue the dirty bitmaps of each flex to batch, the first to the last
+ * one in one io. Called by kfs_sync_fs() after kfs_sync_bgs().
+ */
+int kfs_sync_flexes(struct kfs *fs, struct kfs_io_batch *batch)
+{
+    struct kfs_flex *flex;
+    struct kfs_io *io;
+    u32 first, last;
+    u64 dirty;
+
+    list_for_each_entry(flex, &fs->flexes, link) {
+        pthread_mutex_lock(&flex->lock);
+        dirty = flex->dirty;
+        flex->dirty = 0;
+        pthread_mutex_unlock(&flex->lock);
+        if (!dirty) {
+            continue;
+        }
+
+        first = __builtin_ctzll(dirty);
+        last = 63 - __builtin_clzll(dirty);
+        io = kfs_io_batch_add(batch, kfs_meta_io_op(fs),
+                (flex->bno + first) << KFS_BLOCK_SHIFT, kfs_sync_flex_end, flex);
+        if (!io) {
+            kerr("Queue bitmaps of flex %llu failed\n", flex->bno);
+            pthread_mutex_lock(&flex->lock);
+            flex->dirty |= dirty;
+            pthread_mutex_unlock(&flex->lock);
+            return -ENOMEM;
+        }
+        /* One sync at a time, nobody else looks at it */
+        flex->writing = dirty;
+        kfs_io_add_vec(io, &flex->bitmaps[first],
+                (size_t)(last - first + 1) << KFS_BLOCK_SHIFT);
+    }
+
+    return 0;
+}
+
+/*
+ * kfs_evict_bgs() of the flexes, the bitmaps of one are dropped when
+ * all its bgs are clean and cold. All of them are locked meanwhile, in
+ * the table order.
+ */
+void kfs_evict_flexes(struct kfs *fs)
+{
+    struct kfs_flex *flex;
+    struct kfs_bg *bg;
+    time_t now = jiffies;
+    u32 i, locked, busy, nr = 0;
+
+    if (fs->mntopt.flags & KFS_MNT_MMAP) {
+        return;
+    }
+
+    lock_for_extend_fs(fs);
+    list_for_each_entry(flex, &fs->flexes, link) {
+        if (!flex->bitmaps) {
+            continue;
+        }
+        busy = 0;
+        for (locked = 0; !busy && (locked < flex->nr); locked++) {
+            bg = flex->bgs[locked];
+            lock_bg(bg);
+            busy = kfs_test_bit_atomic(KFS_DIRTY_BIT, &bg->state)
+                || (bg->bitmap && ((now - bg->atime) < KFS_BG_COLD_TIME));
+        }
+        if (!busy && !flex->dirty) {
+            for (i = 0; i < flex->nr; i++) {
+                kfs_sum_bg(flex->bgs[i]);
+                flex->bgs[i]->bitmap = NULL;
+            }
+            kfs_free(MEM_FS, flex->bitmaps);
+            flex->bitmaps = NULL;
+            nr++;
+        }
+        for (i = 0; i < locked; i++) {
+            unlock_bg(flex->bgs[i]);
+        }
+    }
+    unlock_for_extend_fs(fs);
+
+    if (nr) {
+        kdebug(LOG_OBJECT, "Dropped the bitmaps of %u cold flexes\n", nr);
+    }
+}
+
+/* At umount, after the last sync */
+void kfs_free_flexes(struct kfs *fs)
+{
+    struct kfs_flex *flex, *n;
+
+    list_for_each_entry_safe(flex, n, &fs->flexes, link) {
+        list_del(&flex->link);
+        if (flex->bitmaps && !(fs->mntopt.flags & KFS_MNT_MMAP)) {
+            kfs_free(MEM_FS, flex->bitmaps);
+        }
+        kfs_free(MEM_FS, flex);
+    }
+}
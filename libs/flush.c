@@ -0,0 +1,361 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * Background flusher for the metadata and the data.
+ * - The dirty sb, bgs and inodes are only marked and accounted by
+ *   the callers, the flusher writes them back every update_daley
+ *   seconds, or earlier once dirty_thresh bytes are dirty.
+ * - The file data is written to the image right away, but counted as
+ *   dirty per inode until the flusher or an fsync fdatasyncs it. Not
+ *   with odirect, nothing is left in the page cache then.
+ * - With update_daley 0 there is no flusher, everything is written
+ *   at umount time.
+ * - Writers call kfs_balance_dirty() to be throttled as the dirty
+ *   bytes get close to dirty_limit.
+ * - fsync is a group commit, see kfs_sync_file().
+ */
+#include <kfs.h>
+
+void kfs_wakeup_flusher(struct kfs *fs)
+{
+    pthread_mutex_lock(&fs->flush_lock);
+    if (kfs_test_bit_atomic(KFS_FLUSH_RUN_BIT, &fs->flush_state)
+            && !kfs_test_and_set_bit_atomic(KFS_FLUSH_WAKE_BIT, &fs->flush_state)) {
+        pthread_cond_signal(&fs->flush_cond);
+    }
+    pthread_mutex_unlock(&fs->flush_lock);
+}
+
+/*
+ * Dirtying doesn't take flush_lock, only waking up the flusher does.
+ * The bytes of the fs are taken off under it, as the writers waiting on
+ * the limit look at them under it.
+ */
+void kfs_inc_dirty(struct kfs *fs, u64 bytes)
+{
+    u64 dirty = __atomic_add_fetch(&fs->dirty_bytes, bytes, __ATOMIC_RELAXED);
+
+    if ((dirty >= fs->mntopt.dirty_thresh)
+            && kfs_test_bit_atomic(KFS_FLUSH_RUN_BIT, &fs->flush_state)
+            && !kfs_test_and_set_bit_atomic(KFS_FLUSH_WAKE_BIT, &fs->flush_state)) {
+        kdebug2(LOG_IO, "dirty %llu, wake up flusher\n", dirty);
+        pthread_mutex_lock(&fs->flush_lock);
+        pthread_cond_signal(&fs->flush_cond);
+        pthread_mutex_unlock(&fs->flush_lock);
+    }
+}
+
+void kfs_dec_dirty(struct kfs *fs, u64 bytes)
+{
+    u64 limit = fs->mntopt.dirty_limit;
+    u64 dirty;
+
+    pthread_mutex_lock(&fs->flush_lock);
+    KFS_ASSERT(fs->dirty_bytes >= bytes);
+    dirty = __atomic_fetch_sub(&fs->dirty_bytes, bytes, __ATOMIC_RELAXED);
+    if ((dirty >= limit) && ((dirty - bytes) < limit)) {
+        /* Release the writers blocked on the limit */
+        pthread_cond_broadcast(&fs->dirty_cond);
+    }
+    pthread_mutex_unlock(&fs->flush_lock);
+}
+
+void kfs_inode_inc_dirty(struct kfs_inode *inode, u64 bytes)
+{
+    __atomic_add_fetch(&inode->dirty_bytes, bytes, __ATOMIC_RELAXED);
+    kfs_inc_dirty(inode->bg->fs, bytes);
+}
+
+void kfs_inode_dec_dirty(struct kfs_inode *inode, u64 bytes)
+{
+    KFS_ASSERT(__atomic_load_n(&inode->dirty_bytes, __ATOMIC_RELAXED) >= bytes);
+    __atomic_sub_fetch(&inode->dirty_bytes, bytes, __ATOMIC_RELAXED);
+    kfs_dec_dirty(inode->bg->fs, bytes);
+}
+
+/*
+ * The data goes to the image with pwrite, it's dirty in the page cache
+ * until the image is fdatasync'ed, see kfs_sync_data(). Counted first,
+ * only what is on data_inodes is taken off again.
+ */
+void kfs_inode_dirty_data(struct kfs_inode *inode, u64 bytes)
+{
+    struct kfs *fs = inode->bg->fs;
+
+    kfs_inode_inc_dirty(inode, bytes);
+    pthread_mutex_lock(&fs->data_lock);
+    if (list_empty(&inode->data_link)) {
+        list_add_tail(&inode->data_link, &fs->data_inodes);
+    }
+    inode->dirty_data += bytes;
+    pthread_mutex_unlock(&fs->data_lock);
+}
+
+/*
+ * fdatasync the image and take off the data the inodes had dirty before
+ * it. The inodes stay on our list meanwhile, what they get written goes
+ * to dirty_data and they are put back on data_inodes for the next one.
+ * Without force nothing is done if there is no dirty data.
+ */
+int kfs_sync_data(struct kfs *fs, int force)
+{
+    struct kfs_inode *inode, *n;
+    struct list_head list;
+    u64 bytes = 0;
+    int ret = 0;
+
+    INIT_LIST_HEAD(&list);
+    pthread_mutex_lock(&fs->data_lock);
+    list_splice(&fs->data_inodes, &list);
+    INIT_LIST_HEAD(&fs->data_inodes);
+    list_for_each_entry(inode, &list, data_link) {
+        inode->sync_data = inode->dirty_data;
+        inode->dirty_data = 0;
+    }
+    pthread_mutex_unlock(&fs->data_lock);
+
+    if (!force && list_empty(&list)) {
+        return 0;
+    }
+    if (fdatasync(fs->fd) < 0) {
+        ret = -errno;
+        kerr("fdatasync failed: %s\n", strerror(errno));
+    }
+
+    pthread_mutex_lock(&fs->data_lock);
+    list_for_each_entry_safe(inode, n, &list, data_link) {
+        if (ret) {
+            inode->dirty_data += inode->sync_data;
+        } else {
+            KFS_ASSERT(inode->dirty_bytes >= inode->sync_data);
+            __atomic_sub_fetch(&inode->dirty_bytes, inode->sync_data,
+                    __ATOMIC_RELAXED);
+            bytes += inode->sync_data;
+        }
+        inode->sync_data = 0;
+        list_del_init(&inode->data_link);
+        if (inode->dirty_data) {
+            list_add_tail(&inode->data_link, &fs->data_inodes);
+        }
+    }
+    pthread_mutex_unlock(&fs->data_lock);
+    if (bytes) {
+        kfs_dec_dirty(fs, bytes);
+    }
+
+    return ret;
+}
+
+/* Pause in ms for dirty between start and limit, MAX_DIRTY_PAUSE at limit */
+static u64 kfs_dirty_pause(u64 dirty, u64 start, u64 limit)
+{
+    if (dirty >= limit) {
+        return MAX_DIRTY_PAUSE;
+    }
+    if (dirty <= start) {
+        return 0;
+    }
+    return (MAX_DIRTY_PAUSE * (dirty - start)) / (limit - start);
+}
+
+/*
+ * Called by the writers after dirtying something, with no lock held.
+ * Between dirty_thresh and dirty_limit the writer is paused for a time
+ * proportional to how close we are to the limit, so the latency grows
+ * smoothly instead of every writer stalling at once on a full flush.
+ * At the limit the writers wait until the flusher brings it back down.
+ * An inode is throttled the same way from half of inode_dirty_limit,
+ * mostly on the data it wrote.
+ */
+void kfs_balance_dirty(struct kfs *fs, struct kfs_inode *inode)
+{
+    u64 limit = fs->mntopt.dirty_limit;
+    u64 ilimit = fs->mntopt.inode_dirty_limit;
+    u64 pause, ipause;
+    struct timespec ts;
+    int over;
+
+    pthread_mutex_lock(&fs->flush_lock);
+    for (;;) {
+        pause = kfs_dirty_pause(fs->dirty_bytes,
+                fs->mntopt.dirty_thresh, limit);
+        over = (fs->dirty_bytes >= limit);
+        if (inode) {
+            ipause = kfs_dirty_pause(inode->dirty_bytes, ilimit >> 1, ilimit);
+            if (ipause > pause) {
+                pause = ipause;
+            }
+            over |= (inode->dirty_bytes >= ilimit);
+        }
+
+        if (!pause) {
+            break;
+        }
+
+        if (!kfs_test_bit_atomic(KFS_FLUSH_RUN_BIT, &fs->flush_state)) {
+            /* Nobody else is going to write it back */
+            pthread_mutex_unlock(&fs->flush_lock);
+            if (over && (kfs_sync_fs(fs) || kfs_sync_data(fs, 0))) {
+                kwarn("Sync over the dirty limit failed\n");
+            }
+            return;
+        }
+
+        if (!kfs_test_and_set_bit_atomic(KFS_FLUSH_WAKE_BIT, &fs->flush_state)) {
+            pthread_cond_signal(&fs->flush_cond);
+        }
+
+        kdebug2(LOG_IO, "dirty %llu inode %llu, pause %llums\n",
+                fs->dirty_bytes, inode?inode->dirty_bytes:0, pause);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (pause % 1000) * 1000000;
+        ts.tv_sec += (pause / 1000) + (ts.tv_nsec / 1000000000);
+        ts.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&fs->dirty_cond, &fs->flush_lock, &ts);
+
+        /* Only the hard limits keep us here */
+        if ((fs->dirty_bytes < limit)
+                && (!inode || (inode->dirty_bytes < ilimit))) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->flush_lock);
+}
+
+/*
+ * fsync of inode. The callers coming in while a commit is running all
+ * wait for the next one, run by the first of them for everybody: one
+ * kfs_sync_fs() and one fdatasync() of the image. The metadata is only
+ * written back if one of them needs it, for a datasync that is when
+ * the size or the block map of its inode changed.
+ */
+int kfs_sync_file(struct kfs_inode *inode, int datasync)
+{
+    struct kfs *fs = inode->bg->fs;
+    int meta, ret;
+    u64 target;
+
+    meta = !datasync || kfs_test_bit_atomic(KFS_DSYNC_BIT, &inode->state);
+
+    pthread_mutex_lock(&fs->commit_lock);
+    /* The next commit to start covers what we wrote */
+    target = fs->commit_seq + 1;
+    fs->commit_meta |= meta;
+    while (fs->commit_done < target) {
+        if (fs->committing) {
+            pthread_cond_wait(&fs->commit_cond, &fs->commit_lock);
+            continue;
+        }
+
+        fs->committing = 1;
+        fs->commit_seq++;
+        meta = fs->commit_meta;
+        fs->commit_meta = 0;
+        pthread_mutex_unlock(&fs->commit_lock);
+
+        ret = meta ? kfs_sync_fs(fs) : 0;
+        /*
+         * A journaled sync_fs is durable already, only the dirty data
+         * needs one more fdatasync to be counted off.
+         */
+        if (!ret) {
+            ret = kfs_sync_data(fs, !(meta && fs->journal.bno));
+        }
+
+        pthread_mutex_lock(&fs->commit_lock);
+        kdebug2(LOG_IO, "commit %llu meta %d ret %d\n",
+                fs->commit_seq, meta, ret);
+        if (ret) {
+            fs->commit_err = ret;
+            fs->commit_err_seq = fs->commit_seq;
+        }
+        fs->commit_done = fs->commit_seq;
+        fs->committing = 0;
+        pthread_cond_broadcast(&fs->commit_cond);
+    }
+    /* A later commit failing may be ours too, better report it */
+    ret = (fs->commit_err_seq >= target) ? fs->commit_err : 0;
+    pthread_mutex_unlock(&fs->commit_lock);
+
+    return ret;
+}
+
+static void *kfs_flusher(void *data)
+{
+    struct kfs *fs = (struct kfs *)data;
+    struct timespec ts;
+    int ret;
+
+    kdebug(LOG_THREADS, "flusher started, interval %u thresh %u\n",
+            fs->mntopt.update_daley, fs->mntopt.dirty_thresh);
+
+    pthread_mutex_lock(&fs->flush_lock);
+    while (kfs_test_bit_atomic(KFS_FLUSH_RUN_BIT, &fs->flush_state)) {
+        if (!kfs_test_bit_atomic(KFS_FLUSH_WAKE_BIT, &fs->flush_state)) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += fs->mntopt.update_daley;
+            pthread_cond_timedwait(&fs->flush_cond, &fs->flush_lock, &ts);
+        }
+        kfs_clear_bit_atomic(KFS_FLUSH_WAKE_BIT, &fs->flush_state);
+
+        if (!fs->dirty_bytes) {
+            continue;
+        }
+
+        kdebug2(LOG_IO, "flush %llu dirty bytes\n", fs->dirty_bytes);
+        pthread_mutex_unlock(&fs->flush_lock);
+        ret = kfs_sync_fs(fs);
+        if (!ret) {
+            ret = kfs_sync_data(fs, 0);
+        }
+        if (ret) {
+            kwarn("Background flush failed %d\n", ret);
+        }
+        pthread_mutex_lock(&fs->flush_lock);
+        /* Let the paused writers re-check */
+        pthread_cond_broadcast(&fs->dirty_cond);
+    }
+    pthread_mutex_unlock(&fs->flush_lock);
+
+    kdebug(LOG_THREADS, "flusher stopped\n");
+    return NULL;
+}
+
+int kfs_start_flusher(struct kfs *fs)
+{
+    int ret;
+
+    if (!fs->mntopt.update_daley) {
+        kinfo("Background flush disabled\n");
+        return 0;
+    }
+
+    kfs_set_bit_atomic(KFS_FLUSH_RUN_BIT, &fs->flush_state);
+    ret = pthread_create(&fs->flusher, NULL, kfs_flusher, fs);
+    if (ret) {
+        kerr("Create flusher thread failed: %s\n", strerror(ret));
+        kfs_clear_bit_atomic(KFS_FLUSH_RUN_BIT, &fs->flush_state);
+        return -ret;
+    }
+
+    return 0;
+}
+
+void kfs_stop_flusher(struct kfs *fs)
+{
+    pthread_mutex_lock(&fs->flush_lock);
+    if (!kfs_test_and_clear_bit_atomic(KFS_FLUSH_RUN_BIT, &fs->flush_state)) {
+        pthread_mutex_unlock(&fs->flush_lock);
+        return;
+    }
+    pthread_cond_signal(&fs->flush_cond);
+    pthread_cond_broadcast(&fs->dirty_cond);
+    pthread_mutex_unlock(&fs->flush_lock);
+
+    pthread_join(fs->flusher, NULL);
+}
@@ -18,7 +18,7 @@
 
 u64 inode_offset(struct kfs_inode *inode)
 {
-    return bg_offset(inode->bg) + ((inode->ino%inode->bg->fs->inode_per_bg) << KFS_INODE_SHIFT) + KFS_BG_META_SIZE;
+    return (bg_data_bno(inode->bg) << KFS_BLOCK_SHIFT) + ((inode->ino%inode->bg->fs->inode_per_bg) << KFS_INODE_SHIFT);
 }
 
 void kfs_fill_inode(struct kfs_inode *inode)
@@ -27,98 +27,196 @@ void kfs_fill_inode(struct kfs_inode *inode)
 
 void kfs_lock_inode(struct kfs_inode *inode)
 {
-    pthread_mutex_lock(&inode->lock);
+    kfs_mutex_lock(&inode->lock, KFS_LOCK_INODE);
 }
 
 void kfs_unlock_inode(struct kfs_inode *inode)
 {
-    pthread_mutex_unlock(&inode->lock);
+    kfs_mutex_unlock(&inode->lock, KFS_LOCK_INODE);
 }
 
-void mark_inode_dirty(struct kfs_inode *inode, int locked)
+void mark_inode_dirty(struct kfs_inode *inode)
 {
-    kfs_set_bit(KFS_DIRTY_BIT, &inode->state, locked?NULL:&inode->lock);
+    if (!kfs_test_and_set_bit_atomic(KFS_DIRTY_BIT, &inode->state)) {
+        /* The flusher will pick it up */
+        kfs_inode_inc_dirty(inode, sizeof(*inode->node));
+    }
 }
 
-int kfs_sync_inode(struct kfs_inode *inode, int locked)
+static void kfs_sync_inode_done(struct kfs_inode *inode, int err)
 {
-    int ret = 0;
+    if (err) {
+        kfs_set_bit_atomic(KFS_DSYNC_BIT, &inode->state);
+        /* Still dirty, don't count it twice if it was dirtied again */
+        if (kfs_test_and_set_bit_atomic(KFS_DIRTY_BIT, &inode->state)) {
+            kfs_inode_dec_dirty(inode, sizeof(*inode->node));
+        }
+        return;
+    }
+    kfs_inode_dec_dirty(inode, sizeof(*inode->node));
 
-    if (kfs_test_bit(KFS_DIRTY_BIT, &inode->state, locked?NULL:&inode->lock)) {
-        ret = pwrite(inode->bg->fs->fd, &inode->node, sizeof(inode->node),
-                inode_offset(inode));
-        if (ret != sizeof(inode->node)) {
-            kerr("Write inode failed %s\n",
-                    strerror(errno));
-            ret = -EIO;
-            goto out;
-        } else {
-            ret = 0;
+    /* Dirtied again while written, the next write frees it */
+    if (!kfs_test_bit_atomic(KFS_DIRTY_BIT, &inode->state)
+            && kfs_test_and_clear_bit_atomic(KFS_FREE_BIT, &inode->state)) {
+        if (kfs_free_ino(inode)) {
+            kerr("Free inode %llu failed\n", inode->ino);
         }
     }
-  out:
+}
+
+static void kfs_sync_inode_end(struct kfs_io *io, int err)
+{
+    kfs_sync_inode_done(io->private, err);
+}
+
+/*
+ * Queue the inode to batch if it's dirty. With a NULL batch it's
+ * written now, and the error is returned.
+ */
+int kfs_sync_inode(struct kfs_inode *inode, struct kfs_io_batch *batch)
+{
+    struct kfs_io_batch own;
+    struct kfs_io *io;
+    int ret = 0;
+
+    if (!kfs_test_and_clear_bit_atomic(KFS_DIRTY_BIT, &inode->state)) {
+        return 0;
+    }
+    /* Set again if the write fails */
+    kfs_clear_bit_atomic(KFS_DSYNC_BIT, &inode->state);
+
+    if (!batch) {
+        kfs_io_batch_init(inode->bg->fs, &own);
+    }
+    io = kfs_io_batch_add(batch?batch:&own, kfs_meta_io_op(inode->bg->fs),
+            inode_offset(inode),
+            batch?kfs_sync_inode_end:NULL, inode);
+    if (!io) {
+        kfs_set_bit_atomic(KFS_DSYNC_BIT, &inode->state);
+        kfs_set_bit_atomic(KFS_DIRTY_BIT, &inode->state);
+        return -ENOMEM;
+    }
+    kfs_set_meta_csum(inode->node, sizeof(*inode->node),
+            offsetof(struct kfs_node, csum));
+    kfs_io_add_vec(io, inode->node, sizeof(*inode->node));
+
+    if (!batch) {
+        ret = kfs_io_batch_submit(&own);
+        kfs_io_batch_release(&own);
+        kfs_sync_inode_done(inode, ret);
+    }
+
+    return ret;
+}
+
+/*
+ * Check the crc32c of the node just read in, the inode is locked. One
+ * never written is all zeros.
+ */
+static int kfs_check_inode(struct kfs_inode *inode)
+{
+    static const struct kfs_node zero;
+    struct kfs_node *node = inode->node;
+    u32 want = kfs_meta_csum(node, sizeof(*node), offsetof(struct kfs_node, csum));
+    int ret;
+
+    if (!node->csum && !memcmp(node, &zero, sizeof(zero))) {
+        return 0;
+    }
+    ret = kfs_check_csum(inode->bg->fs, node->csum, want, "inode", inode->ino);
+    if (ret > 0) {
+        mark_inode_dirty(inode);
+        ret = 0;
+    }
     return ret;
 }
 
 int kfs_read_inode(struct kfs_inode *inode)
 {
+    struct kfs *fs = inode->bg->fs;
     int ret;
 
-    ret = pread(inode->bg->fs->fd, &inode->node, sizeof(inode->node), inode_offset(inode));
-    if (ret != sizeof(inode->node)) {
+    if (fs->mntopt.flags & KFS_MNT_MMAP) {
+        inode->node = kfs_map_ptr(fs, inode_offset(inode));
+        return kfs_check_inode(inode);
+    }
+
+    ret = kfs_pread(inode->bg->fs, inode->node, sizeof(*inode->node), inode_offset(inode));
+    if (ret != sizeof(*inode->node)) {
         kerr("Read inode failed %s\n",
                 strerror(errno));
         ret = -EIO;
         goto out;
     } else {
-        ret = 0;
+        ret = kfs_check_inode(inode);
     }
   out:
     return ret;
 }
 
+void kfs_inode_stat(struct kfs_inode *inode, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_dev = 200;
+    stbuf->st_ino = inode->ino;
+    stbuf->st_mode = inode->node->mode;
+    stbuf->st_nlink = inode->node->nlink;
+    stbuf->st_uid = inode->node->uid;
+    stbuf->st_gid = inode->node->gid;
+    stbuf->st_rdev = 0;
+    stbuf->st_size = inode->node->size;
+    stbuf->st_blksize = 512;
+    stbuf->st_blocks = inode->node->blocks << (KFS_BLOCK_SHIFT - 9);
+    stbuf->st_atime = inode->node->mtime;
+    stbuf->st_mtime = inode->node->mtime;
+    stbuf->st_ctime = inode->node->ctime;
+}
+
 void kfs_init_inode(struct kfs_inode *inode)
 {
     memset(inode, 0, sizeof(*inode));
+    inode->node = &inode->node_buf;
     INIT_LIST_HEAD(&inode->link);
+    INIT_LIST_HEAD(&inode->data_link);
     pthread_mutex_init(&inode->lock, NULL);
 }
 
 void kfs_ihash_insert(struct kfs_bg *ibg, struct kfs_inode *inode, int locked)
 {
-    int slot = inode->ino/KFS_IHASH_SLOT;
+    int slot = inode->ino % KFS_IHASH_SLOT;
 
     if (!locked) {
-        pthread_mutex_lock(&ibg->ihash[slot].lock);
+        kfs_mutex_lock(&ibg->ihash[slot].lock, KFS_LOCK_IHASH);
     }
     list_add_tail(&inode->link, &ibg->ihash[slot].inodes);
     if (!locked) {
-        pthread_mutex_unlock(&ibg->ihash[slot].lock);
+        kfs_mutex_unlock(&ibg->ihash[slot].lock, KFS_LOCK_IHASH);
     }
 }
 
 void kfs_ihash_remove(struct kfs_bg *ibg, struct kfs_inode *inode, int locked)
 {
-    int slot = inode->ino/KFS_IHASH_SLOT;
+    int slot = inode->ino % KFS_IHASH_SLOT;
 
     if (!locked) {
-        pthread_mutex_lock(&ibg->ihash[slot].lock);
+        kfs_mutex_lock(&ibg->ihash[slot].lock, KFS_LOCK_IHASH);
     }
     list_del_init(&inode->link);
     if (!locked) {
-        pthread_mutex_unlock(&ibg->ihash[slot].lock);
+        kfs_mutex_unlock(&ibg->ihash[slot].lock, KFS_LOCK_IHASH);
     }
 }
 
 struct kfs_inode *kfs_ihash_get(struct kfs_bg *ibg, u64 ino)
 {
-    int slot = ino/KFS_IHASH_SLOT;
+    int slot = ino % KFS_IHASH_SLOT;
     struct kfs_inode *inode;
 
-    pthread_mutex_lock(&ibg->ihash[slot].lock);
+    kfs_mutex_lock(&ibg->ihash[slot].lock, KFS_LOCK_IHASH);
     list_for_each_entry(inode, &ibg->ihash[slot].inodes, link) {
-        if (inode->ino == ino) {
-            pthread_mutex_unlock(&ibg->ihash[slot].lock);
+        if ((inode->ino == ino)
+                && !kfs_test_bit_atomic(KFS_DEAD_BIT, &inode->state)) {
+            kfs_mutex_unlock(&ibg->ihash[slot].lock, KFS_LOCK_IHASH);
             kfs_lock_inode(inode);
             return inode;
         }
@@ -127,7 +225,7 @@ struct kfs_inode *kfs_ihash_get(struct kfs_bg *ibg, u64 ino)
     inode = kfs_alloc(MEM_FS, sizeof(*inode));
     if (!inode) {
         kerr("Alloc inode failed\n");
-        pthread_mutex_unlock(&ibg->ihash[slot].lock);
+        kfs_mutex_unlock(&ibg->ihash[slot].lock, KFS_LOCK_IHASH);
         return NULL;
     }
 
@@ -135,8 +233,9 @@ struct kfs_inode *kfs_ihash_get(struct kfs_bg *ibg, u64 ino)
     inode->ino = ino;
     inode->bg = ibg;
     kfs_ihash_insert(ibg, inode, 1);
+    kfs_lock_inode(inode);
 
-    pthread_mutex_unlock(&ibg->ihash[slot].lock);
+    kfs_mutex_unlock(&ibg->ihash[slot].lock, KFS_LOCK_IHASH);
 
     return inode;
 }
@@ -145,7 +244,6 @@ struct kfs_inode *kfs_get_inode(struct kfs *fs, u64 ino)
 {
     struct kfs_inode *inode;
     struct kfs_bg *ibg;
-    int ret;
 
     ibg = kfs_get_ibg(fs, ino);
     if (!ibg) {
@@ -154,20 +252,74 @@ struct kfs_inode *kfs_get_inode(struct kfs *fs, u64 ino)
 
     inode = kfs_ihash_get(ibg, ino);
     if (!inode) {
-        goto out;
+        return NULL;
     }
 
-    if (!kfs_test_bit(KFS_INIT_BIT, &inode->state, NULL)) {
+    if (!kfs_test_bit_atomic(KFS_INIT_BIT, &inode->state)) {
         /* Do read from file */
         if (kfs_read_inode(inode)) {
             /* FIXME: Inode need ref here */
             kfs_ihash_remove(ibg, inode, 0);
+            kfs_unlock_inode(inode);
+            kfs_free(MEM_FS, inode);
+            return NULL;
         }
+        kfs_set_bit_atomic(KFS_INIT_BIT, &inode->state);
     }
 
     kfs_unlock_inode(inode);
 
-  out:
-    unlock_bgs(fs, KFS_BG_INODE);
     return inode;
 }
+
+/* One more lookup of inode, a frontend keeps using it */
+void kfs_hold_inode(struct kfs_inode *inode)
+{
+    kfs_lock_inode(inode);
+    inode->nlookup++;
+    kfs_unlock_inode(inode);
+}
+
+/*
+ * Neither linked nor looked up any more, the inode is locked. The
+ * blocks go back now, the ino once the cleared node is written, so a
+ * new inode never shares the slot with a dirty dead one. The struct
+ * is left dead in the ihash, the inodes are only freed with the fs.
+ */
+static void kfs_evict_inode(struct kfs_inode *inode)
+{
+    int ret;
+
+    kdebug(LOG_OBJECT, "evict inode %llu\n", inode->ino);
+
+    ret = kfs_file_truncate(inode, 0);
+    if (ret) {
+        kerr("Free blocks of inode %llu failed %d, left in use\n",
+                inode->ino, ret);
+        return;
+    }
+
+    if (inode->dentry) {
+        kfs_free_dentry(inode->dentry);
+        inode->dentry = NULL;
+    }
+
+    memset(inode->node, 0, sizeof(*inode->node));
+    kfs_set_bit_atomic(KFS_DEAD_BIT, &inode->state);
+    /* Dirty before the free bit, see kfs_sync_inode_done() */
+    mark_inode_dirty(inode);
+    kfs_set_bit_atomic(KFS_FREE_BIT, &inode->state);
+}
+
+/* Drop n lookups of inode, it's evicted once it has no link either */
+void kfs_put_inode(struct kfs_inode *inode, u64 n)
+{
+    kfs_lock_inode(inode);
+    KFS_ASSERT(inode->nlookup >= n);
+    inode->nlookup -= n;
+    if (!inode->nlookup && !inode->node->nlink
+            && !kfs_test_bit_atomic(KFS_DEAD_BIT, &inode->state)) {
+        kfs_evict_inode(inode);
+    }
+    kfs_unlock_inode(inode);
+}
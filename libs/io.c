@@ -0,0 +1,765 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * I/O backends for the metadata.
+ * - The callers queue their reads and writes in a kfs_io_batch, and
+ *   the whole batch is handed to the backend at once, which returns
+ *   when all of them are done. Then end_io is called for each one.
+ * - psync does preadv/pwritev one by one, it's always there and it's
+ *   the default.
+ * - uring puts the batch in one io_uring submission, the image fd is
+ *   registered as a fixed file. Only built with KFS_HAVE_LIBURING, and
+ *   only used with io_engine=uring.
+ * - Short transfers are not errors, the rest of the io is done again
+ *   with preadv/pwritev until it's all there. Only a read at EOF stays
+ *   short.
+ * - With odirect the image is opened with O_DIRECT. What is not block
+ *   aligned is bounced through the kfs_dio buffers by kfs_pread() and
+ *   kfs_pwrite(), partial blocks are read, modified and written back.
+ * - With mmap_meta the image is mapped MAP_SHARED and the metadata is
+ *   used in place, KFS_IO_MSYNC io write it back with msync().
+ */
+#include <kfs.h>
+#include <sys/mman.h>
+#ifdef KFS_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+static int kfs_psync_init(struct kfs *fs)
+{
+    return 0;
+}
+
+static void kfs_psync_exit(struct kfs *fs)
+{
+}
+
+/* The buffers of io past its first done bytes, return their count */
+static int kfs_io_rest(struct kfs_io *io, size_t done, struct iovec *iov)
+{
+    int i, n = 0;
+
+    for (i = 0; i < io->iovcnt; i++) {
+        if (done >= io->iov[i].iov_len) {
+            done -= io->iov[i].iov_len;
+            continue;
+        }
+        iov[n].iov_base = (char *)io->iov[i].iov_base + done;
+        iov[n].iov_len = io->iov[i].iov_len - done;
+        done = 0;
+        n++;
+    }
+
+    return n;
+}
+
+/* Do io from io->ret on, until it's all done, it fails or a read hits EOF */
+static void kfs_psync_rw(struct kfs *fs, struct kfs_io *io)
+{
+    struct iovec iov[KFS_IO_MAX_VEC];
+    ssize_t ret;
+    int cnt;
+
+    while (io->ret < io->len) {
+        cnt = kfs_io_rest(io, io->ret, iov);
+        if (io->op == KFS_IO_READ) {
+            ret = preadv(fs->fd, iov, cnt, io->pos + io->ret);
+        } else {
+            ret = pwritev(fs->fd, iov, cnt, io->pos + io->ret);
+        }
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            io->ret = -errno;
+            return;
+        }
+        if (!ret) {
+            return;
+        }
+        io->ret += ret;
+    }
+}
+
+static int kfs_psync_submit(struct kfs *fs, struct kfs_io *ios, int nr)
+{
+    int i;
+
+    for (i = 0; i < nr; i++) {
+        ios[i].ret = 0;
+        kfs_psync_rw(fs, &ios[i]);
+    }
+
+    return 0;
+}
+
+struct kfs_io_ops kfs_psync_io_ops = {
+    .name   = "psync",
+    .init   = kfs_psync_init,
+    .exit   = kfs_psync_exit,
+    .submit = kfs_psync_submit,
+};
+
+#ifdef KFS_HAVE_LIBURING
+struct kfs_uring {
+    struct io_uring ring;
+    pthread_mutex_t lock;
+};
+
+static int kfs_uring_init(struct kfs *fs)
+{
+    struct kfs_uring *ur;
+    int ret;
+
+    ur = kfs_alloc(MEM_FS, sizeof(*ur));
+    if (!ur) {
+        kerr("Allocate io_uring context failed\n");
+        return -ENOMEM;
+    }
+
+    ret = io_uring_queue_init(KFS_IO_DEPTH, &ur->ring, 0);
+    if (ret < 0) {
+        kerr("Setup io_uring failed %s\n", strerror(-ret));
+        goto err;
+    }
+
+    ret = io_uring_register_files(&ur->ring, &fs->fd, 1);
+    if (ret < 0) {
+        kerr("Register image file failed %s\n", strerror(-ret));
+        io_uring_queue_exit(&ur->ring);
+        goto err;
+    }
+
+    pthread_mutex_init(&ur->lock, NULL);
+    fs->io_priv = ur;
+    return 0;
+
+  err:
+    kfs_free(MEM_FS, ur);
+    return ret;
+}
+
+static void kfs_uring_exit(struct kfs *fs)
+{
+    struct kfs_uring *ur = fs->io_priv;
+
+    io_uring_queue_exit(&ur->ring);
+    pthread_mutex_destroy(&ur->lock);
+    kfs_free(MEM_FS, ur);
+    fs->io_priv = NULL;
+}
+
+/* The ring is shared, one batch at a time goes through it */
+static int kfs_uring_submit(struct kfs *fs, struct kfs_io *ios, int nr)
+{
+    struct kfs_uring *ur = fs->io_priv;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct kfs_io *io;
+    int done = 0, n, i, ret = 0;
+
+    pthread_mutex_lock(&ur->lock);
+    while (done < nr) {
+        for (n = 0; (done + n) < nr; n++) {
+            sqe = io_uring_get_sqe(&ur->ring);
+            if (!sqe) {
+                break;
+            }
+            io = &ios[done + n];
+            if (io->op == KFS_IO_READ) {
+                io_uring_prep_readv(sqe, 0, io->iov, io->iovcnt, io->pos);
+            } else {
+                io_uring_prep_writev(sqe, 0, io->iov, io->iovcnt, io->pos);
+            }
+            sqe->flags |= IOSQE_FIXED_FILE;
+            io_uring_sqe_set_data(sqe, io);
+        }
+
+        ret = io_uring_submit_and_wait(&ur->ring, n);
+        if (ret < 0) {
+            kerr("Submit %d io failed %s\n", n, strerror(-ret));
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            ret = io_uring_wait_cqe(&ur->ring, &cqe);
+            if (ret < 0) {
+                kerr("Wait io completion failed %s\n", strerror(-ret));
+                goto out;
+            }
+            io = io_uring_cqe_get_data(cqe);
+            io->ret = cqe->res;
+            io_uring_cqe_seen(&ur->ring, cqe);
+            if (io->ret > 0) {
+                /* Short, the rest is not worth another round of the ring */
+                kfs_psync_rw(fs, io);
+            }
+        }
+        done += n;
+        ret = 0;
+    }
+
+  out:
+    pthread_mutex_unlock(&ur->lock);
+    return ret;
+}
+
+static struct kfs_io_ops kfs_uring_io_ops = {
+    .name   = "uring",
+    .init   = kfs_uring_init,
+    .exit   = kfs_uring_exit,
+    .submit = kfs_uring_submit,
+};
+#endif
+
+#define KFS_DIO_MASK    ((u64)KFS_BLOCK_SIZE - 1)
+
+static int kfs_dio_aligned(const void *buf, size_t len, u64 pos)
+{
+    return !(((unsigned long)buf | len | pos) & KFS_DIO_MASK);
+}
+
+void *kfs_get_iobuf(struct kfs *fs)
+{
+    struct kfs_dio *dio = &fs->dio;
+    void *buf = NULL;
+
+    pthread_mutex_lock(&dio->lock);
+    while (!dio->nr_free && (dio->nr_alloc == KFS_DIO_BUFS)) {
+        pthread_cond_wait(&dio->wait, &dio->lock);
+    }
+    if (dio->nr_free) {
+        buf = dio->bufs[--dio->nr_free];
+    } else {
+        buf = kfs_alloc_aligned(KFS_DIO_BUF_SIZE);
+        if (buf) {
+            dio->nr_alloc++;
+        }
+    }
+    pthread_mutex_unlock(&dio->lock);
+
+    return buf;
+}
+
+void kfs_put_iobuf(struct kfs *fs, void *buf)
+{
+    struct kfs_dio *dio = &fs->dio;
+
+    pthread_mutex_lock(&dio->lock);
+    dio->bufs[dio->nr_free++] = buf;
+    pthread_cond_signal(&dio->wait);
+    pthread_mutex_unlock(&dio->lock);
+}
+
+static void kfs_dio_lock(struct kfs *fs, u64 first, u64 last)
+{
+    u32 a = first % KFS_DIO_RMW_LOCKS, b = last % KFS_DIO_RMW_LOCKS;
+
+    if (a > b) {
+        u32 t = a; a = b; b = t;
+    }
+    pthread_mutex_lock(&fs->dio.rmw[a]);
+    if (b != a) {
+        pthread_mutex_lock(&fs->dio.rmw[b]);
+    }
+}
+
+static void kfs_dio_unlock(struct kfs *fs, u64 first, u64 last)
+{
+    u32 a = first % KFS_DIO_RMW_LOCKS, b = last % KFS_DIO_RMW_LOCKS;
+
+    if (b != a) {
+        pthread_mutex_unlock(&fs->dio.rmw[b]);
+    }
+    pthread_mutex_unlock(&fs->dio.rmw[a]);
+}
+
+/*
+ * Bounce [pos, pos+len) through a dio buffer, a chunk at a time. For a
+ * write the partial head and tail blocks are read first, under the rmw
+ * locks of the blocks so two partial writes don't lose each other.
+ */
+static ssize_t kfs_dio_rw(struct kfs *fs, u32 op, char *buf, size_t len, u64 pos)
+{
+    char *iobuf;
+    size_t done = 0, boff, clen, alen;
+    u64 start, first, last;
+    ssize_t ret = 0;
+
+    iobuf = kfs_get_iobuf(fs);
+    if (!iobuf) {
+        kerr("Allocate dio buffer failed\n");
+        return -ENOMEM;
+    }
+
+    while (done < len) {
+        start = (pos + done) & ~KFS_DIO_MASK;
+        boff = pos + done - start;
+        clen = KFS_DIO_BUF_SIZE - boff;
+        if (clen > (len - done)) {
+            clen = len - done;
+        }
+        alen = (boff + clen + KFS_DIO_MASK) & ~KFS_DIO_MASK;
+
+        if (op == KFS_IO_READ) {
+            ret = pread(fs->fd, iobuf, alen, start);
+            if (ret < (ssize_t)(boff + clen)) {
+                ret = (ret < 0) ? -errno : -EIO;
+                break;
+            }
+            memcpy(buf + done, iobuf + boff, clen);
+            done += clen;
+            continue;
+        }
+
+        first = start >> KFS_BLOCK_SHIFT;
+        last = (start + alen - 1) >> KFS_BLOCK_SHIFT;
+        kfs_dio_lock(fs, first, last);
+        ret = 0;
+        if (boff) {
+            ret = pread(fs->fd, iobuf, KFS_BLOCK_SIZE, start);
+        }
+        if ((ret >= 0) && ((boff + clen) & KFS_DIO_MASK)
+                && (!boff || (last != first))) {
+            ret = pread(fs->fd, iobuf + alen - KFS_BLOCK_SIZE, KFS_BLOCK_SIZE,
+                    start + alen - KFS_BLOCK_SIZE);
+        }
+        if (ret >= 0) {
+            memcpy(iobuf + boff, buf + done, clen);
+            ret = pwrite(fs->fd, iobuf, alen, start);
+        }
+        kfs_dio_unlock(fs, first, last);
+        if (ret != alen) {
+            ret = (ret < 0) ? -errno : -EIO;
+            break;
+        }
+        done += clen;
+    }
+
+    kfs_put_iobuf(fs, iobuf);
+    if (ret < 0) {
+        kerr("%s %zd bytes at %llu failed %s\n",
+                (op == KFS_IO_READ)?"Read":"Write", len, pos, strerror(-ret));
+    }
+    return done ? done : ret;
+}
+
+ssize_t kfs_pread(struct kfs *fs, void *buf, size_t len, u64 pos)
+{
+    if (!(fs->mntopt.flags & KFS_MNT_ODIRECT) || kfs_dio_aligned(buf, len, pos)) {
+        return pread(fs->fd, buf, len, pos);
+    }
+    return kfs_dio_rw(fs, KFS_IO_READ, buf, len, pos);
+}
+
+ssize_t kfs_pwrite(struct kfs *fs, const void *buf, size_t len, u64 pos)
+{
+    if (!(fs->mntopt.flags & KFS_MNT_ODIRECT) || kfs_dio_aligned(buf, len, pos)) {
+        return pwrite(fs->fd, buf, len, pos);
+    }
+    return kfs_dio_rw(fs, KFS_IO_WRITE, (char *)buf, len, pos);
+}
+
+static int kfs_io_aligned(struct kfs_io *io)
+{
+    int i;
+
+    if (io->pos & KFS_DIO_MASK) {
+        return 0;
+    }
+    for (i = 0; i < io->iovcnt; i++) {
+        if (!kfs_dio_aligned(io->iov[i].iov_base, io->iov[i].iov_len, 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* An odirect io the backend can't take, done piece by piece */
+static void kfs_io_bounce(struct kfs *fs, struct kfs_io *io)
+{
+    u64 pos = io->pos;
+    ssize_t ret;
+    int i;
+
+    io->ret = 0;
+    for (i = 0; i < io->iovcnt; i++) {
+        if (io->op == KFS_IO_READ) {
+            ret = kfs_pread(fs, io->iov[i].iov_base, io->iov[i].iov_len, pos);
+        } else {
+            ret = kfs_pwrite(fs, io->iov[i].iov_base, io->iov[i].iov_len, pos);
+        }
+        if (ret != io->iov[i].iov_len) {
+            io->ret = (ret < 0) ? ret : -EIO;
+            return;
+        }
+        io->ret += ret;
+        pos += ret;
+    }
+}
+
+/*
+ * Map the whole image for mmap_meta. KFS_MMAP_MAX of address space is
+ * reserved first, so kfs_map_grow() can always map the new tail right
+ * after the old one and the pointers into the map never move.
+ */
+int kfs_map_image(struct kfs *fs, u64 size)
+{
+    void *p;
+    int ret;
+
+    if (size > KFS_MMAP_MAX) {
+        kerr("Image size %llu is beyond the map limit %llu\n",
+                size, KFS_MMAP_MAX);
+        return -EFBIG;
+    }
+
+    p = mmap(NULL, KFS_MMAP_MAX, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        ret = -errno;
+        kerr("Reserve %llu bytes for the map failed %d\n", KFS_MMAP_MAX, ret);
+        return ret;
+    }
+    fs->map = p;
+    fs->map_size = 0;
+
+    ret = kfs_map_grow(fs, size);
+    if (ret) {
+        munmap(fs->map, KFS_MMAP_MAX);
+        fs->map = NULL;
+    }
+    return ret;
+}
+
+/* Map the image up to size, after kfs_extend_bg() made it bigger */
+int kfs_map_grow(struct kfs *fs, u64 size)
+{
+    u64 old = fs->map_size;
+    void *p;
+    int ret;
+
+    KFS_ASSERT(!(old & (KFS_BLOCK_SIZE - 1)));
+    if (size <= old) {
+        return 0;
+    }
+    if (size > KFS_MMAP_MAX) {
+        kerr("Grow the map to %llu is beyond the limit %llu\n",
+                size, KFS_MMAP_MAX);
+        return -EFBIG;
+    }
+
+    p = mmap(fs->map + old, size - old, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fs->fd, old);
+    if (p == MAP_FAILED) {
+        ret = -errno;
+        kerr("Map %llu bytes at %llu failed %d\n", size - old, old, ret);
+        return ret;
+    }
+    fs->map_size = size;
+    kdebug2(LOG_IO, "Mapped image up to %llu\n", size);
+
+    return 0;
+}
+
+void kfs_unmap_image(struct kfs *fs)
+{
+    if (!fs->map) {
+        return;
+    }
+    munmap(fs->map, KFS_MMAP_MAX);
+    fs->map = NULL;
+    fs->map_size = 0;
+}
+
+/* Write back the pages of a KFS_IO_MSYNC io */
+static void kfs_io_msync(struct kfs *fs, struct kfs_io *io)
+{
+    u64 start = io->pos & ~((u64)sysconf(_SC_PAGESIZE) - 1);
+    u64 end = io->pos + io->len;
+
+    KFS_ASSERT(end <= fs->map_size);
+    if (msync(fs->map + start, end - start, MS_ASYNC) < 0) {
+        io->ret = -errno;
+        return;
+    }
+    io->ret = io->len;
+}
+
+/* The engine for the io_engine mount option, psync if none is given */
+int kfs_io_engine(const char *name)
+{
+    if (!name || !strcmp(name, "psync")) {
+        return KFS_IO_PSYNC;
+    }
+    if (!strcmp(name, "uring")) {
+        return KFS_IO_URING;
+    }
+
+    kerr("Unknown io_engine %s\n", name);
+    return -EINVAL;
+}
+
+/* Pick the backend of mntopt.io_engine, psync if it can't be set up */
+int kfs_io_init(struct kfs *fs)
+{
+    int ret;
+
+    fs->io_ops = &kfs_psync_io_ops;
+#ifdef KFS_HAVE_LIBURING
+    if (fs->mntopt.io_engine == KFS_IO_URING) {
+        ret = kfs_uring_init(fs);
+        if (!ret) {
+            fs->io_ops = &kfs_uring_io_ops;
+            kinfo("Using io engine %s\n", fs->io_ops->name);
+            return 0;
+        }
+        kwarn("Fall back to io engine %s\n", fs->io_ops->name);
+    }
+#else
+    if (fs->mntopt.io_engine == KFS_IO_URING) {
+        kwarn("Built without liburing, fall back to io engine %s\n",
+                fs->io_ops->name);
+    }
+#endif
+
+    ret = fs->io_ops->init(fs);
+    return ret;
+}
+
+void kfs_io_exit(struct kfs *fs)
+{
+    struct kfs_dio *dio = &fs->dio;
+
+    fs->io_ops->exit(fs);
+    fs->io_ops = &kfs_psync_io_ops;
+
+    pthread_mutex_lock(&dio->lock);
+    KFS_ASSERT(dio->nr_free == dio->nr_alloc);
+    while (dio->nr_free) {
+        kfs_free(MEM_IO, dio->bufs[--dio->nr_free]);
+    }
+    dio->nr_alloc = 0;
+    pthread_mutex_unlock(&dio->lock);
+}
+
+/*
+ * A grown io array is kept by the thread when its batch is released,
+ * the next batch of the thread that grows takes it back. So a worker
+ * doing big requests doesn't allocate the array for each one.
+ */
+struct kfs_io_cache {
+    struct kfs_io *ios;
+    int max;
+};
+
+static pthread_key_t kfs_io_cache_key;
+static pthread_once_t kfs_io_cache_once = PTHREAD_ONCE_INIT;
+
+static void kfs_io_cache_free(void *data)
+{
+    struct kfs_io_cache *cache = data;
+
+    kfs_free(MEM_IO, cache->ios);
+    kfs_free(MEM_IO, cache);
+}
+
+static void kfs_io_cache_init(void)
+{
+    pthread_key_create(&kfs_io_cache_key, kfs_io_cache_free);
+}
+
+static struct kfs_io_cache *kfs_io_cache(void)
+{
+    struct kfs_io_cache *cache;
+
+    pthread_once(&kfs_io_cache_once, kfs_io_cache_init);
+    cache = pthread_getspecific(kfs_io_cache_key);
+    if (!cache) {
+        cache = kfs_alloc(MEM_IO, sizeof(*cache));
+        if (!cache) {
+            return NULL;
+        }
+        cache->ios = NULL;
+        cache->max = 0;
+        pthread_setspecific(kfs_io_cache_key, cache);
+    }
+
+    return cache;
+}
+
+/* An array of at least max io, from the thread cache if it's big enough */
+static struct kfs_io *kfs_io_array_get(int *max)
+{
+    struct kfs_io_cache *cache = kfs_io_cache();
+    struct kfs_io *ios;
+
+    if (cache && cache->ios && (cache->max >= *max)) {
+        ios = cache->ios;
+        *max = cache->max;
+        cache->ios = NULL;
+        cache->max = 0;
+        return ios;
+    }
+
+    return kfs_alloc(MEM_IO, sizeof(*ios) * (*max));
+}
+
+/* Keep the biggest array in the thread cache */
+static void kfs_io_array_put(struct kfs_io *ios, int max)
+{
+    struct kfs_io_cache *cache = kfs_io_cache();
+
+    if (!cache || (cache->max >= max)) {
+        kfs_free(MEM_IO, ios);
+        return;
+    }
+    kfs_free(MEM_IO, cache->ios);
+    cache->ios = ios;
+    cache->max = max;
+}
+
+void kfs_io_batch_init(struct kfs *fs, struct kfs_io_batch *batch)
+{
+    batch->fs = fs;
+    batch->ios = batch->inline_ios;
+    batch->nr = 0;
+    batch->max = KFS_IO_INLINE;
+}
+
+void kfs_io_batch_release(struct kfs_io_batch *batch)
+{
+    KFS_ASSERT(!batch->nr);
+    if (batch->ios != batch->inline_ios) {
+        kfs_io_array_put(batch->ios, batch->max);
+    }
+    batch->ios = batch->inline_ios;
+    batch->max = KFS_IO_INLINE;
+}
+
+/*
+ * Queue one io at pos, the buffers are added with kfs_io_add_vec().
+ * The io is only valid until the next kfs_io_batch_add().
+ */
+struct kfs_io *kfs_io_batch_add(struct kfs_io_batch *batch, u32 op, u64 pos,
+        void (*end_io)(struct kfs_io *io, int err), void *private)
+{
+    struct kfs_io *ios, *io;
+    int max;
+
+    if (batch->nr == batch->max) {
+        max = batch->max * 2;
+        ios = kfs_io_array_get(&max);
+        if (!ios) {
+            kerr("Grow io batch to %d failed\n", max);
+            return NULL;
+        }
+        memcpy(ios, batch->ios, sizeof(*ios) * batch->nr);
+        if (batch->ios != batch->inline_ios) {
+            kfs_io_array_put(batch->ios, batch->max);
+        }
+        batch->ios = ios;
+        batch->max = max;
+    }
+
+    io = &batch->ios[batch->nr++];
+    io->op = op;
+    io->pos = pos;
+    io->iovcnt = 0;
+    io->len = 0;
+    io->ret = 0;
+    io->end_io = end_io;
+    io->private = private;
+
+    return io;
+}
+
+void kfs_io_add_vec(struct kfs_io *io, void *buf, size_t len)
+{
+    KFS_ASSERT(io->iovcnt < KFS_IO_MAX_VEC);
+    io->iov[io->iovcnt].iov_base = buf;
+    io->iov[io->iovcnt].iov_len = len;
+    io->iovcnt++;
+    io->len += len;
+}
+
+/* Run all the queued io, return the first error */
+int kfs_io_batch_submit(struct kfs_io_batch *batch)
+{
+    struct kfs *fs = batch->fs;
+    struct kfs_io *io, tmp;
+    int ret, err = 0, i, nr;
+
+    if (!batch->nr) {
+        return 0;
+    }
+
+    nr = batch->nr;
+    if (fs->mntopt.flags & (KFS_MNT_ODIRECT | KFS_MNT_MMAP)) {
+        /* Move what the backend can't take to the end and do it here */
+        for (i = 0; i < nr; ) {
+            io = &batch->ios[i];
+            if ((io->op != KFS_IO_MSYNC) &&
+                    (!(fs->mntopt.flags & KFS_MNT_ODIRECT) || kfs_io_aligned(io))) {
+                i++;
+                continue;
+            }
+            nr--;
+            tmp = *io;
+            *io = batch->ios[nr];
+            batch->ios[nr] = tmp;
+            if (tmp.op == KFS_IO_MSYNC) {
+                kfs_io_msync(fs, &batch->ios[nr]);
+            } else {
+                kfs_io_bounce(fs, &batch->ios[nr]);
+            }
+        }
+    }
+
+    ret = nr ? fs->io_ops->submit(fs, batch->ios, nr) : 0;
+    kdebug2(LOG_IO, "Submitted %d of %d io by %s ret %d\n",
+            nr, batch->nr, fs->io_ops->name, ret);
+
+    for (i = 0; i < batch->nr; i++) {
+        io = &batch->ios[i];
+        if ((ret < 0) && (i < nr)) {
+            io->ret = ret;
+        }
+        if (io->ret != io->len) {
+            kerr("%s %zd bytes at %llu failed %zd\n",
+                    (io->op == KFS_IO_READ)?"Read":
+                    (io->op == KFS_IO_WRITE)?"Write":"Msync",
+                    io->len, io->pos, io->ret);
+            if (!err) {
+                err = -EIO;
+            }
+        }
+        if (io->end_io) {
+            io->end_io(io, (io->ret == io->len)?0:-EIO);
+        }
+    }
+    batch->nr = 0;
+
+    return err;
+}
+
+/* Drop the queued io without running it, each end_io sees err */
+void kfs_io_batch_cancel(struct kfs_io_batch *batch, int err)
+{
+    struct kfs_io *io;
+    int i;
+
+    for (i = 0; i < batch->nr; i++) {
+        io = &batch->ios[i];
+        io->ret = err;
+        if (io->end_io) {
+            io->end_io(io, err);
+        }
+    }
+    batch->nr = 0;
+}
@@ -0,0 +1,387 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * Metadata journal
+ * - kfs_sync_fs() logs everything it's going to write back as one
+ *   transaction: one sequential write and one fdatasync(). Only then
+ *   the metadata is written in place, nobody waits for it.
+ * - Checkpoints are lazy, when the journal is full and at umount: an
+ *   fdatasync() makes the in place writes durable, then the jsb moves
+ *   the tail and the journal is used again from block 1.
+ * - At mount the complete transactions from the tail on are replayed,
+ *   the time depends on the journal size and not on the image.
+ * - The journal is a run of data blocks, taken at the first mount.
+ *   There is none with mmap_meta, the metadata is changed in place in
+ *   the map and may reach the disk any time.
+ * - Data and indirect blocks are still written in place right away.
+ */
+
+#include <kfs.h>
+
+/*
+ * Enough to tell a torn transaction. crc32c as the rest of the metadata,
+ * FNV-1a on v2 images, whose journal mkfs -c replays.
+ */
+static u32 kfs_jcsum(struct kfs *fs, const void *buf, size_t len)
+{
+    const u8 *p = buf;
+    u32 h = 2166136261U;
+
+    if (fs->sb->version >= 3) {
+        return kfs_crc32c(0, buf, len);
+    }
+    while (len--) {
+        h = (h ^ *p++) * 16777619U;
+    }
+
+    return h;
+}
+
+static u64 kfs_jpos(struct kfs_journal *j, u32 block)
+{
+    return (j->bno + block) << KFS_BLOCK_SHIFT;
+}
+
+static int kfs_journal_write_jsb(struct kfs *fs)
+{
+    struct kfs_journal *j = &fs->journal;
+    struct kfs_jsb *jsb;
+    int ret = 0;
+
+    jsb = kfs_alloc_aligned(KFS_BLOCK_SIZE);
+    if (!jsb) {
+        kerr("Alloc jsb failed\n");
+        return -ENOMEM;
+    }
+    memset(jsb, 0, KFS_BLOCK_SIZE);
+    jsb->magic = KFS_JOURNAL_MAGIC;
+    jsb->blocks = j->blocks;
+    jsb->seq = j->tail_seq;
+    jsb->tail = j->tail;
+
+    if (kfs_pwrite(fs, jsb, KFS_BLOCK_SIZE, kfs_jpos(j, 0)) != KFS_BLOCK_SIZE) {
+        kerr("Write jsb failed %s\n", strerror(errno));
+        ret = -EIO;
+    }
+    kfs_free(MEM_IO, jsb);
+
+    return ret;
+}
+
+/*
+ * Make what was written in place durable and empty the journal. The
+ * caller holds sync_lock.
+ */
+int kfs_journal_checkpoint(struct kfs *fs)
+{
+    struct kfs_journal *j = &fs->journal;
+    int ret;
+
+    if (!j->bno || (j->head == 1)) {
+        return 0;
+    }
+
+    if (fdatasync(fs->fd) < 0) {
+        kerr("fdatasync failed: %s\n", strerror(errno));
+        return -errno;
+    }
+    kdebug(LOG_IO, "Checkpoint journal at %u seq %llu\n", j->head, j->seq);
+    j->tail = j->head = 1;
+    j->tail_seq = j->seq;
+    ret = kfs_journal_write_jsb(fs);
+    if (ret) {
+        return ret;
+    }
+    if (fdatasync(fs->fd) < 0) {
+        kerr("fdatasync failed: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
+/*
+ * Log the writes queued in batch as one transaction, and wait for it.
+ * Return 1 if it's bigger than the journal: the batch must be written
+ * in place and synced the old way.
+ */
+int kfs_journal_commit(struct kfs *fs, struct kfs_io_batch *batch)
+{
+    struct kfs_journal *j = &fs->journal;
+    struct kfs_jhdr *hdr;
+    struct kfs_jrec *rec;
+    struct kfs_io *io;
+    size_t hlen, plen = 0, len;
+    u32 blocks;
+    char *buf, *p;
+    int ret, i, k;
+
+    if (!j->bno) {
+        return 0;
+    }
+    if (!batch->nr) {
+        /* Nothing to log, still everything before must be durable */
+        if (fdatasync(fs->fd) < 0) {
+            kerr("fdatasync failed: %s\n", strerror(errno));
+            return -errno;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < batch->nr; i++) {
+        plen += batch->ios[i].len;
+    }
+    hlen = sizeof(*hdr) + (batch->nr * sizeof(*rec));
+    hlen = (hlen + KFS_BLOCK_MASK) & ~KFS_BLOCK_MASK;
+    len = hlen + ((plen + KFS_BLOCK_MASK) & ~KFS_BLOCK_MASK);
+    blocks = len >> KFS_BLOCK_SHIFT;
+
+    if (blocks >= j->blocks) {
+        if (!j->full) {
+            kwarn("Sync of %u blocks is bigger than the journal\n", blocks);
+            j->full = 1;
+        }
+        ret = kfs_journal_checkpoint(fs);
+        return ret ? ret : 1;
+    }
+    if ((j->head + blocks) > j->blocks) {
+        ret = kfs_journal_checkpoint(fs);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    buf = kfs_alloc_aligned(len);
+    if (!buf) {
+        kerr("Alloc journal buffer of %zu bytes failed\n", len);
+        return -ENOMEM;
+    }
+    memset(buf, 0, hlen);
+    hdr = (struct kfs_jhdr *)buf;
+    hdr->magic = KFS_JTRANS_MAGIC;
+    hdr->nr = batch->nr;
+    hdr->seq = j->seq;
+    hdr->blocks = blocks;
+    rec = (struct kfs_jrec *)(hdr + 1);
+    p = buf + hlen;
+    for (i = 0; i < batch->nr; i++) {
+        io = &batch->ios[i];
+        rec[i].pos = io->pos;
+        rec[i].len = io->len;
+        for (k = 0; k < io->iovcnt; k++) {
+            memcpy(p, io->iov[k].iov_base, io->iov[k].iov_len);
+            p += io->iov[k].iov_len;
+        }
+    }
+    memset(p, 0, buf + len - p);
+    hdr->csum = kfs_jcsum(fs, buf, len);
+
+    ret = kfs_pwrite(fs, buf, len, kfs_jpos(j, j->head));
+    kfs_free(MEM_IO, buf);
+    if (ret != len) {
+        kerr("Write journal at %u failed %s\n", j->head, strerror(errno));
+        return -EIO;
+    }
+    if (fdatasync(fs->fd) < 0) {
+        kerr("fdatasync failed: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    kdebug2(LOG_IO, "Journal seq %llu at %u: %d records %u blocks\n",
+            j->seq, j->head, batch->nr, blocks);
+    j->head += blocks;
+    j->seq++;
+
+    return 0;
+}
+
+/* Read the transaction at block with seq, NULL unless it's complete */
+static struct kfs_jhdr *kfs_journal_read(struct kfs *fs, u32 block, u64 seq)
+{
+    struct kfs_journal *j = &fs->journal;
+    struct kfs_jhdr *hdr;
+    struct kfs_jrec *rec;
+    size_t len, plen = 0;
+    u32 csum, i;
+
+    hdr = kfs_alloc_aligned(KFS_BLOCK_SIZE);
+    if (!hdr) {
+        return NULL;
+    }
+    if ((kfs_pread(fs, hdr, KFS_BLOCK_SIZE, kfs_jpos(j, block)) != KFS_BLOCK_SIZE)
+            || (hdr->magic != KFS_JTRANS_MAGIC) || (hdr->seq != seq)
+            || !hdr->blocks || ((block + hdr->blocks) > j->blocks)
+            || ((sizeof(*hdr) + ((u64)hdr->nr * sizeof(*rec)))
+                > ((u64)hdr->blocks << KFS_BLOCK_SHIFT))) {
+        goto bad;
+    }
+
+    len = (size_t)hdr->blocks << KFS_BLOCK_SHIFT;
+    if (len > KFS_BLOCK_SIZE) {
+        kfs_free(MEM_IO, hdr);
+        hdr = kfs_alloc_aligned(len);
+        if (!hdr || (kfs_pread(fs, hdr, len, kfs_jpos(j, block)) != len)) {
+            goto bad;
+        }
+    }
+
+    csum = hdr->csum;
+    hdr->csum = 0;
+    if (kfs_jcsum(fs, hdr, len) != csum) {
+        goto bad;
+    }
+    rec = (struct kfs_jrec *)(hdr + 1);
+    for (i = 0; i < hdr->nr; i++) {
+        plen += rec[i].len;
+    }
+    len -= (sizeof(*hdr) + (hdr->nr * sizeof(*rec)) + KFS_BLOCK_MASK) & ~KFS_BLOCK_MASK;
+    if (plen > len) {
+        goto bad;
+    }
+
+    return hdr;
+
+  bad:
+    kfs_free(MEM_IO, hdr);
+    return NULL;
+}
+
+/*
+ * Replay the journal of the image, before anything else of it is
+ * read. Return the number of transactions replayed, the sb has to be
+ * read again if there were any.
+ */
+int kfs_journal_replay(struct kfs *fs)
+{
+    struct kfs_journal *j = &fs->journal;
+    struct kfs_jsb *jsb;
+    struct kfs_jhdr *hdr;
+    struct kfs_jrec *rec;
+    char *p;
+    u32 block, i;
+    int ret = 0, n = 0;
+
+    if (!fs->sb->journal) {
+        return 0;
+    }
+
+    jsb = kfs_alloc_aligned(KFS_BLOCK_SIZE);
+    if (!jsb) {
+        return -ENOMEM;
+    }
+    if (kfs_pread(fs, jsb, KFS_BLOCK_SIZE, fs->sb->journal << KFS_BLOCK_SHIFT)
+            != KFS_BLOCK_SIZE) {
+        kerr("Read jsb failed %s\n", strerror(errno));
+        kfs_free(MEM_IO, jsb);
+        return -EIO;
+    }
+    if ((jsb->magic != KFS_JOURNAL_MAGIC) || (jsb->blocks != fs->sb->journal_blocks)
+            || !jsb->tail || (jsb->tail >= jsb->blocks)) {
+        kerr("Bad jsb at block %llu\n", fs->sb->journal);
+        kfs_free(MEM_IO, jsb);
+        return -EINVAL;
+    }
+    j->bno = fs->sb->journal;
+    j->blocks = jsb->blocks;
+    j->tail = block = jsb->tail;
+    j->tail_seq = j->seq = jsb->seq;
+    kfs_free(MEM_IO, jsb);
+
+    while ((hdr = kfs_journal_read(fs, block, j->seq))) {
+        rec = (struct kfs_jrec *)(hdr + 1);
+        p = (char *)hdr + ((sizeof(*hdr) + (hdr->nr * sizeof(*rec))
+                    + KFS_BLOCK_MASK) & ~KFS_BLOCK_MASK);
+        for (i = 0; i < hdr->nr; i++) {
+            if (kfs_pwrite(fs, p, rec[i].len, rec[i].pos) != rec[i].len) {
+                kerr("Replay %u bytes at %llu failed %s\n", rec[i].len,
+                        rec[i].pos, strerror(errno));
+                ret = -EIO;
+                break;
+            }
+            p += rec[i].len;
+        }
+        block += hdr->blocks;
+        kfs_free(MEM_IO, hdr);
+        if (ret) {
+            return ret;
+        }
+        j->seq++;
+        n++;
+    }
+    j->head = block;
+
+    if (n) {
+        kinfo("Replayed %d journal transactions\n", n);
+    }
+    /* Nothing to keep in there now */
+    ret = kfs_journal_checkpoint(fs);
+
+    return ret ? ret : n;
+}
+
+/*
+ * Start logging once the image is up, creating the journal if the
+ * image has none yet.
+ */
+int kfs_journal_load(struct kfs *fs)
+{
+    struct kfs_journal *j = &fs->journal;
+    u64 bno;
+    u32 got, i;
+    int ret;
+
+    if (fs->mntopt.flags & KFS_MNT_MMAP) {
+        kinfo("No metadata journal with mmap_meta\n");
+        j->bno = 0;
+        return 0;
+    }
+    if (j->bno) {
+        return 0;
+    }
+
+    ret = kfs_alloc_blocks(fs, KFS_JOURNAL_BLOCKS, &bno, &got);
+    if (ret) {
+        return ret;
+    }
+    if (got < KFS_JOURNAL_BLOCKS) {
+        kwarn("No room for a journal of %u blocks\n", KFS_JOURNAL_BLOCKS);
+        for (i = 0; i < got; i++) {
+            kfs_free_block(fs, bno + i);
+        }
+        return 0;
+    }
+
+    /* The new jsb and sb go in place, the journal is not on yet */
+    j->bno = bno;
+    j->blocks = KFS_JOURNAL_BLOCKS;
+    j->tail = j->head = 1;
+    j->tail_seq = j->seq = 1;
+    ret = kfs_journal_write_jsb(fs);
+    j->bno = 0;
+    if (ret) {
+        return ret;
+    }
+    pthread_rwlock_wrlock(&fs->sb_lock);
+    fs->sb->journal = bno;
+    fs->sb->journal_blocks = KFS_JOURNAL_BLOCKS;
+    pthread_rwlock_unlock(&fs->sb_lock);
+    mark_fs_dirty(fs);
+
+    ret = kfs_sync_fs(fs);
+    if (!ret && (fdatasync(fs->fd) < 0)) {
+        ret = -errno;
+    }
+    if (ret) {
+        kerr("Write the new journal failed %d\n", ret);
+        return ret;
+    }
+    j->bno = bno;
+    kinfo("Created a journal of %u blocks at %llu\n", j->blocks, bno);
+
+    return 0;
+}
@@ -10,43 +10,469 @@
  * What I plan to do for the lock lib:
  * - lock_for_extent_fs
  * - lock_bg
+ * - lock_bgs, lock free for the readers
+ * - the contention profile with KFS_LOCK_STAT
  */
 #include <kfs.h>
+#ifdef KFS_LOCK_STAT
+#include <semaphore.h>
+#include <signal.h>
+#endif
+
+#ifdef KFS_LOCK_STAT
+/*
+ * Contention profile of the lock classes, KFS_LOCK_*. Every lock taken
+ * through kfs_mutex_lock() and co is counted, contended if a trylock
+ * failed first, with how long it waited then and how long it was held.
+ * The times go to log2 histograms of ns. Threads add to a shard of
+ * their own, like the fs counts, the report sums them.
+ * kill -USR1 the daemon logs the report, -USR2 zeroes the counts first,
+ * so the next report covers only what came after.
+ */
+struct kfs_lock_stat {
+    u64 acquired;
+    u64 contended;
+    u64 wait_ns;            /* Of the contended ones */
+    u64 hold_ns;
+    u64 max_wait;
+    u64 max_hold;
+    u64 wait[KFS_LOCK_BUCKETS];
+    u64 hold[KFS_LOCK_BUCKETS];
+};
+
+struct kfs_lock_shard {
+    struct kfs_lock_stat stat[KFS_LOCK_CLASSES];
+} __attribute__((aligned(KFS_CACHELINE)));
+
+/* A lock this thread holds, for its hold time */
+struct kfs_lock_held {
+    void *lock;
+    u32 class;
+    u64 since;
+};
+
+static const char *kfs_lock_names[KFS_LOCK_CLASSES] = {
+    [KFS_LOCK_EXTEND] = "extend",
+    [KFS_LOCK_IBGS] = "ibgs",
+    [KFS_LOCK_DBGS] = "dbgs",
+    [KFS_LOCK_BG] = "bg",
+    [KFS_LOCK_IHASH] = "ihash",
+    [KFS_LOCK_INODE] = "inode",
+    [KFS_LOCK_DENTRY] = "dentry",
+};
+
+static struct kfs_lock_shard kfs_lock_shards[KFS_LOCK_SHARDS];
+static __thread int kfs_lock_shard = -1;
+static int kfs_lock_next;
+static __thread struct kfs_lock_held kfs_lock_held[KFS_LOCK_HELD];
+static __thread int kfs_lock_nheld;
+static sem_t kfs_lockstat_sem;
+static int kfs_lockstat_zero;
+
+static inline u64 kfs_lockstat_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static inline struct kfs_lock_stat *kfs_lockstat_my(u32 class)
+{
+    if (kfs_lock_shard < 0) {
+        kfs_lock_shard = __atomic_fetch_add(&kfs_lock_next, 1, __ATOMIC_RELAXED)
+            & (KFS_LOCK_SHARDS - 1);
+    }
+    return &kfs_lock_shards[kfs_lock_shard].stat[class];
+}
+
+/* Bucket b has the times below 2^b ns */
+static inline u32 kfs_lockstat_bucket(u64 ns)
+{
+    u32 b = ns ? (64 - __builtin_clzll(ns)) : 0;
+
+    return (b < KFS_LOCK_BUCKETS) ? b : (KFS_LOCK_BUCKETS - 1);
+}
+
+static inline void kfs_lockstat_max(u64 *max, u64 ns)
+{
+    u64 old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    while ((ns > old) && !__atomic_compare_exchange_n(max, &old, ns, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* lock of class was taken, asked for at start */
+static void kfs_lockstat_locked(void *lock, u32 class, u64 start, int contended)
+{
+    struct kfs_lock_stat *stat = kfs_lockstat_my(class);
+    u64 now = kfs_lockstat_now();
+    struct kfs_lock_held *held;
+
+    __atomic_add_fetch(&stat->acquired, 1, __ATOMIC_RELAXED);
+    if (contended) {
+        __atomic_add_fetch(&stat->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stat->wait_ns, now - start, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stat->wait[kfs_lockstat_bucket(now - start)], 1,
+                __ATOMIC_RELAXED);
+        kfs_lockstat_max(&stat->max_wait, now - start);
+    }
+
+    /* Deeper than that isn't timed */
+    if (kfs_lock_nheld < KFS_LOCK_HELD) {
+        held = &kfs_lock_held[kfs_lock_nheld++];
+        held->lock = lock;
+        held->class = class;
+        held->since = now;
+    }
+}
+
+static void kfs_lockstat_unlocked(void *lock)
+{
+    struct kfs_lock_stat *stat;
+    struct kfs_lock_held *held;
+    u64 hold;
+    int i;
+
+    for (i = kfs_lock_nheld - 1; i >= 0; i--) {
+        if (kfs_lock_held[i].lock == lock) {
+            break;
+        }
+    }
+    if (i < 0) {
+        return;
+    }
+
+    held = &kfs_lock_held[i];
+    hold = kfs_lockstat_now() - held->since;
+    stat = kfs_lockstat_my(held->class);
+    __atomic_add_fetch(&stat->hold_ns, hold, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stat->hold[kfs_lockstat_bucket(hold)], 1, __ATOMIC_RELAXED);
+    kfs_lockstat_max(&stat->max_hold, hold);
+
+    /* Not always the last one taken */
+    memmove(held, held + 1, (--kfs_lock_nheld - i) * sizeof(*held));
+}
+
+void kfs_mutex_lock(pthread_mutex_t *lock, u32 class)
+{
+    u64 start = kfs_lockstat_now();
+    int contended = 0;
+
+    if (pthread_mutex_trylock(lock)) {
+        contended = 1;
+        pthread_mutex_lock(lock);
+    }
+    kfs_lockstat_locked(lock, class, start, contended);
+}
+
+void kfs_mutex_unlock(pthread_mutex_t *lock, u32 class)
+{
+    kfs_lockstat_unlocked(lock);
+    pthread_mutex_unlock(lock);
+}
+
+void kfs_rwlock_rdlock(pthread_rwlock_t *lock, u32 class)
+{
+    u64 start = kfs_lockstat_now();
+    int contended = 0;
+
+    if (pthread_rwlock_tryrdlock(lock)) {
+        contended = 1;
+        pthread_rwlock_rdlock(lock);
+    }
+    kfs_lockstat_locked(lock, class, start, contended);
+}
+
+void kfs_rwlock_wrlock(pthread_rwlock_t *lock, u32 class)
+{
+    u64 start = kfs_lockstat_now();
+    int contended = 0;
+
+    if (pthread_rwlock_trywrlock(lock)) {
+        contended = 1;
+        pthread_rwlock_wrlock(lock);
+    }
+    kfs_lockstat_locked(lock, class, start, contended);
+}
+
+void kfs_rwlock_unlock(pthread_rwlock_t *lock, u32 class)
+{
+    kfs_lockstat_unlocked(lock);
+    pthread_rwlock_unlock(lock);
+}
+
+/* The non empty buckets of hist, "<2^b ns:count" each */
+static void kfs_lockstat_hist(char *buf, size_t size, const u64 *hist)
+{
+    int i, len = 0;
+
+    buf[0] = '\0';
+    for (i = 0; (i < KFS_LOCK_BUCKETS) && (len < size); i++) {
+        if (hist[i]) {
+            len += snprintf(buf + len, size - len, " <%llu:%llu",
+                    1ULL << i, hist[i]);
+        }
+    }
+}
+
+void kfs_lockstat_report(void)
+{
+    struct kfs_lock_stat sum, *stat;
+    char hist[512];
+    int c, s, b;
+
+    kinfo("%-8s %12s %12s %10s %10s %10s %10s\n", "lock", "acquired",
+            "contended", "wait(ms)", "maxw(us)", "hold(ms)", "maxh(us)");
+    for (c = 0; c < KFS_LOCK_CLASSES; c++) {
+        memset(&sum, 0, sizeof(sum));
+        for (s = 0; s < KFS_LOCK_SHARDS; s++) {
+            stat = &kfs_lock_shards[s].stat[c];
+            sum.acquired += __atomic_load_n(&stat->acquired, __ATOMIC_RELAXED);
+            sum.contended += __atomic_load_n(&stat->contended, __ATOMIC_RELAXED);
+            sum.wait_ns += __atomic_load_n(&stat->wait_ns, __ATOMIC_RELAXED);
+            sum.hold_ns += __atomic_load_n(&stat->hold_ns, __ATOMIC_RELAXED);
+            if (stat->max_wait > sum.max_wait) {
+                sum.max_wait = stat->max_wait;
+            }
+            if (stat->max_hold > sum.max_hold) {
+                sum.max_hold = stat->max_hold;
+            }
+            for (b = 0; b < KFS_LOCK_BUCKETS; b++) {
+                sum.wait[b] += __atomic_load_n(&stat->wait[b], __ATOMIC_RELAXED);
+                sum.hold[b] += __atomic_load_n(&stat->hold[b], __ATOMIC_RELAXED);
+            }
+        }
+        if (!sum.acquired) {
+            continue;
+        }
+
+        kinfo("%-8s %12llu %12llu %10.3f %10.1f %10.3f %10.1f\n",
+                kfs_lock_names[c], sum.acquired, sum.contended,
+                sum.wait_ns / 1000000.0, sum.max_wait / 1000.0,
+                sum.hold_ns / 1000000.0, sum.max_hold / 1000.0);
+        if (sum.contended) {
+            kfs_lockstat_hist(hist, sizeof(hist), sum.wait);
+            kinfo("%-8s wait ns%s\n", kfs_lock_names[c], hist);
+        }
+        kfs_lockstat_hist(hist, sizeof(hist), sum.hold);
+        kinfo("%-8s hold ns%s\n", kfs_lock_names[c], hist);
+    }
+}
+
+/* Not atomic with the threads adding meanwhile, a few may be lost */
+void kfs_lockstat_reset(void)
+{
+    memset(kfs_lock_shards, 0, sizeof(kfs_lock_shards));
+}
+
+/* sem_post() is all a handler may do */
+static void kfs_lockstat_signal(int sig)
+{
+    if (sig == SIGUSR2) {
+        __atomic_store_n(&kfs_lockstat_zero, 1, __ATOMIC_RELAXED);
+    }
+    sem_post(&kfs_lockstat_sem);
+}
+
+static void *kfs_lockstat_reporter(void *data)
+{
+    for (;;) {
+        if (sem_wait(&kfs_lockstat_sem)) {
+            continue;
+        }
+        kfs_lockstat_report();
+        if (__atomic_exchange_n(&kfs_lockstat_zero, 0, __ATOMIC_RELAXED)) {
+            kfs_lockstat_reset();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Log the report on SIGUSR1, and zero the counts after it on SIGUSR2.
+ * Threads can't be created before the daemonize, call it after.
+ */
+int kfs_lockstat_start(void)
+{
+    struct sigaction sa;
+    pthread_t reporter;
+    int ret;
+
+    sem_init(&kfs_lockstat_sem, 0, 0);
+    ret = pthread_create(&reporter, NULL, kfs_lockstat_reporter, NULL);
+    if (ret) {
+        kerr("Create lock stat reporter failed: %s\n", strerror(ret));
+        return -ret;
+    }
+    pthread_detach(reporter);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = kfs_lockstat_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, NULL) || sigaction(SIGUSR2, &sa, NULL)) {
+        kerr("Set lock stat signals failed: %s\n", strerror(errno));
+        return -errno;
+    }
+    kinfo("Lock stats on, kill -USR1 %d to log them\n", getpid());
+
+    return 0;
+}
+#endif /* KFS_LOCK_STAT */
 
 void lock_for_extend_fs(struct kfs *fs)
 {
-    pthread_mutex_lock(&fs->extend_lock);
+    kfs_mutex_lock(&fs->extend_lock, KFS_LOCK_EXTEND);
 }
 
 void unlock_for_extend_fs(struct kfs *fs)
 {
-    pthread_mutex_unlock(&fs->extend_lock);
+    kfs_mutex_unlock(&fs->extend_lock, KFS_LOCK_EXTEND);
+}
+
+/*
+ * The bg lists are walked without a shared write. bgs are only added,
+ * at the tail by publish_bg() under extend_lock, and a walker sees a
+ * new one all set up or not at all. A thread takes one of the
+ * KFS_BG_READERS indexes for its life, its kfs_reader in every fs, where
+ * lock_bgs() puts the epoch of the fs and unlock_bgs() 0.
+ * kfs_synchronize_bgs() moves the epoch on and waits for the readers
+ * still in an older one: what was taken off the lists before it may be
+ * freed after it.
+ * Once all indexes are taken, the next threads take the extend rwlocks
+ * for reading as before, publish_bg() takes them for writing.
+ */
+static u64 kfs_readers_map;             /* Indexes taken, KFS_BG_READERS bits */
+static __thread int kfs_reader_index = -2;      /* -2 none yet, -1 no room */
+static pthread_key_t kfs_reader_key;
+static pthread_once_t kfs_reader_once = PTHREAD_ONCE_INIT;
+
+/* The thread is gone, so is its walk */
+static void kfs_put_reader(void *data)
+{
+    kfs_clear_bit_atomic((u32)(unsigned long)data - 1, &kfs_readers_map);
+}
+
+static void kfs_reader_key_init(void)
+{
+    pthread_key_create(&kfs_reader_key, kfs_put_reader);
+}
+
+/* The reader of this thread in fs, NULL if there was no index left */
+static struct kfs_reader *kfs_get_reader(struct kfs *fs)
+{
+    int index = kfs_reader_index;
+
+    if (index == -2) {
+        pthread_once(&kfs_reader_once, kfs_reader_key_init);
+        index = kfs_find_and_set_bit_atomic(&kfs_readers_map, KFS_BG_READERS, 0);
+        if (index < 0) {
+            kdebug(LOG_THREADS, "No bg reader left, the lists are locked\n");
+        } else {
+            /* Not NULL, or there is no destructor */
+            pthread_setspecific(kfs_reader_key, (void *)(unsigned long)(index + 1));
+        }
+        kfs_reader_index = index;
+    }
+
+    return (index < 0) ? NULL : &fs->readers[index];
 }
 
 void lock_bgs(struct kfs *fs, u32 type)
 {
-    if (type == KFS_BG_INODE) {
-        pthread_rwlock_rdlock(&fs->extend_ibg_lock);
-    } else {
-        pthread_rwlock_rdlock(&fs->extend_dbg_lock);
+    struct kfs_reader *reader = kfs_get_reader(fs);
+
+    if (!reader) {
+        if (type == KFS_BG_INODE) {
+            kfs_rwlock_rdlock(&fs->extend_ibg_lock, KFS_LOCK_IBGS);
+        } else {
+            kfs_rwlock_rdlock(&fs->extend_dbg_lock, KFS_LOCK_DBGS);
+        }
+        return;
+    }
+
+    if (!reader->nest++) {
+        __atomic_store_n(&reader->epoch,
+                __atomic_load_n(&fs->epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        /* Seen by kfs_synchronize_bgs() before we look at the lists */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#ifdef KFS_LOCK_STAT
+        /* Never waits, the hold is the walk */
+        kfs_lockstat_locked(reader, (type == KFS_BG_INODE) ?
+                KFS_LOCK_IBGS : KFS_LOCK_DBGS, 0, 0);
+#endif
     }
 }
 
 void unlock_bgs(struct kfs *fs, u32 type)
 {
-    if (type == KFS_BG_INODE) {
-        pthread_rwlock_unlock(&fs->extend_ibg_lock);
+    struct kfs_reader *reader = kfs_get_reader(fs);
+
+    if (!reader) {
+        if (type == KFS_BG_INODE) {
+            kfs_rwlock_unlock(&fs->extend_ibg_lock, KFS_LOCK_IBGS);
+        } else {
+            kfs_rwlock_unlock(&fs->extend_dbg_lock, KFS_LOCK_DBGS);
+        }
+        return;
+    }
+
+    if (!--reader->nest) {
+#ifdef KFS_LOCK_STAT
+        kfs_lockstat_unlocked(reader);
+#endif
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Add a new bg to its list and its slot, the caller holds extend_lock.
+ * The slots are taken in order, nslots says the slot is set.
+ */
+void publish_bg(struct kfs *fs, struct kfs_bg *bg)
+{
+    fs->slots[bg->slot] = bg;
+    __atomic_store_n(&fs->nslots, bg->slot + 1, __ATOMIC_RELEASE);
+
+    if (bg->bgd.type == KFS_BG_INODE) {
+        kfs_rwlock_wrlock(&fs->extend_ibg_lock, KFS_LOCK_IBGS);
+        list_add_tail_rcu(&bg->link, &fs->ibgs);
+        kfs_rwlock_unlock(&fs->extend_ibg_lock, KFS_LOCK_IBGS);
     } else {
-        pthread_rwlock_unlock(&fs->extend_dbg_lock);
+        kfs_rwlock_wrlock(&fs->extend_dbg_lock, KFS_LOCK_DBGS);
+        list_add_tail_rcu(&bg->link, &fs->dbgs);
+        kfs_rwlock_unlock(&fs->extend_dbg_lock, KFS_LOCK_DBGS);
     }
 }
 
+/* Wait for the walks of the bg lists started before to end */
+void kfs_synchronize_bgs(struct kfs *fs)
+{
+    u64 epoch = __atomic_add_fetch(&fs->epoch, 1, __ATOMIC_SEQ_CST);
+    u64 in;
+    int i;
+
+    for (i = 0; i < KFS_BG_READERS; i++) {
+        while ((in = __atomic_load_n(&fs->readers[i].epoch, __ATOMIC_ACQUIRE))
+                && (in < epoch)) {
+            sched_yield();
+        }
+    }
+
+    /* And for the readers without a kfs_reader */
+    kfs_rwlock_wrlock(&fs->extend_ibg_lock, KFS_LOCK_IBGS);
+    kfs_rwlock_unlock(&fs->extend_ibg_lock, KFS_LOCK_IBGS);
+    kfs_rwlock_wrlock(&fs->extend_dbg_lock, KFS_LOCK_DBGS);
+    kfs_rwlock_unlock(&fs->extend_dbg_lock, KFS_LOCK_DBGS);
+}
+
 void lock_bg(struct kfs_bg *bg)
 {
-    pthread_mutex_lock(&bg->lock);
+    kfs_mutex_lock(&bg->lock, KFS_LOCK_BG);
 }
 
 void unlock_bg(struct kfs_bg *bg)
 {
-    pthread_mutex_unlock(&bg->lock);
+    kfs_mutex_unlock(&bg->lock, KFS_LOCK_BG);
 }
@@ -0,0 +1,148 @@
+/* vim: set expandtab ts=4 sw=4:                               */
+
+/*-===========================================================-*/
+/*  Author:                                                    */
+/*        KevinKW                                              */
+/*-===========================================================-*/
+
+/*
+ * Parallel scan of the bgs, for mount after an unclean umount and kfsck
+ * - kfs_scan_bgs() runs fn on every bg, in table order, on a pool of
+ *   threads. The table is cut in chunks of KFS_SCAN_CHUNK bgs, whole
+ *   flexes with flex_bgs, which the threads take in turn.
+ * - The bitmaps of a chunk are read in one batch before fn sees any of
+ *   its bgs, so with io_uring a chunk is one deep queue.
+ * - fn is called without the bg locked. What it finds goes to the bg
+ *   or priv, the caller merges it once all are done.
+ */
+#include <kfs.h>
+
+struct kfs_scan {
+    struct kfs *fs;
+    struct kfs_bg **bgs;    /* By slot */
+    u64 nr;
+    u64 next;               /* First bg not taken yet */
+    u32 chunk;
+    pthread_mutex_t lock;
+    int (*fn)(struct kfs_bg *bg, void *priv);
+    void *priv;
+    int err;                /* The first one, the others stop */
+};
+
+static void *kfs_scan_thread(void *arg)
+{
+    struct kfs_scan *scan = arg;
+    u64 start, end, i;
+    int ret;
+
+    for (;;) {
+        pthread_mutex_lock(&scan->lock);
+        start = scan->next;
+        scan->next += scan->chunk;
+        ret = scan->err;
+        pthread_mutex_unlock(&scan->lock);
+        if (ret || (start >= scan->nr)) {
+            break;
+        }
+
+        end = start + scan->chunk;
+        if (end > scan->nr) {
+            end = scan->nr;
+        }
+        ret = kfs_load_bitmaps(scan->fs, &scan->bgs[start], end - start);
+        for (i = start; !ret && (i < end); i++) {
+            ret = scan->fn(scan->bgs[i], scan->priv);
+        }
+        if (ret) {
+            pthread_mutex_lock(&scan->lock);
+            if (!scan->err) {
+                scan->err = ret;
+            }
+            pthread_mutex_unlock(&scan->lock);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Run fn on all the bgs with threads threads, as many as there are
+ * CPUs up to KFS_SCAN_THREADS if 0. No bg is added meanwhile. Return
+ * the first error of fn.
+ */
+int kfs_scan_bgs(struct kfs *fs, u32 threads,
+        int (*fn)(struct kfs_bg *bg, void *priv), void *priv)
+{
+    struct kfs_scan scan;
+    struct kfs_bg *bg;
+    pthread_t *tids;
+    u32 i, started;
+    long cpus;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.fs = fs;
+    scan.nr = fs->sb->ibg_num + fs->sb->dbg_num;
+    scan.fn = fn;
+    scan.priv = priv;
+    pthread_mutex_init(&scan.lock, NULL);
+    if (!scan.nr) {
+        return 0;
+    }
+
+    /* A flex is read by one thread, in one go */
+    scan.chunk = KFS_SCAN_CHUNK;
+    if (fs->sb->flex_bgs) {
+        scan.chunk = ((scan.chunk + fs->sb->flex_bgs - 1) / fs->sb->flex_bgs)
+            * fs->sb->flex_bgs;
+    }
+
+    if (!threads) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? cpus : 1;
+    }
+    if (threads > KFS_SCAN_THREADS) {
+        threads = KFS_SCAN_THREADS;
+    }
+    if (threads > ((scan.nr + scan.chunk - 1) / scan.chunk)) {
+        threads = (scan.nr + scan.chunk - 1) / scan.chunk;
+    }
+
+    scan.bgs = kfs_alloc(MEM_FS, sizeof(*scan.bgs) * scan.nr);
+    tids = kfs_alloc(MEM_FS, sizeof(*tids) * threads);
+    if (!scan.bgs || !tids) {
+        kerr("Alloc scan of %llu bgs failed\n", scan.nr);
+        scan.err = -ENOMEM;
+        goto out;
+    }
+    list_for_each_entry(bg, &fs->ibgs, link) {
+        scan.bgs[bg->slot] = bg;
+    }
+    list_for_each_entry(bg, &fs->dbgs, link) {
+        scan.bgs[bg->slot] = bg;
+    }
+
+    /* The caller's thread is one of them */
+    for (started = 0; started < (threads - 1); started++) {
+        if (pthread_create(&tids[started], NULL, kfs_scan_thread, &scan)) {
+            kwarn("Start scan thread %u failed\n", started);
+            break;
+        }
+    }
+    kfs_scan_thread(&scan);
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    kdebug(LOG_VFS, "Scanned %llu bgs with %u threads, err %d\n",
+            scan.nr, started + 1, scan.err);
+
+  out:
+    if (tids) {
+        kfs_free(MEM_FS, tids);
+    }
+    if (scan.bgs) {
+        kfs_free(MEM_FS, scan.bgs);
+    }
+    pthread_mutex_destroy(&scan.lock);
+    return scan.err;
+}
@@ -18,70 +18,182 @@
 
 void kfs_init(struct kfs *fs)
 {
+    int i;
+
     memset(fs, 0, sizeof(*fs));
+    fs->sb = &fs->sb_buf;
     INIT_LIST_HEAD(&fs->ibgs);
     INIT_LIST_HEAD(&fs->dbgs);
+    INIT_LIST_HEAD(&fs->flexes);
     pthread_rwlock_init(&fs->extend_ibg_lock, NULL);
     pthread_rwlock_init(&fs->extend_dbg_lock, NULL);
     pthread_rwlock_init(&fs->sb_lock, NULL);
     pthread_mutex_init(&fs->extend_lock, NULL);
     pthread_mutex_init(&fs->lock, NULL);
+    pthread_mutex_init(&fs->flush_lock, NULL);
+    pthread_cond_init(&fs->flush_cond, NULL);
+    pthread_cond_init(&fs->dirty_cond, NULL);
+    pthread_mutex_init(&fs->data_lock, NULL);
+    INIT_LIST_HEAD(&fs->data_inodes);
+    pthread_mutex_init(&fs->sync_lock, NULL);
+    pthread_mutex_init(&fs->commit_lock, NULL);
+    pthread_cond_init(&fs->commit_cond, NULL);
+    fs->epoch = 1;
+    fs->mntopt.update_daley = DEFAULT_UPDATE_DELAY;
+    fs->mntopt.dirty_thresh = DEFAULT_DIRTY_THRESH;
+    fs->mntopt.dirty_limit = DEFAULT_DIRTY_LIMIT;
+    fs->mntopt.inode_dirty_limit = DEFAULT_INODE_DIRTY_LIMIT;
+    fs->mntopt.io_engine = KFS_IO_PSYNC;
+    fs->io_ops = &kfs_psync_io_ops;
+    pthread_mutex_init(&fs->dio.lock, NULL);
+    pthread_cond_init(&fs->dio.wait, NULL);
+    for (i = 0; i < KFS_DIO_RMW_LOCKS; i++) {
+        pthread_mutex_init(&fs->dio.rmw[i], NULL);
+    }
 }
 
-void mark_fs_ok(struct kfs *fs, int locked)
+void mark_fs_ok(struct kfs *fs)
 {
-    kfs_set_bit(KFS_OK_BIT, &fs->state, locked?NULL:&fs->lock);
+    kfs_set_bit_atomic(KFS_OK_BIT, &fs->state);
 }
 
-void mark_fs_err(struct kfs *fs, int locked)
+void mark_fs_err(struct kfs *fs)
 {
-    kfs_clear_bit(KFS_OK_BIT, &fs->state, locked?NULL:&fs->lock);
+    kfs_clear_bit_atomic(KFS_OK_BIT, &fs->state);
 }
 
-void mark_fs_dirty(struct kfs *fs, int locked)
+void mark_fs_dirty(struct kfs *fs)
 {
-    kfs_set_bit(KFS_DIRTY_BIT, &fs->state, locked?NULL:&fs->lock);
-    /* Do issue sb update async */
+    if (!kfs_test_and_set_bit_atomic(KFS_DIRTY_BIT, &fs->state)) {
+        /* The flusher will pick it up */
+        kfs_inc_dirty(fs, sizeof(*fs->sb));
+    }
 }
 
-int kfs_sync_sb(struct kfs *fs)
+static void kfs_sync_sb_end(struct kfs_io *io, int err)
 {
-    int ret = 0;
+    struct kfs *fs = io->private;
 
-    if (kfs_test_bit(KFS_DIRTY_BIT, &fs->state, &fs->lock)) {
-        ret = pwrite(fs->fd, &fs->sb, sizeof(fs->sb), 0);
-        if (ret != sizeof(fs->sb)) {
-            kerr("Sync superblock failed %s\n",
-                    strerror(errno));
-            ret = -EIO;
-        } else {
-            fs->synctime = time(NULL);
-            kdebug(LOG_IO, "Sync sb time %ld\n", fs->synctime);
-            ret = 0;
+    if (io->op != KFS_IO_MSYNC) {
+        kfs_free(MEM_IO, io->iov[0].iov_base);
+    }
+    if (err) {
+        /* Still dirty, don't count it twice if it was dirtied again */
+        if (kfs_test_and_set_bit_atomic(KFS_DIRTY_BIT, &fs->state)) {
+            kfs_dec_dirty(fs, sizeof(*fs->sb));
         }
+        return;
     }
+    fs->synctime = time(NULL);
+    kdebug(LOG_IO, "Sync sb time %ld\n", fs->synctime);
+    kfs_dec_dirty(fs, sizeof(*fs->sb));
+}
 
-    return ret;
+/* Queue a copy of the sb to batch, the sb may change before it's written */
+int kfs_sync_sb(struct kfs *fs, struct kfs_io_batch *batch)
+{
+    struct kfs_sb *sb;
+    struct kfs_io *io;
+
+    kfs_fold_counts(fs);
+    if (!kfs_test_and_clear_bit_atomic(KFS_DIRTY_BIT, &fs->state)) {
+        return 0;
+    }
+
+    if (fs->mntopt.flags & KFS_MNT_MMAP) {
+        /* In place, only the pages need to be written back */
+        io = kfs_io_batch_add(batch, KFS_IO_MSYNC, 0, kfs_sync_sb_end, fs);
+        if (!io) {
+            kerr("Queue superblock failed\n");
+            kfs_set_bit_atomic(KFS_DIRTY_BIT, &fs->state);
+            return -ENOMEM;
+        }
+        pthread_rwlock_wrlock(&fs->sb_lock);
+        kfs_set_meta_csum(fs->sb, sizeof(*fs->sb), offsetof(struct kfs_sb, csum));
+        pthread_rwlock_unlock(&fs->sb_lock);
+        kfs_io_add_vec(io, fs->sb, sizeof(*fs->sb));
+        return 0;
+    }
+
+    /* The whole block, so it can go straight to an O_DIRECT fd */
+    sb = kfs_alloc_aligned(KFS_BLOCK_SIZE);
+    io = sb ? kfs_io_batch_add(batch, KFS_IO_WRITE, 0, kfs_sync_sb_end, fs) : NULL;
+    if (!io) {
+        kerr("Queue superblock failed\n");
+        kfs_free(MEM_IO, sb);
+        kfs_set_bit_atomic(KFS_DIRTY_BIT, &fs->state);
+        return -ENOMEM;
+    }
+
+    memset(sb, 0, KFS_BLOCK_SIZE);
+    pthread_rwlock_rdlock(&fs->sb_lock);
+    memcpy(sb, fs->sb, sizeof(*sb));
+    pthread_rwlock_unlock(&fs->sb_lock);
+    kfs_set_meta_csum(sb, sizeof(*sb), offsetof(struct kfs_sb, csum));
+    kfs_io_add_vec(io, sb, KFS_BLOCK_SIZE);
+
+    return 0;
+}
+
+/*
+ * The first bg of type with room, locked, NULL if there is none. The
+ * walk starts at the cursor, and from the first bg if nothing is found
+ * after it. For want blocks, a bg the summary says has a free run that
+ * long is taken over the first one with room. The caller holds
+ * lock_bgs().
+ */
+static struct kfs_bg *kfs_find_bg(struct kfs *fs, u32 type, u32 want)
+{
+    struct list_head *bgs = (type == KFS_BG_INODE) ? &fs->ibgs : &fs->dbgs;
+    u32 bits = (type == KFS_BG_INODE) ? fs->inode_per_bg : fs->block_per_bg;
+    struct kfs_bg *bg, *first = NULL, *cursor;
+    struct kfs_bg *head = list_first_entry_rcu(bgs, struct kfs_bg, link);
+
+    bg = cursor = kfs_get_cursor(fs, type);
+  again:
+    list_for_each_entry_from_rcu(bg, bgs, link) {
+        lock_bg(bg);
+        if (bg->bgd.used < bits) {
+            if (!first) {
+                first = bg;
+                kfs_set_cursor(bg);
+            }
+            /* 0 if not known, the bitmap tells */
+            if ((want <= 1) || !bg->bgd.maxrun || (bg->bgd.maxrun >= want)) {
+                return bg;
+            }
+        }
+        unlock_bg(bg);
+    }
+
+    if (first) {
+        /* No run long enough, the first with room does */
+        lock_bg(first);
+        if (first->bgd.used < bits) {
+            return first;
+        }
+        unlock_bg(first);
+    }
+    if (first || (cursor != head)) {
+        /* Taken meanwhile, or freed before the cursor, any room will do */
+        first = NULL;
+        want = 1;
+        bg = cursor = head;
+        goto again;
+    }
+
+    return NULL;
 }
 
 int kfs_alloc_ino(struct kfs *fs, struct kfs_inode *inode)
 {
     int ret;
-    int found = 0;
     struct kfs_bg *ibg;
 
   retry:
     lock_bgs(fs, KFS_BG_INODE);
-    list_for_each_entry(ibg, &fs->ibgs, link) {
-        lock_bg(ibg);
-        if (ibg->bgd.used < fs->inode_per_bg) {
-            found = 1;
-            break;
-        }
-        unlock_bg(ibg);
-    }
-
-    if (!found) {
+    ibg = kfs_find_bg(fs, KFS_BG_INODE, 1);
+    if (!ibg) {
         unlock_bgs(fs, KFS_BG_INODE);
         kinfo("No available inode group, trying to extend filesystem...\n");
         ret = kfs_extend_bg(fs, KFS_BG_INODE);
@@ -96,8 +208,13 @@ int kfs_alloc_ino(struct kfs *fs, struct kfs_inode *inode)
 
     ret = kfs_alloc_inode_bg(ibg, &inode->ino);
     if (!ret) {
-        kfs_ihash_insert(ibg, inode, 0);
         inode->bg = ibg;
+        if (fs->mntopt.flags & KFS_MNT_MMAP) {
+            /* From now on the node is the one in the map */
+            inode->node = kfs_map_ptr(fs, inode_offset(inode));
+            memcpy(inode->node, &inode->node_buf, sizeof(*inode->node));
+        }
+        kfs_ihash_insert(ibg, inode, 0);
     }
     unlock_bg(ibg);
     unlock_bgs(fs, KFS_BG_INODE);
@@ -105,6 +222,132 @@ int kfs_alloc_ino(struct kfs *fs, struct kfs_inode *inode)
     return ret;
 }
 
+int kfs_alloc_block(struct kfs *fs, u64 *bno)
+{
+    int ret;
+    struct kfs_bg *dbg;
+
+  retry:
+    lock_bgs(fs, KFS_BG_DATA);
+    dbg = kfs_find_bg(fs, KFS_BG_DATA, 1);
+    if (!dbg) {
+        unlock_bgs(fs, KFS_BG_DATA);
+        kinfo("No available data group, trying to extend filesystem...\n");
+        ret = kfs_extend_bg(fs, KFS_BG_DATA);
+        if (ret) {
+            return ret;
+        }
+        goto retry;
+    }
+
+    ret = kfs_alloc_block_bg(dbg, bno);
+    unlock_bg(dbg);
+    unlock_bgs(fs, KFS_BG_DATA);
+
+    kdebug2(LOG_OBJECT, "Alloc block %llu from bg %llu\n", *bno, dbg->bid);
+    return ret;
+}
+
+/*
+ * Like kfs_alloc_block(), but take a run of up to want contiguous
+ * blocks from *bno. *got tells how many, at least one.
+ */
+int kfs_alloc_blocks(struct kfs *fs, u32 want, u64 *bno, u32 *got)
+{
+    int ret;
+    struct kfs_bg *dbg;
+
+  retry:
+    lock_bgs(fs, KFS_BG_DATA);
+    dbg = kfs_find_bg(fs, KFS_BG_DATA, want);
+    if (!dbg) {
+        unlock_bgs(fs, KFS_BG_DATA);
+        kinfo("No available data group, trying to extend filesystem...\n");
+        ret = kfs_extend_bg(fs, KFS_BG_DATA);
+        if (ret) {
+            return ret;
+        }
+        goto retry;
+    }
+
+    ret = kfs_load_bitmap(dbg);
+    if (!ret) {
+        *got = kfs_alloc_blocks_bg(dbg, want, bno);
+    }
+    unlock_bg(dbg);
+    unlock_bgs(fs, KFS_BG_DATA);
+    if (ret) {
+        return ret;
+    }
+
+    kdebug2(LOG_OBJECT, "Alloc %u blocks at %llu from bg %llu\n",
+            *got, *bno, dbg->bid);
+    return 0;
+}
+
+/*
+ * The data bg holding bno. The bgs are laid out in the order of their
+ * slots, inode and data ones of different sizes mixed, so the slot is
+ * found by a binary search of fs->slots on the first block.
+ */
+static struct kfs_bg *kfs_find_dbg(struct kfs *fs, u64 bno)
+{
+    u32 lo = 0, hi = __atomic_load_n(&fs->nslots, __ATOMIC_ACQUIRE), mid;
+    struct kfs_bg *dbg;
+    u64 first;
+
+    /* The last bg starting at or before bno */
+    while ((hi - lo) > 1) {
+        mid = lo + ((hi - lo) >> 1);
+        if (fs->slots[mid]->bno <= bno) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if (!hi) {
+        return NULL;
+    }
+
+    dbg = fs->slots[lo];
+    first = bg_data_bno(dbg);
+    if ((dbg->bgd.type == KFS_BG_DATA)
+            && (bno >= first) && (bno < (first + fs->block_per_bg))) {
+        return dbg;
+    }
+
+    kerr("Block %llu not in any data group\n", bno);
+    return NULL;
+}
+
+int kfs_free_block(struct kfs *fs, u64 bno)
+{
+    struct kfs_bg *dbg = kfs_find_dbg(fs, bno);
+    int ret;
+
+    if (!dbg) {
+        return -EINVAL;
+    }
+    lock_bg(dbg);
+    ret = kfs_free_block_bg(dbg, bno);
+    unlock_bg(dbg);
+
+    return ret;
+}
+
+/* The cleared node of inode is on disk, its ino can be reused */
+int kfs_free_ino(struct kfs_inode *inode)
+{
+    struct kfs_bg *ibg = inode->bg;
+    int ret;
+
+    lock_bg(ibg);
+    ret = kfs_free_inode_bg(ibg, inode->ino);
+    unlock_bg(ibg);
+
+    return ret;
+}
+
 int kfs_alloc_inode(struct kfs *fs, struct kfs_inode **inodep)
 {
     struct kfs_inode *inode;
@@ -125,7 +368,8 @@ int kfs_alloc_inode(struct kfs *fs, struct kfs_inode **inodep)
         return ret;
     }
 
-    kfs_set_bit(KFS_INIT_BIT, &inode->state, &inode->lock);
+    inode->node->generation = kfs_next_generation(fs);
+    kfs_set_bit_atomic(KFS_INIT_BIT, &inode->state);
     *inodep = inode;
 
     return 0;
@@ -133,41 +377,128 @@ int kfs_alloc_inode(struct kfs *fs, struct kfs_inode **inodep)
 
 int kfs_sync_fs(struct kfs *fs)
 {
-    int ret;
+    struct kfs_io_batch batch;
+    int ret, err, logged = 0;
 
-    lock_for_extend_fs(fs);
-    ret = kfs_sync_bgs(fs, KFS_BG_INODE);
-    if (ret) {
-        goto out;
+    /*
+     * Everything dirty goes in one batch, submitted once no lock is
+     * held. The bg lists only grow under lock_bgs(), extend_lock is
+     * only needed for the sb. Don't hold it over the inodes, a writer
+     * may be extending the fs with its inode locked.
+     * sync_lock makes sure what an earlier sync took off the dirty
+     * lists is on disk when we return, kfs_sync_file() relies on it.
+     * With the journal the batch is logged first, and all is durable
+     * when we return.
+     */
+    pthread_mutex_lock(&fs->sync_lock);
+    kfs_io_batch_init(fs, &batch);
+    ret = kfs_sync_bgs(fs, KFS_BG_INODE, &batch);
+    if (!ret) {
+        ret = kfs_sync_bgs(fs, KFS_BG_DATA, &batch);
+    }
+    if (!ret) {
+        lock_for_extend_fs(fs);
+        ret = kfs_sync_flexes(fs, &batch);
+        if (!ret) {
+            ret = kfs_sync_gdt(fs, &batch);
+        }
+        if (!ret) {
+            ret = kfs_sync_sb(fs, &batch);
+        }
+        unlock_for_extend_fs(fs);
     }
 
-    ret = kfs_sync_bgs(fs, KFS_BG_DATA);
-    if (ret) {
-        goto out;
+    if (fs->journal.bno) {
+        /* Only whole transactions go in place */
+        logged = ret ? ret : kfs_journal_commit(fs, &batch);
+        if (logged < 0) {
+            kfs_io_batch_cancel(&batch, logged);
+            ret = logged;
+        }
     }
 
-    ret = kfs_sync_sb(fs);
-  out:
-    unlock_for_extend_fs(fs);
-    return ret;
+    /* Even on error, what was queued is written or marked dirty again */
+    err = kfs_io_batch_submit(&batch);
+    kfs_io_batch_release(&batch);
+    if (!err && (logged == 1) && (fdatasync(fs->fd) < 0)) {
+        kerr("fdatasync failed: %s\n", strerror(errno));
+        err = -errno;
+    }
+    if ((jiffies - fs->evicttime) >= KFS_BG_COLD_TIME) {
+        /* Nothing of the batch is in flight any more */
+        fs->evicttime = jiffies;
+        kfs_evict_bgs(fs, KFS_BG_INODE);
+        kfs_evict_bgs(fs, KFS_BG_DATA);
+        kfs_evict_flexes(fs);
+    }
+    pthread_mutex_unlock(&fs->sync_lock);
+
+    return ret ? ret : err;
+}
+
+/*
+ * Check the crc32c of the sb just read in. Whether the last umount was
+ * clean, which the sb tells, says how much the checksums are trusted.
+ */
+static int kfs_check_sb(struct kfs *fs)
+{
+    struct kfs_sb *sb = fs->sb;
+    int ret;
+
+    if (sb->mount_times == sb->umount_times) {
+        kfs_set_bit_atomic(KFS_CLEAN_BIT, &fs->state);
+    } else {
+        kfs_clear_bit_atomic(KFS_CLEAN_BIT, &fs->state);
+    }
+
+    /* A bad one is written again by the mount */
+    ret = kfs_check_csum(fs, sb->csum,
+            kfs_meta_csum(sb, sizeof(*sb), offsetof(struct kfs_sb, csum)), "sb", 0);
+    return (ret < 0) ? -EINVAL : 0;
 }
 
 int kfs_read_sb(struct kfs *fs)
 {
     int ret;
     struct stat st;
+    u64 nr, meta;
 
-    ret = pread(fs->fd, &fs->sb, sizeof(fs->sb), 0);
-    if (ret != sizeof(fs->sb)) {
+    ret = kfs_pread(fs, fs->sb, sizeof(*fs->sb), 0);
+    if (ret != sizeof(*fs->sb)) {
         kerr("Read super block failed\n");
         return -EIO;
     }
 
-    if (fs->sb.magic != KFS_SB_MAGIC
-            || fs->sb.version != KFS_SB_VERSION) {
+    if (fs->sb->magic != KFS_SB_MAGIC
+            || fs->sb->version > KFS_SB_VERSION) {
         kerr("Super block check failed\n");
         return -EINVAL;
     }
+    if (fs->sb->version != KFS_SB_VERSION) {
+        kerr("Image of version %u, convert it with mkfs -c first\n",
+                fs->sb->version);
+        return -EINVAL;
+    }
+    ret = kfs_check_sb(fs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The sb may be in the journal too */
+    ret = kfs_journal_replay(fs);
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret) {
+        if (kfs_pread(fs, fs->sb, sizeof(*fs->sb), 0) != sizeof(*fs->sb)) {
+            kerr("Read super block failed\n");
+            return -EIO;
+        }
+        ret = kfs_check_sb(fs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
 
     ret = fstat(fs->fd, &st);
     if (ret < 0) {
@@ -175,13 +506,26 @@ int kfs_read_sb(struct kfs *fs)
         return -EIO;
     }
 
+    if (fs->sb->flex_bgs == 1 || fs->sb->flex_bgs > KFS_FLEX_MAX) {
+        kerr("Bad flex_bgs %u\n", fs->sb->flex_bgs);
+        return -EINVAL;
+    }
+
+    /* A flex has a run of flex_bgs bitmaps, even if not full yet */
+    nr = fs->sb->ibg_num + fs->sb->dbg_num;
+    if (fs->sb->flex_bgs) {
+        meta = ((nr + fs->sb->flex_bgs - 1) / fs->sb->flex_bgs)
+            * fs->sb->flex_bgs * KFS_BITMAP_SIZE;
+    } else {
+        meta = nr * (KFS_BGD_SIZE + KFS_BITMAP_SIZE);
+    }
     fs->filesize = st.st_size;
     if (fs->filesize !=
             (KFS_SB_SIZE
-             + (KFS_BGD_SIZE * (fs->sb.ibg_num+fs->sb.dbg_num))
-             + (KFS_BITMAP_SIZE * (fs->sb.ibg_num+fs->sb.dbg_num))
-             + (fs->sb.ibg_size * fs->sb.ibg_num)
-             + (fs->sb.dbg_size * fs->sb.dbg_num))) {
+             + ((u64)fs->sb->gdt_blocks << KFS_BLOCK_SHIFT)
+             + meta
+             + (fs->sb->ibg_size * fs->sb->ibg_num)
+             + (fs->sb->dbg_size * fs->sb->dbg_num))) {
         kerr("Check filesize failed: %s\n", strerror(errno));
         return -EINVAL;
     }
@@ -190,99 +534,804 @@ int kfs_read_sb(struct kfs *fs)
     fs->block_per_bg = kfs_dbg_size(fs) / KFS_BLOCK_SIZE;
 
     kdebug(LOG_VFS, "Read sb iused %llu bused %llu\n",
-            fs->sb.iused, fs->sb.bused);
+            fs->sb->iused, fs->sb->bused);
     return 0;
 }
 
-/* This will be done during mount time, so no lock is needed */
+/*
+ * This will be done during mount time, so no lock is needed.
+ * The bgs are made from the group descriptor table, read in one go.
+ * Their bitmaps are left on disk until kfs_load_bitmap(). With
+ * mmap_meta there is nothing to read, the bgs point into the map.
+ */
 int kfs_build_bgs(struct kfs *fs)
 {
+    struct kfs_gde *gde;
     struct kfs_bg *bg;
-    int ret;
-    u64 offset = KFS_SB_SIZE;
+    int ret = 0;
+    u64 nr = fs->sb->ibg_num + fs->sb->dbg_num;
     u64 ibgid = 0;
     u64 dbgid = 0;
+    u64 offset, end, id, run;
+    u32 slot, head;
+    int bad;
 
+    ret = kfs_read_gdt(fs);
+    if (ret) {
+        return ret;
+    }
 
-    while (offset < fs->filesize) {
-        if ((fs->filesize - offset) < KFS_BGD_SIZE) {
-            kerr("Invalid filesize left offset %llu filesize %llu\n",
-                    offset, fs->filesize);
-            return -EINVAL;
+    head = fs->sb->flex_bgs ? 0 : KFS_BG_META_SIZE;
+    for (slot = 0; slot < nr; slot++) {
+        gde = &fs->gdt[slot];
+        bad = kfs_check_csum(fs, gde->csum,
+                kfs_meta_csum(gde, sizeof(*gde), offsetof(struct kfs_gde, csum)),
+                "entry of bg", slot);
+        if (bad < 0) {
+            ret = bad;
+            goto out;
+        }
+        offset = gde->bno << KFS_BLOCK_SHIFT;
+        if (gde->type == KFS_BG_INODE) {
+            end = offset + head + fs->sb->ibg_size;
+            id = ibgid++;
+        } else if (gde->type == KFS_BG_DATA) {
+            end = offset + head + fs->sb->dbg_size;
+            id = dbgid++;
+        } else {
+            kerr("Bad type %u of bg %u\n", gde->type, slot);
+            ret = -EINVAL;
+            goto out;
+        }
+        /* The bitmaps of a flex are right before its first bg */
+        run = 0;
+        if (fs->sb->flex_bgs && !(slot % fs->sb->flex_bgs)) {
+            run = gde->bno - fs->sb->flex_bgs;
+            offset -= (u64)fs->sb->flex_bgs << KFS_BLOCK_SHIFT;
         }
+        if ((offset < KFS_SB_SIZE) || (end > fs->filesize)) {
+            kerr("Invalid bg %u at %llu filesize %llu\n",
+                    slot, offset, fs->filesize);
+            ret = -EINVAL;
+            goto out;
+        }
+        offset = gde->bno << KFS_BLOCK_SHIFT;
 
         bg = kfs_alloc(MEM_FS, sizeof(*bg));
         if (!bg) {
             kerr("Alloc bg failed\n");
-            return -ENOMEM;
+            ret = -ENOMEM;
+            goto out;
         }
 
-        /* I don't know the bg type yet, will set it later */
-        kfs_init_bg(fs, bg, 0, 0, offset);
-
-        ret = pread(fs->fd, &bg->bgd, sizeof(bg->bgd), offset);
-        if (ret != sizeof(bg->bgd)) {
-            kerr("Read block group discriptor failed %s\n",
-                    strerror(errno));
-            return -EIO;
+        ret = kfs_init_bg(fs, bg, id, gde->type, offset);
+        if (ret) {
+            kfs_free_bg(bg);
+            goto out;
+        }
+        bg->slot = slot;
+        bg->bgd.used = gde->used;
+        bg->bgd.cursor = gde->cursor;
+        bg->bgd.maxrun = gde->maxrun;
+        bg->bgd.csum = gde->map_csum;
+        if (bad) {
+            kfs_update_gde(bg);
+        }
+        if (fs->sb->flex_bgs) {
+            ret = kfs_flex_add_bg(bg, run);
+            if (ret) {
+                kfs_free_bg(bg);
+                goto out;
+            }
         }
 
-        if (bg->bgd.type == KFS_BG_INODE) {
-            bg->bid = ibgid;
-            ibgid++;
+        fs->slots[slot] = bg;
+        fs->nslots = slot + 1;
+        if (gde->type == KFS_BG_INODE) {
+            list_add_tail(&bg->link, &fs->ibgs);
         } else {
-            bg->bid = dbgid;
-            dbgid++;
+            list_add_tail(&bg->link, &fs->dbgs);
         }
+        kdebug(LOG_VFS, "Init bg type %u id %llu\n", gde->type, bg->bid);
+    }
+
+    if ((ibgid != fs->sb->ibg_num) || (dbgid != fs->sb->dbg_num)) {
+        kerr("%llu inode and %llu data bgs in the table, %llu and %llu in sb\n",
+                ibgid, dbgid, fs->sb->ibg_num, fs->sb->dbg_num);
+        ret = -EINVAL;
+    }
+
+  out:
+    fs->evicttime = jiffies;
 
-        offset += KFS_BGD_SIZE;
-        if ((fs->filesize - offset) < KFS_BITMAP_SIZE) {
-            kerr("Invalid filesize left offset %llu filesize %llu\n",
-                    offset, fs->filesize);
-            return -EINVAL;
+    return ret;
+}
+
+/* The bg of type with id, NULL if there is none */
+static struct kfs_bg *kfs_find_bg_id(struct kfs *fs, u32 type, u64 id)
+{
+    struct list_head *bgs = (type == KFS_BG_INODE) ? &fs->ibgs : &fs->dbgs;
+    struct kfs_bg *bg;
+
+    list_for_each_entry(bg, bgs, link) {
+        if (bg->bid == id) {
+            return bg;
         }
+    }
+    return NULL;
+}
 
-        ret = pread(fs->fd, &bg->bitmap, sizeof(bg->bitmap), offset);
-        if (ret != sizeof(bg->bitmap)) {
-            kerr("Read block group bitmap failed %s\n",
-                    strerror(errno));
-            return -EIO;
+static int kfs_count_one(struct kfs_bg *bg, void *priv)
+{
+    int ret;
+
+    lock_bg(bg);
+    ret = kfs_count_bg(bg);
+    unlock_bg(bg);
+
+    return ret;
+}
+
+/*
+ * At mount, after kfs_build_bgs(). The used counts, cursors and
+ * longest free runs in the table, and the cursors in the sb, are what
+ * kfs_save_summary() left at the last umount. If there was none since
+ * the last mount, all the bitmaps are read in to count them again, by
+ * kfs_scan_bgs(), and the rest is forgotten.
+ */
+int kfs_load_summary(struct kfs *fs)
+{
+    struct kfs_bg *bg;
+    u64 iused = 0, bused = 0;
+    int ret;
+
+    fs->generation = fs->sb->generation;
+    if (fs->sb->mount_times == fs->sb->umount_times) {
+        fs->icursor = kfs_find_bg_id(fs, KFS_BG_INODE, fs->sb->icursor);
+        fs->dcursor = kfs_find_bg_id(fs, KFS_BG_DATA, fs->sb->dcursor);
+        return 0;
+    }
+
+    kwarn("Not umounted cleanly, counting %llu inode and %llu data bgs\n",
+            fs->sb->ibg_num, fs->sb->dbg_num);
+    ret = kfs_scan_bgs(fs, 0, kfs_count_one, NULL);
+    if (ret) {
+        return ret;
+    }
+
+    list_for_each_entry(bg, &fs->ibgs, link) {
+        iused += bg->bgd.used;
+    }
+    list_for_each_entry(bg, &fs->dbgs, link) {
+        bused += bg->bgd.used;
+    }
+    if ((iused != fs->sb->iused) || (bused != fs->sb->bused)) {
+        kwarn("%llu inodes and %llu blocks used, not %llu and %llu\n",
+                iused, bused, fs->sb->iused, fs->sb->bused);
+        fs->sb->iused = iused;
+        fs->sb->bused = bused;
+        mark_fs_dirty(fs);
+    }
+
+    return 0;
+}
+
+/* Longest free runs of the bgs with their bitmaps still in */
+static void kfs_sum_bgs(struct kfs *fs, u32 type)
+{
+    struct list_head *bgs = (type == KFS_BG_INODE) ? &fs->ibgs : &fs->dbgs;
+    struct kfs_gde *gde;
+    struct kfs_bg *bg;
+
+    lock_bgs(fs, type);
+    list_for_each_entry_rcu(bg, bgs, link) {
+        lock_bg(bg);
+        kfs_sum_bg(bg);
+        gde = &fs->gdt[bg->slot];
+        if ((gde->cursor != bg->bgd.cursor) || (gde->maxrun != bg->bgd.maxrun)) {
+            kfs_update_gde(bg);
         }
+        unlock_bg(bg);
+    }
+    unlock_bgs(fs, type);
+}
+
+/*
+ * At umount, once all is synced. The summary goes to the table, and is
+ * on disk before the sb says the umount was clean, for
+ * kfs_load_summary().
+ */
+int kfs_save_summary(struct kfs *fs)
+{
+    struct kfs_bg *icursor = __atomic_load_n(&fs->icursor, __ATOMIC_ACQUIRE);
+    struct kfs_bg *dcursor = __atomic_load_n(&fs->dcursor, __ATOMIC_ACQUIRE);
+    struct timespec now;
+    int ret;
+
+    kfs_sum_bgs(fs, KFS_BG_INODE);
+    kfs_sum_bgs(fs, KFS_BG_DATA);
+    fs->sb->icursor = icursor ? icursor->bid : 0;
+    fs->sb->dcursor = dcursor ? dcursor->bid : 0;
+    mark_fs_dirty(fs);
+
+    ret = kfs_sync_fs(fs);
+    if (!ret && (fdatasync(fs->fd) < 0)) {
+        kerr("fdatasync failed: %s\n", strerror(errno));
+        ret = -errno;
+    }
+    if (ret) {
+        return ret;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    fs->sb->umount_time = now;
+    fs->sb->umount_times = fs->sb->mount_times;
+    mark_fs_dirty(fs);
+    ret = kfs_sync_fs(fs);
+    if (!ret && (fdatasync(fs->fd) < 0)) {
+        kerr("fdatasync failed: %s\n", strerror(errno));
+        ret = -errno;
+    }
+
+    return ret;
+}
 
-        offset += KFS_BITMAP_SIZE;
+/* An entry of the v2 table, before the checksums */
+struct kfs_gde_v2 {
+    u64 bno;
+    u64 pad;
+    u32 type;
+    u32 used;
+    u32 cursor;
+    u32 maxrun;
+} __attribute__((packed));
+
+/*
+ * v1 images have no group descriptor table, it's made from their bgd
+ * blocks and added at the end of the image, end before.
+ */
+static int kfs_convert_v1(struct kfs *fs, u64 end)
+{
+    struct kfs_bg_meta *meta;
+    struct kfs_gde *gde;
+    u64 offset, nr = fs->sb->ibg_num + fs->sb->dbg_num;
+    u32 slot = 0, blocks;
+    int ret;
+
+    blocks = ((nr + KFS_GDE_PER_BLOCK - 1) / KFS_GDE_PER_BLOCK);
+    if (blocks < KFS_GDT_BLOCKS) {
+        blocks = KFS_GDT_BLOCKS;
+    }
 
-        offset += (bg->bgd.type == KFS_BG_INODE)?fs->sb.ibg_size:fs->sb.dbg_size;
+    meta = kfs_alloc_aligned(KFS_BGD_SIZE);
+    if (!meta) {
+        return -ENOMEM;
+    }
+    ret = kfs_create_gdt(fs, blocks);
+    if (ret) {
+        goto out;
+    }
 
-        if (offset > fs->filesize) {
-            kerr("Invalid filesize left offset %llu filesize %llu\n",
-                    offset, fs->filesize);
-            return -EINVAL;
+    /* The v1 walk, where the next bg is depends on the type */
+    offset = KFS_SB_SIZE;
+    while ((offset < end) && (slot < nr)) {
+        if (kfs_pread(fs, meta->bgd_block, KFS_BGD_SIZE, offset) != KFS_BGD_SIZE) {
+            kerr("Read bgd %u at %llu failed\n", slot, offset);
+            ret = -EIO;
+            goto out;
         }
+        gde = &fs->gdt[slot++];
+        gde->bno = offset >> KFS_BLOCK_SHIFT;
+        gde->type = meta->bgd.type;
+        gde->used = meta->bgd.used;
+        offset += KFS_BG_META_SIZE;
+        offset += (gde->type == KFS_BG_INODE)?fs->sb->ibg_size:fs->sb->dbg_size;
+    }
+    if ((offset != end) || (slot != nr)) {
+        kerr("Found %u bgs up to %llu, the sb has %llu up to %llu\n",
+                slot, offset, nr, end);
+        ret = -EINVAL;
+    }
 
-        if (bg->bgd.type == KFS_BG_INODE) {
-            list_add_tail(&bg->link, &fs->ibgs);
+  out:
+    kfs_free(MEM_IO, meta);
+    return ret;
+}
+
+/*
+ * The v2 table in memory to v3 entries, unless a convert that stopped
+ * half way has written them already.
+ */
+static int kfs_convert_v2(struct kfs *fs)
+{
+    struct kfs_gde_v2 old;
+    struct kfs_gde *gde;
+    u64 slot, nr = fs->sb->ibg_num + fs->sb->dbg_num;
+    int ret;
+
+    ret = kfs_read_gdt(fs);
+    if (ret) {
+        return ret;
+    }
+    if (nr && (fs->gdt[0].csum
+                == kfs_meta_csum(&fs->gdt[0], sizeof(fs->gdt[0]),
+                    offsetof(struct kfs_gde, csum)))) {
+        kinfo("The table is of version 3 already\n");
+        return 0;
+    }
+
+    for (slot = 0; slot < nr; slot++) {
+        gde = &fs->gdt[slot];
+        memcpy(&old, gde, sizeof(old));
+        memset(gde, 0, sizeof(*gde));
+        gde->bno = old.bno;
+        gde->type = old.type;
+        gde->used = old.used;
+        gde->cursor = old.cursor;
+        gde->maxrun = old.maxrun;
+    }
+
+    return 0;
+}
+
+/*
+ * The checksums v3 adds: of each bitmap and entry in the table in
+ * memory, and of the inodes, which are written in place. Inodes never
+ * written stay all zeros.
+ */
+static int kfs_convert_csums(struct kfs *fs)
+{
+    static const struct kfs_node zero;
+    struct kfs_bitmap *bitmap;
+    struct kfs_node *node;
+    struct kfs_gde *gde;
+    char *table = NULL;
+    u64 slot, mapb, first = 0, pos, nr = fs->sb->ibg_num + fs->sb->dbg_num;
+    u32 flex = fs->sb->flex_bgs, i;
+    int ret = 0;
+
+    bitmap = kfs_alloc_aligned(sizeof(*bitmap));
+    table = kfs_alloc_aligned(fs->sb->ibg_size);
+    if (!bitmap || !table) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (slot = 0; slot < nr; slot++) {
+        gde = &fs->gdt[slot];
+        /* As kfs_build_bgs() finds the bitmap */
+        if (flex) {
+            if (!(slot % flex)) {
+                first = gde->bno - flex;
+            }
+            mapb = first + (slot % flex);
+            pos = gde->bno << KFS_BLOCK_SHIFT;
         } else {
-            list_add_tail(&bg->link, &fs->dbgs);
+            mapb = gde->bno + (KFS_BGD_SIZE >> KFS_BLOCK_SHIFT);
+            pos = (gde->bno << KFS_BLOCK_SHIFT) + KFS_BG_META_SIZE;
+        }
+        if (kfs_pread(fs, bitmap, sizeof(*bitmap), mapb << KFS_BLOCK_SHIFT)
+                != sizeof(*bitmap)) {
+            kerr("Read bitmap of bg %llu failed %s\n", slot, strerror(errno));
+            ret = -EIO;
+            goto out;
+        }
+        gde->map_csum = kfs_crc32c(0, bitmap, sizeof(*bitmap));
+        kfs_set_meta_csum(gde, sizeof(*gde), offsetof(struct kfs_gde, csum));
+        if (gde->type != KFS_BG_INODE) {
+            continue;
+        }
+
+        if (kfs_pread(fs, table, fs->sb->ibg_size, pos) != fs->sb->ibg_size) {
+            kerr("Read inodes of bg %llu failed %s\n", slot, strerror(errno));
+            ret = -EIO;
+            goto out;
+        }
+        for (i = 0; i < (fs->sb->ibg_size / KFS_INODE_SIZE); i++) {
+            node = (struct kfs_node *)(table + ((size_t)i << KFS_INODE_SHIFT));
+            if (memcmp(node, &zero, sizeof(zero))) {
+                kfs_set_meta_csum(node, sizeof(*node),
+                        offsetof(struct kfs_node, csum));
+            }
+        }
+        if (kfs_pwrite(fs, table, fs->sb->ibg_size, pos) != fs->sb->ibg_size) {
+            kerr("Write inodes of bg %llu failed %s\n", slot, strerror(errno));
+            ret = -EIO;
+            goto out;
         }
-        kdebug(LOG_VFS, "Init bg type %u id %llu\n",
-                bg->bgd.type, bg->bid);
     }
 
-    return 0;
+  out:
+    if (table) {
+        kfs_free(MEM_IO, table);
+    }
+    if (bitmap) {
+        kfs_free(MEM_IO, bitmap);
+    }
+    return ret;
+}
+
+/*
+ * Bring an image of an older format to KFS_SB_VERSION in place: v1 gets
+ * a group descriptor table, v2 the checksums of v3. The sb is written
+ * last, an image left half way is still of its old version, and can be
+ * converted again.
+ */
+int kfs_convert_fs(struct kfs *fs, char *filename)
+{
+    struct stat st;
+    u64 end;
+    size_t len;
+    int ret;
+
+    fs->fd = open(filename, O_RDWR|O_NOFOLLOW);
+    if (fs->fd < 0) {
+        ret = -errno;
+        kerr("Open file %s failed: %s\n", filename, strerror(errno));
+        return ret;
+    }
+
+    if (kfs_pread(fs, fs->sb, sizeof(*fs->sb), 0) != sizeof(*fs->sb)) {
+        kerr("Read super block failed\n");
+        ret = -EIO;
+        goto out;
+    }
+    if ((fs->sb->magic != KFS_SB_MAGIC) || (fs->sb->version > KFS_SB_VERSION)) {
+        kerr("Super block check failed\n");
+        ret = -EINVAL;
+        goto out;
+    }
+    if (fs->sb->version == KFS_SB_VERSION) {
+        kinfo("%s is of version %u already\n", filename, KFS_SB_VERSION);
+        ret = 0;
+        goto out;
+    }
+
+    /* Whatever is in the journal belongs to the old layout */
+    ret = kfs_journal_replay(fs);
+    if (ret < 0) {
+        goto out;
+    }
+    if (ret && (kfs_pread(fs, fs->sb, sizeof(*fs->sb), 0) != sizeof(*fs->sb))) {
+        kerr("Read super block failed\n");
+        ret = -EIO;
+        goto out;
+    }
+
+    if (fstat(fs->fd, &st) < 0) {
+        kerr("Get filesize failed: %s\n", strerror(errno));
+        ret = -EIO;
+        goto out;
+    }
+    fs->filesize = end = st.st_size;
+
+    if (fs->sb->version == 1) {
+        ret = kfs_convert_v1(fs, end);
+    } else {
+        ret = kfs_convert_v2(fs);
+    }
+    if (!ret) {
+        ret = kfs_convert_csums(fs);
+    }
+    if (ret) {
+        goto err_truncate;
+    }
+
+    len = (size_t)fs->sb->gdt_blocks << KFS_BLOCK_SHIFT;
+    if ((kfs_pwrite(fs, fs->gdt, len, fs->sb->gdt << KFS_BLOCK_SHIFT) != len)
+            || (fsync(fs->fd) < 0)) {
+        kerr("Write group descriptor table failed %s\n", strerror(errno));
+        ret = -EIO;
+        goto err_truncate;
+    }
+
+    fs->sb->version = KFS_SB_VERSION;
+    kfs_set_meta_csum(fs->sb, sizeof(*fs->sb), offsetof(struct kfs_sb, csum));
+    if ((kfs_pwrite(fs, fs->sb, sizeof(*fs->sb), 0) != sizeof(*fs->sb))
+            || (fsync(fs->fd) < 0)) {
+        kerr("Write super block failed %s\n", strerror(errno));
+        ret = -EIO;
+        goto out;
+    }
+    kinfo("Converted %s to version %u, %llu bgs\n", filename,
+            KFS_SB_VERSION, fs->sb->ibg_num + fs->sb->dbg_num);
+    goto out;
+
+  err_truncate:
+    /* Only the table of a v1 image was added */
+    if ((fs->filesize != end) && (ftruncate(fs->fd, end) < 0)) {
+        kerr("Trucate fs back to %llu failed: %s\n", end, strerror(errno));
+    }
+  out:
+    kfs_free_gdt(fs);
+    close(fs->fd);
+    return ret;
+}
+
+/*
+ * iused and bused change on every create and block allocation, from
+ * every thread. Each thread adds to a shard of fs->counts of its own
+ * instead of taking sb_lock, kfs_fold_counts() moves the shards to the
+ * sb at sync and statfs. Their sum is in the bgs anyway, dirtied along
+ * with the counts. The bg cursors they move are atomics, so nothing on
+ * the way takes fs->lock either.
+ */
+static __thread int kfs_count_shard = -1;
+static int kfs_count_next;
+
+static inline struct kfs_count *kfs_my_count(struct kfs *fs)
+{
+    if (kfs_count_shard < 0) {
+        kfs_count_shard = __atomic_fetch_add(&kfs_count_next, 1, __ATOMIC_RELAXED)
+            & (KFS_COUNT_SHARDS - 1);
+    }
+    return &fs->counts[kfs_count_shard];
 }
 
 void kfs_inc_iused(struct kfs *fs)
 {
-    pthread_rwlock_wrlock(&fs->sb_lock);
-    fs->sb.iused++;
-    pthread_rwlock_unlock(&fs->sb_lock);
-    mark_fs_dirty(fs, 0);
+    __atomic_add_fetch(&kfs_my_count(fs)->iused, 1, __ATOMIC_RELAXED);
 }
 
 void kfs_dec_iused(struct kfs *fs)
 {
+    __atomic_sub_fetch(&kfs_my_count(fs)->iused, 1, __ATOMIC_RELAXED);
+}
+
+void kfs_inc_bused(struct kfs *fs)
+{
+    __atomic_add_fetch(&kfs_my_count(fs)->bused, 1, __ATOMIC_RELAXED);
+}
+
+void kfs_add_bused(struct kfs *fs, u64 n)
+{
+    __atomic_add_fetch(&kfs_my_count(fs)->bused, n, __ATOMIC_RELAXED);
+}
+
+void kfs_sub_bused(struct kfs *fs, u64 n)
+{
+    __atomic_sub_fetch(&kfs_my_count(fs)->bused, n, __ATOMIC_RELAXED);
+}
+
+/* Taken by each new inode, it's in the sb from the next fold on */
+u32 kfs_next_generation(struct kfs *fs)
+{
+    return __atomic_add_fetch(&fs->generation, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Move what the shards counted to the sb, and the generation. Return 1
+ * and mark the fs dirty if it changed.
+ */
+int kfs_fold_counts(struct kfs *fs)
+{
+    long long iused = 0, bused = 0;
+    u32 gen;
+    int i, changed;
+
+    for (i = 0; i < KFS_COUNT_SHARDS; i++) {
+        if (__atomic_load_n(&fs->counts[i].iused, __ATOMIC_RELAXED)) {
+            iused += __atomic_exchange_n(&fs->counts[i].iused, 0, __ATOMIC_RELAXED);
+        }
+        if (__atomic_load_n(&fs->counts[i].bused, __ATOMIC_RELAXED)) {
+            bused += __atomic_exchange_n(&fs->counts[i].bused, 0, __ATOMIC_RELAXED);
+        }
+    }
+    gen = __atomic_load_n(&fs->generation, __ATOMIC_RELAXED);
+
     pthread_rwlock_wrlock(&fs->sb_lock);
-    fs->sb.iused--;
+    changed = iused || bused || (fs->sb->generation != gen);
+    fs->sb->iused += iused;
+    fs->sb->bused += bused;
+    fs->sb->generation = gen;
+    pthread_rwlock_unlock(&fs->sb_lock);
+
+    if (changed) {
+        mark_fs_dirty(fs);
+    }
+    return changed;
+}
+
+/*
+ * The counts of the sb once the shards are folded in, a create or an
+ * allocation running meanwhile may be in or not. With exact_statfs the
+ * used inodes and blocks of the bgs are added up instead, each bg under
+ * its lock, so they are what the bitmaps say.
+ */
+static void kfs_count_used(struct kfs *fs, u64 *iused, u64 *bused)
+{
+    struct kfs_bg *bg;
+
+    if (!(fs->mntopt.flags & KFS_MNT_EXACT_STATFS)) {
+        kfs_fold_counts(fs);
+        pthread_rwlock_rdlock(&fs->sb_lock);
+        *iused = fs->sb->iused;
+        *bused = fs->sb->bused;
+        pthread_rwlock_unlock(&fs->sb_lock);
+        return;
+    }
+
+    *iused = 0;
+    *bused = 0;
+    lock_bgs(fs, KFS_BG_INODE);
+    list_for_each_entry_rcu(bg, &fs->ibgs, link) {
+        lock_bg(bg);
+        *iused += bg->bgd.used;
+        unlock_bg(bg);
+    }
+    unlock_bgs(fs, KFS_BG_INODE);
+    lock_bgs(fs, KFS_BG_DATA);
+    list_for_each_entry_rcu(bg, &fs->dbgs, link) {
+        lock_bg(bg);
+        *bused += bg->bgd.used;
+        unlock_bg(bg);
+    }
+    unlock_bgs(fs, KFS_BG_DATA);
+}
+
+void kfs_fill_statfs(struct kfs *fs, struct statvfs *stbuf)
+{
+    unsigned char blockbits;
+    unsigned long blockres;
+    u64 iused, bused;
+
+    stbuf->f_frsize = KFS_BLOCK_SIZE;
+    stbuf->f_bsize = KFS_BLOCK_SIZE;
+    blockbits = KFS_BLOCK_SHIFT;
+    blockres = (1 << blockbits) - 1;
+    stbuf->f_namemax = KFS_FILENAME_LEN - 1;
+    kfs_count_used(fs, &iused, &bused);
+    pthread_rwlock_rdlock(&fs->sb_lock);
+    stbuf->f_blocks = (fs->filesize + blockres) >> blockbits;
+    stbuf->f_bfree = stbuf->f_blocks - bused;
+    stbuf->f_bavail = ((fs->sb->dbg_num * fs->sb->dbg_size) >> blockbits) - bused;
+    stbuf->f_files = fs->sb->ibg_num * fs->inode_per_bg;
+    stbuf->f_ffree = (fs->sb->ibg_num * fs->inode_per_bg) - iused;
     pthread_rwlock_unlock(&fs->sb_lock);
-    mark_fs_dirty(fs, 0);
+    kdebug(LOG_VFS, "iuse %llu\n", iused);
+}
+
+int kfs_check_mntopt(struct kfs_mount_opt *opt)
+{
+    if (opt->update_daley > MAX_UPDATE_DELAY) {
+        kerr("update_delay should be less than %d\n", MAX_UPDATE_DELAY);
+        return -EINVAL;
+    }
+    if (opt->dirty_thresh < MIN_DIRTY_THRESH) {
+        kerr("dirty_bytes should be at least %d\n", MIN_DIRTY_THRESH);
+        return -EINVAL;
+    }
+    if (opt->dirty_limit <= opt->dirty_thresh) {
+        kerr("dirty_limit should be greater than dirty_bytes\n");
+        return -EINVAL;
+    }
+    if ((opt->inode_dirty_limit < MIN_DIRTY_THRESH)
+            || (opt->inode_dirty_limit > opt->dirty_limit)) {
+        kerr("inode_dirty_limit should be between %d and dirty_limit\n",
+                MIN_DIRTY_THRESH);
+        return -EINVAL;
+    }
+    if ((opt->flags & KFS_MNT_MMAP) && (opt->flags & KFS_MNT_ODIRECT)) {
+        kerr("mmap_meta can't be used with odirect\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Open the image and load the sb and bgs, used by the fuse frontends */
+int kfs_open_fs(struct kfs *fs, char *filename)
+{
+    struct timespec now;
+    int ret, flags;
+
+    flags = O_RDWR|O_NOFOLLOW;
+    if (fs->mntopt.flags & KFS_MNT_ODIRECT) {
+        flags |= O_DIRECT;
+    }
+
+    fs->fd = open(filename, flags);
+    if (fs->fd < 0) {
+        ret = -errno;
+        kerr("Open file %s failed: %s\n", filename, strerror(errno));
+        return ret;
+    }
+
+    ret = kfs_io_init(fs);
+    if (ret < 0) {
+        goto err;
+    }
+
+    ret = kfs_read_sb(fs);
+    if (ret < 0) {
+        goto err_io;
+    }
+
+    if (fs->mntopt.flags & KFS_MNT_MMAP) {
+        /* The sb was checked in sb_buf, use the one in the map now */
+        ret = kfs_map_image(fs, fs->filesize);
+        if (ret < 0) {
+            goto err_io;
+        }
+        fs->sb = kfs_map_ptr(fs, 0);
+    }
+
+    ret = kfs_build_bgs(fs);
+    if (ret < 0) {
+        goto err_map;
+    }
+
+    ret = kfs_load_summary(fs);
+    if (ret < 0) {
+        goto err_map;
+    }
+
+    ret = kfs_journal_load(fs);
+    if (ret < 0) {
+        goto err_map;
+    }
+
+    /* The summary on disk is stale until kfs_save_summary() */
+    clock_gettime(CLOCK_REALTIME, &now);
+    fs->sb->mount_time = now;
+    fs->sb->mount_times++;
+    mark_fs_dirty(fs);
+    ret = kfs_sync_fs(fs);
+    if (!ret && (fdatasync(fs->fd) < 0)) {
+        kerr("fdatasync failed: %s\n", strerror(errno));
+        ret = -errno;
+    }
+    if (ret < 0) {
+        goto err_map;
+    }
+
+    return 0;
+
+  err_map:
+    kfs_free_flexes(fs);
+    kfs_free_gdt(fs);
+    if (fs->map) {
+        fs->sb = &fs->sb_buf;
+        kfs_unmap_image(fs);
+    }
+  err_io:
+    kfs_io_exit(fs);
+  err:
+    close(fs->fd);
+    return ret;
+}
+
+void kfs_close_fs(struct kfs *fs)
+{
+    int ret;
+
+    kfs_stop_flusher(fs);
+    ret = kfs_sync_fs(fs);
+    if (!ret) {
+        ret = kfs_sync_data(fs, 0);
+    }
+    if (ret) {
+        kwarn("Sync filesystem failed\n");
+    } else if (kfs_save_summary(fs)) {
+        kwarn("Save free space summary failed\n");
+    }
+    pthread_mutex_lock(&fs->sync_lock);
+    ret = kfs_journal_checkpoint(fs);
+    pthread_mutex_unlock(&fs->sync_lock);
+    if (ret) {
+        kwarn("Checkpoint journal failed\n");
+    }
+    kfs_io_exit(fs);
+    kfs_free_flexes(fs);
+    kfs_free_gdt(fs);
+    if (fs->map) {
+        memcpy(&fs->sb_buf, fs->sb, sizeof(fs->sb_buf));
+        fs->sb = &fs->sb_buf;
+        kfs_unmap_image(fs);
+    }
+    ret = close(fs->fd);
+    if (ret) {
+        kwarn("Close filesystem failed: %s\n", strerror(errno));
+    }
+    /* Nobody is left in the bg lists when the caller frees them */
+    kfs_synchronize_bgs(fs);
 }
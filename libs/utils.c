@@ -92,3 +92,76 @@ int kfs_test_bit(u32 nr, void *addr, pthread_mutex_t *lock)
 
     return ret;
 }
+
+/*
+ * Lock free bit ops on arrays of u64, bit nr is bit (nr & 63) of word
+ * (nr >> 6), the same bit as kfs_set_bit() on little endian. For the
+ * state flags, which any thread may set or clear: none needs a lock.
+ * The test_and ones are full barriers, the others order the stores or
+ * loads before or after them.
+ */
+void kfs_set_bit_atomic(u32 nr, u64 *addr)
+{
+    __atomic_fetch_or(addr + (nr >> 6), 1ULL << (nr & 63), __ATOMIC_RELEASE);
+}
+
+void kfs_clear_bit_atomic(u32 nr, u64 *addr)
+{
+    __atomic_fetch_and(addr + (nr >> 6), ~(1ULL << (nr & 63)), __ATOMIC_RELEASE);
+}
+
+int kfs_test_bit_atomic(u32 nr, const u64 *addr)
+{
+    return (__atomic_load_n(addr + (nr >> 6), __ATOMIC_ACQUIRE) >> (nr & 63)) & 1;
+}
+
+int kfs_test_and_set_bit_atomic(u32 nr, u64 *addr)
+{
+    u64 mask = 1ULL << (nr & 63);
+
+    return !!(__atomic_fetch_or(addr + (nr >> 6), mask, __ATOMIC_SEQ_CST) & mask);
+}
+
+int kfs_test_and_clear_bit_atomic(u32 nr, u64 *addr)
+{
+    u64 mask = 1ULL << (nr & 63);
+
+    return !!(__atomic_fetch_and(addr + (nr >> 6), ~mask, __ATOMIC_SEQ_CST) & mask);
+}
+
+/*
+ * Take the first clear bit at or after from, and before size, with a
+ * compare and swap of its word: two takers never get the same bit.
+ * Return it, or -1 if they are all set.
+ */
+int kfs_find_and_set_bit_atomic(u64 *addr, u32 size, u32 from)
+{
+    u32 nr = from & ~63;
+    u64 *word = addr + (from >> 6);
+    u64 old, free;
+
+    while (nr < size) {
+        old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        do {
+            /* Bits below from and from size on are taken as set */
+            free = ~old;
+            if (nr < from) {
+                free &= ~0ULL << (from - nr);
+            }
+            if ((size - nr) < 64) {
+                free &= (1ULL << (size - nr)) - 1;
+            }
+            if (!free) {
+                break;
+            }
+        } while (!__atomic_compare_exchange_n(word, &old, old | (free & -free), 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+        if (free) {
+            return nr + __builtin_ctzll(free);
+        }
+        nr += 64;
+        word++;
+    }
+
+    return -1;
+}
@@ -27,6 +27,9 @@ int mkfs_usage()
     printf("    -f|--file filename     file path to create the kfs on\n");
     printf("    -i|--inode_bg_size     inode group size (default %dM)\n", getm(DEFAULT_IBG_SIZE));
     printf("    -b|--block_bg_size     block group size (default %dM)\n", getm(DEFAULT_BBG_SIZE));
+    printf("    -g|--gdt_blocks        group descriptor table blocks (default %d)\n", KFS_GDT_BLOCKS);
+    printf("    -x|--flex_bgs          bgs sharing a run of bitmaps, 0 or 2-%d (default 0)\n", KFS_FLEX_MAX);
+    printf("    -c|--convert           convert the image to version %d in place\n", KFS_SB_VERSION);
     return 1;
 }
 
@@ -36,12 +39,18 @@ static struct option kfs_mkfs_opts[] = {
     { "file", required_argument, NULL, 'f' },
     { "inode_bg_size", required_argument, NULL, 'i' },
     { "block_bg_size", required_argument, NULL, 'b' },
+    { "gdt_blocks", required_argument, NULL, 'g' },
+    { "flex_bgs", required_argument, NULL, 'x' },
+    { "convert", no_argument, NULL, 'c' },
     { NULL, no_argument, NULL, 0 }
 };
 
 static char file[256];
 static u32 inode_bg_size = DEFAULT_IBG_SIZE;
 static u32 block_bg_size = DEFAULT_BBG_SIZE;
+static u32 gdt_blocks = KFS_GDT_BLOCKS;
+static u32 flex_bgs = 0;
+static int convert = 0;
 static struct kfs fs;
 
 int main(int argc, char **argv)
@@ -71,7 +80,7 @@ int main(int argc, char **argv)
     }
 
     char c;
-    while ((c = getopt_long(argc, argv, "f:i:b:",
+    while ((c = getopt_long(argc, argv, "f:i:b:g:x:c",
                     kfs_mkfs_opts, NULL)) != -1) {
         switch (c) {
             case 'f':
@@ -85,6 +94,15 @@ int main(int argc, char **argv)
                 block_bg_size = atoi(optarg);
                 block_bg_size <<= 20;
                 break;
+            case 'g':
+                gdt_blocks = atoi(optarg);
+                break;
+            case 'x':
+                flex_bgs = atoi(optarg);
+                break;
+            case 'c':
+                convert = 1;
+                break;
             case 'h':
                 mkfs_usage();
                 return 0;
@@ -108,6 +126,11 @@ int main(int argc, char **argv)
     kdebug(LOG_MKFS, "file %s ibg_size %u dbg_size %u\n",
             file, inode_bg_size, block_bg_size);
 
+    if (convert) {
+        kfs_init(&fs);
+        return kfs_convert_fs(&fs, file) ? 1 : 0;
+    }
+
     if ((inode_bg_size < MIN_IBG_SIZE) || (inode_bg_size > MAX_IBG_SIZE)) {
         kerr("Invalid inode block group size\n");
         return 1;
@@ -118,6 +141,16 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (!gdt_blocks) {
+        kerr("Invalid group descriptor table size\n");
+        return 1;
+    }
+
+    if ((flex_bgs == 1) || (flex_bgs > KFS_FLEX_MAX)) {
+        kerr("Invalid flex_bgs\n");
+        return 1;
+    }
+
     kfs_init(&fs);
 
     fs.fd = open(file, O_CREAT|O_EXCL|O_RDWR|O_NOFOLLOW, 0644);
@@ -135,18 +168,26 @@ int main(int argc, char **argv)
     }
 
     /* Generate sb */
-    fs.sb.magic = KFS_SB_MAGIC;
-    fs.sb.version = KFS_SB_VERSION;
-    fs.sb.ibg_size = inode_bg_size;
-    fs.sb.dbg_size = block_bg_size;
-
-    ret = pwrite(fs.fd, &fs.sb, sizeof(fs.sb), 0);
-    if (ret != sizeof(fs.sb)) {
+    fs.sb->magic = KFS_SB_MAGIC;
+    fs.sb->version = KFS_SB_VERSION;
+    fs.sb->ibg_size = inode_bg_size;
+    fs.sb->dbg_size = block_bg_size;
+    fs.sb->flex_bgs = flex_bgs;
+
+    ret = pwrite(fs.fd, fs.sb, sizeof(*fs.sb), 0);
+    if (ret != sizeof(*fs.sb)) {
         kerr("Write superblock failed %s\n",
                 strerror(errno));
         goto err;
     }
     fs.filesize = KFS_SB_SIZE;
+
+    /* Right after the sb, the bgs follow */
+    ret = kfs_create_gdt(&fs, gdt_blocks);
+    if (ret) {
+        kerr("Generate group descriptor table failed\n");
+        goto err;
+    }
     fs.inode_per_bg = kfs_ibg_size(&fs) / KFS_INODE_SIZE;
     fs.block_per_bg = kfs_dbg_size(&fs) / KFS_BLOCK_SIZE;
 
@@ -166,13 +207,13 @@ int main(int argc, char **argv)
     }
 
     kfs_lock_inode(inode);
-    inode->node.uid = KFS_DEFAULT_ROOT_UID;
-    inode->node.gid = KFS_DEFAULT_ROOT_GID;
-    inode->node.mode = KFS_DEFAULT_ROOT_MODE|S_IFDIR;
-    inode->node.nlink = 1;
-    inode->node.btime = time(NULL);
-    inode->node.ctime = inode->node.atime = inode->node.mtime = inode->node.btime;
-    mark_inode_dirty(inode, 1);
+    inode->node->uid = KFS_DEFAULT_ROOT_UID;
+    inode->node->gid = KFS_DEFAULT_ROOT_GID;
+    inode->node->mode = KFS_DEFAULT_ROOT_MODE|S_IFDIR;
+    inode->node->nlink = 1;
+    inode->node->btime = time(NULL);
+    inode->node->ctime = inode->node->atime = inode->node->mtime = inode->node->btime;
+    mark_inode_dirty(inode);
     kfs_unlock_inode(inode);
 
     ret = kfs_sync_fs(&fs);